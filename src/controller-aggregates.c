@@ -0,0 +1,473 @@
+/*
+ * Copyright (C) 2018 "IoT.bzh"
+ * Author Romain Forlot <romain@iot.bzh>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <pthread.h>
+#include <systemd/sd-event.h>
+
+#include "controller-binding.h"
+
+#define AGG_DEFAULT_CAPACITY 1024
+
+typedef enum {
+    AGG_WINDOW_TUMBLING,
+    AGG_WINDOW_SLIDING,
+    AGG_WINDOW_SESSION,
+} CtrlWindowTypeT;
+
+typedef enum {
+    AGG_FUNC_COUNT = 1 << 0,
+    AGG_FUNC_SUM = 1 << 1,
+    AGG_FUNC_AVG = 1 << 2,
+    AGG_FUNC_MIN = 1 << 3,
+    AGG_FUNC_MAX = 1 << 4,
+    AGG_FUNC_RATE = 1 << 5,
+} CtrlAggFunctionT;
+
+static const char *AggFunctionsNames[] = { "count", "sum", "avg", "min", "max", "rate", NULL };
+static const char *AggWindowsNames[] = { "tumbling", "sliding", "session", NULL };
+
+typedef struct {
+    uint64_t ts;
+    double value;
+} CtrlSampleT;
+
+/*
+ * Sliding windows keep their samples in a ring indexed by sequence number,
+ * plus two monotonic deques of sequence numbers giving min and max in O(1)
+ * amortized. Tumbling and session windows only need running accumulators.
+ */
+typedef struct {
+    const char *uid;
+    char **path;
+    int depth;
+    CtrlWindowTypeT type;
+    uint64_t duration;
+    int functions;
+    uint64_t count;
+    double sum;
+    double min;
+    double max;
+    uint64_t first;
+    uint64_t last;
+    CtrlSampleT *ring;
+    uint64_t *minq;
+    uint64_t *maxq;
+    int capacity;
+    uint64_t seq;
+    uint64_t size;
+    uint64_t minHead, minTail;
+    uint64_t maxHead, maxTail;
+    json_object *closedJ;
+    afb_event_t event;
+    uint64_t interval;
+    uint64_t lastPublish;
+    afb_api_t api;
+    sd_event_source *timer;
+    pthread_mutex_t lock;
+} CtrlAggregateT;
+
+static CtrlInternT CtrlAggEvents = { 0 };
+static int *CtrlAggEventOf = NULL;
+static CtrlAggregateT *CtrlAggregates = NULL;
+static int CtrlAggregatesCount = 0;
+static int *CtrlAggIndex = NULL;
+static CtrlAggregateT **CtrlAggRefs = NULL;
+
+static int AggNameIndex(const char **names, const char *name)
+{
+    for (int idx = 0; names[idx]; idx++) {
+        if (!strcasecmp(names[idx], name))
+            return idx;
+    }
+
+    return -1;
+}
+
+#define RING(agg, seq) (agg)->ring[(seq) % (uint64_t) (agg)->capacity]
+
+static void AggSlidingEvict(CtrlAggregateT *agg, uint64_t now, int room)
+{
+    uint64_t oldest;
+
+    while (agg->size && ((room && agg->size == (uint64_t) agg->capacity) ||
+                         now - RING(agg, agg->seq - agg->size).ts > agg->duration)) {
+        oldest = agg->seq - agg->size;
+        agg->sum -= RING(agg, oldest).value;
+        if (agg->minHead != agg->minTail && agg->minq[agg->minHead % agg->capacity] == oldest)
+            agg->minHead++;
+        if (agg->maxHead != agg->maxTail && agg->maxq[agg->maxHead % agg->capacity] == oldest)
+            agg->maxHead++;
+        agg->size--;
+    }
+
+    agg->count = agg->size;
+    if (agg->size) {
+        agg->min = RING(agg, agg->minq[agg->minHead % agg->capacity]).value;
+        agg->max = RING(agg, agg->maxq[agg->maxHead % agg->capacity]).value;
+        agg->first = RING(agg, agg->seq - agg->size).ts;
+    }
+}
+
+static void AggSlidingPush(CtrlAggregateT *agg, uint64_t now, double value)
+{
+    AggSlidingEvict(agg, now, 1);
+
+    RING(agg, agg->seq).ts = now;
+    RING(agg, agg->seq).value = value;
+    agg->sum += value;
+
+    while (agg->minHead != agg->minTail && RING(agg, agg->minq[(agg->minTail - 1) % agg->capacity]).value >= value)
+        agg->minTail--;
+    agg->minq[agg->minTail++ % agg->capacity] = agg->seq;
+
+    while (agg->maxHead != agg->maxTail && RING(agg, agg->maxq[(agg->maxTail - 1) % agg->capacity]).value <= value)
+        agg->maxTail--;
+    agg->maxq[agg->maxTail++ % agg->capacity] = agg->seq;
+
+    agg->seq++;
+    agg->size++;
+    agg->last = now;
+    AggSlidingEvict(agg, now, 0);
+}
+
+static void AggAccumulate(CtrlAggregateT *agg, uint64_t now, double value)
+{
+    if (!agg->count) {
+        agg->min = agg->max = value;
+        agg->first = now;
+    }
+    else {
+        if (value < agg->min)
+            agg->min = value;
+        if (value > agg->max)
+            agg->max = value;
+    }
+
+    agg->count++;
+    agg->sum += value;
+    agg->last = now;
+}
+
+static void AggReset(CtrlAggregateT *agg)
+{
+    agg->count = 0;
+    agg->sum = agg->min = agg->max = 0;
+}
+
+static json_object *AggResult(CtrlAggregateT *agg, uint64_t span)
+{
+    json_object *resultJ = json_object_new_object();
+
+    json_object_object_add(resultJ, "uid", json_object_new_string(agg->uid));
+    if (agg->functions & AGG_FUNC_COUNT)
+        json_object_object_add(resultJ, "count", json_object_new_int64((int64_t) agg->count));
+    if (agg->functions & AGG_FUNC_SUM)
+        json_object_object_add(resultJ, "sum", json_object_new_double(agg->sum));
+    if (agg->functions & AGG_FUNC_AVG)
+        json_object_object_add(resultJ, "avg", agg->count ? json_object_new_double(agg->sum / (double) agg->count) : NULL);
+    if (agg->functions & AGG_FUNC_MIN)
+        json_object_object_add(resultJ, "min", agg->count ? json_object_new_double(agg->min) : NULL);
+    if (agg->functions & AGG_FUNC_MAX)
+        json_object_object_add(resultJ, "max", agg->count ? json_object_new_double(agg->max) : NULL);
+    if (agg->functions & AGG_FUNC_RATE)
+        json_object_object_add(resultJ, "rate", json_object_new_double(span ? (double) agg->count * 1000000.0 / (double) span : 0));
+
+    return resultJ;
+}
+
+/* Close a tumbling or session window, called with the lock held */
+static json_object *AggClose(CtrlAggregateT *agg)
+{
+    uint64_t span = agg->type == AGG_WINDOW_TUMBLING ? agg->duration : agg->last - agg->first;
+
+    json_object_put(agg->closedJ);
+    agg->closedJ = AggResult(agg, span);
+    AggReset(agg);
+
+    return agg->event ? json_object_get(agg->closedJ) : NULL;
+}
+
+static int AggTimerCB(sd_event_source *source, uint64_t usec, void *userdata)
+{
+    CtrlAggregateT *agg = (CtrlAggregateT *) userdata;
+    json_object *publishJ = NULL;
+
+    pthread_mutex_lock(&agg->lock);
+    if (agg->type == AGG_WINDOW_TUMBLING) {
+        publishJ = AggClose(agg);
+        sd_event_source_set_time(agg->timer, usec + agg->duration);
+        sd_event_source_set_enabled(agg->timer, SD_EVENT_ONESHOT);
+    }
+    else if (agg->count) {
+        /* Session: a sample may have extended the gap since the timer was set */
+        if (CtrlNowUsec() - agg->last >= agg->duration) {
+            publishJ = AggClose(agg);
+        }
+        else {
+            sd_event_source_set_time(agg->timer, agg->last + agg->duration);
+            sd_event_source_set_enabled(agg->timer, SD_EVENT_ONESHOT);
+        }
+    }
+    pthread_mutex_unlock(&agg->lock);
+
+    if (publishJ)
+        afb_event_push(agg->event, publishJ);
+
+    return 0;
+}
+
+static void AggregateSample(CtrlAggregateT *agg, json_object *eventJ)
+{
+    json_object *valueJ = CtrlJsonPathGet(eventJ, agg->path, agg->depth), *publishJ = NULL;
+    uint64_t now;
+    double value;
+
+    if (!valueJ || (!json_object_is_type(valueJ, json_type_int) &&
+                    !json_object_is_type(valueJ, json_type_double)))
+        return;
+
+    value = json_object_get_double(valueJ);
+    now = CtrlNowUsec();
+
+    pthread_mutex_lock(&agg->lock);
+    switch (agg->type) {
+        case AGG_WINDOW_SLIDING:
+            AggSlidingPush(agg, now, value);
+            if (agg->event && now - agg->lastPublish >= CtrlShedStretch(agg->interval)) {
+                agg->lastPublish = now;
+                publishJ = AggResult(agg, agg->duration);
+            }
+            break;
+
+        case AGG_WINDOW_SESSION:
+            if (agg->count && now - agg->last >= agg->duration)
+                publishJ = AggClose(agg);
+            if (!agg->count && agg->timer)
+                CtrlTimerArm(agg->api, agg->timer, now + agg->duration);
+            AggAccumulate(agg, now, value);
+            break;
+
+        default:
+            AggAccumulate(agg, now, value);
+            break;
+    }
+    pthread_mutex_unlock(&agg->lock);
+
+    if (publishJ)
+        afb_event_push(agg->event, publishJ);
+}
+
+/**
+ * @brief Feed an event received by the controller API to the aggregates
+ * computed on it.
+ *
+ * @param api the controller API handle.
+ * @param evtLabel the event label, ie: "api/event".
+ * @param eventJ the event payload.
+ */
+void CtrlAggregatesDispatch(afb_api_t api, const char *evtLabel, json_object *eventJ)
+{
+    int event = CtrlInternFind(&CtrlAggEvents, evtLabel);
+
+    if (event < 0)
+        return;
+
+    for (int idx = CtrlAggIndex[event]; idx < CtrlAggIndex[event + 1]; idx++)
+        AggregateSample(CtrlAggRefs[idx], eventJ);
+}
+
+/**
+ * @brief Verb returning the aggregates values, or the one given by
+ * { "uid": "name" }. Sliding windows give their current values, tumbling and
+ * session windows their last closed window.
+ *
+ * @param request AFB request with the JSON arguments if the request got some.
+ */
+void CtrlAggregatesRequest(afb_req_t request)
+{
+    const char *uid = NULL;
+    json_object *resultsJ;
+
+    wrap_json_unpack(afb_req_json(request), "{s?s}", "uid", &uid);
+
+    resultsJ = json_object_new_object();
+    for (int idx = 0; idx < CtrlAggregatesCount; idx++) {
+        CtrlAggregateT *agg = &CtrlAggregates[idx];
+        if (uid && strcmp(uid, agg->uid))
+            continue;
+
+        pthread_mutex_lock(&agg->lock);
+        if (agg->type == AGG_WINDOW_SLIDING) {
+            AggSlidingEvict(agg, CtrlNowUsec(), 0);
+            json_object_object_add(resultsJ, agg->uid, AggResult(agg, agg->duration));
+        }
+        else {
+            json_object_object_add(resultsJ, agg->uid, json_object_get(agg->closedJ));
+        }
+        pthread_mutex_unlock(&agg->lock);
+    }
+
+    if (uid && !json_object_object_length(resultsJ)) {
+        json_object_put(resultsJ);
+        AFB_ReqFailF(request, "unknown-aggregate", "No aggregate '%s'", uid);
+        return;
+    }
+
+    AFB_ReqSuccess(request, resultsJ, NULL);
+}
+
+static int AggregateLoadOne(afb_api_t api, CtrlAggregateT *agg, json_object *aggJ, int *event)
+{
+    json_object *functionsJ = NULL;
+    const char *label = NULL, *field = NULL, *window = NULL, *publish = NULL;
+    int idx, func, duration = 0, capacity = AGG_DEFAULT_CAPACITY, interval = 0;
+
+    if (wrap_json_unpack(aggJ, "{ss,ss,ss,ss,si,so,s?i,s?s,s?i}",
+            "uid", &agg->uid,
+            "event", &label,
+            "field", &field,
+            "window", &window,
+            "duration", &duration,
+            "functions", &functionsJ,
+            "capacity", &capacity,
+            "publish", &publish,
+            "interval", &interval) || duration <= 0 || capacity <= 0) {
+        AFB_API_ERROR(api, "AggregateLoadOne: aggregate needs 'uid', 'event', 'field', 'window', a positive 'duration' and 'functions': %s",
+            json_object_to_json_string(aggJ));
+        return ERROR;
+    }
+
+    agg->type = (CtrlWindowTypeT) AggNameIndex(AggWindowsNames, window);
+    if ((int) agg->type < 0) {
+        AFB_API_ERROR(api, "AggregateLoadOne: aggregate '%s' unknown window type '%s'", agg->uid, window);
+        return ERROR;
+    }
+
+    if (json_object_is_type(functionsJ, json_type_string)) {
+        func = AggNameIndex(AggFunctionsNames, json_object_get_string(functionsJ));
+        agg->functions = func < 0 ? 0 : 1 << func;
+    }
+    else {
+        for (idx = 0; idx < (int) json_object_array_length(functionsJ); idx++) {
+            func = AggNameIndex(AggFunctionsNames, json_object_get_string(json_object_array_get_idx(functionsJ, idx)));
+            if (func < 0) {
+                agg->functions = 0;
+                break;
+            }
+            agg->functions |= 1 << func;
+        }
+    }
+    if (!agg->functions) {
+        AFB_API_ERROR(api, "AggregateLoadOne: aggregate '%s' invalid functions %s", agg->uid,
+            json_object_to_json_string(functionsJ));
+        return ERROR;
+    }
+
+    agg->api = api;
+    agg->duration = (uint64_t) duration * 1000;
+    agg->interval = (uint64_t) interval * 1000;
+    agg->path = CtrlJsonPathCompile(field, &agg->depth);
+    pthread_mutex_init(&agg->lock, NULL);
+
+    if (agg->type == AGG_WINDOW_SLIDING) {
+        agg->capacity = capacity;
+        agg->ring = calloc(capacity, sizeof(CtrlSampleT));
+        agg->minq = calloc(capacity, sizeof(uint64_t));
+        agg->maxq = calloc(capacity, sizeof(uint64_t));
+    }
+
+    if (publish)
+        agg->event = CtrlEventGet(api, publish);
+
+    *event = CtrlInternAdd(&CtrlAggEvents, label);
+    return 0;
+}
+
+/* Build the index: event id -> range of aggregates computed on it */
+static void AggregatesCompile(void)
+{
+    int idx, event, *fill;
+
+    CtrlAggIndex = calloc(CtrlAggEvents.count + 1, sizeof(int));
+    for (idx = 0; idx < CtrlAggregatesCount; idx++)
+        CtrlAggIndex[CtrlAggEventOf[idx] + 1]++;
+
+    for (event = 0; event < CtrlAggEvents.count; event++)
+        CtrlAggIndex[event + 1] += CtrlAggIndex[event];
+
+    CtrlAggRefs = calloc(CtrlAggregatesCount + 1, sizeof(CtrlAggregateT *));
+    fill = calloc(CtrlAggEvents.count, sizeof(int));
+    for (idx = 0; idx < CtrlAggregatesCount; idx++) {
+        event = CtrlAggEventOf[idx];
+        CtrlAggRefs[CtrlAggIndex[event] + fill[event]++] = &CtrlAggregates[idx];
+    }
+    free(fill);
+}
+
+/**
+ * @brief Controller's 'aggregates' section loader. Each aggregate computes
+ * functions of an event's numeric field over a tumbling, sliding or session
+ * window, incrementally on every sample.
+ *
+ * @param api the API handle being set up.
+ * @param section the section definition.
+ * @param aggregatesJ the JSON section, NULL when called at init time.
+ * @return int 0 if OK, other if not.
+ */
+int CtrlAggregatesConfig(afb_api_t api, CtlSectionT *section, json_object *aggregatesJ)
+{
+    int idx, errcount = 0;
+
+    /* Tumbling and session windows are closed by timers on the binder's loop */
+    if (!aggregatesJ) {
+        for (idx = 0; idx < CtrlAggregatesCount; idx++) {
+            CtrlAggregateT *agg = &CtrlAggregates[idx];
+            if (agg->type == AGG_WINDOW_SLIDING)
+                continue;
+            if (sd_event_add_time(afb_api_get_event_loop(api), &agg->timer, CLOCK_MONOTONIC,
+                                  CtrlNowUsec() + agg->duration, 1000, AggTimerCB, agg) < 0) {
+                AFB_API_ERROR(api, "CtrlAggregatesConfig: fail to create window timer of aggregate '%s'", agg->uid);
+                errcount++;
+                continue;
+            }
+            if (agg->type == AGG_WINDOW_SESSION)
+                sd_event_source_set_enabled(agg->timer, SD_EVENT_OFF);
+        }
+        return errcount;
+    }
+
+    if (!json_object_is_type(aggregatesJ, json_type_array)) {
+        AFB_API_ERROR(api, "CtrlAggregatesConfig: 'aggregates' section must be an array");
+        return ERROR;
+    }
+
+    CtrlAggregatesCount = (int) json_object_array_length(aggregatesJ);
+    CtrlAggregates = calloc(CtrlAggregatesCount, sizeof(CtrlAggregateT));
+    CtrlAggEventOf = calloc(CtrlAggregatesCount, sizeof(int));
+    for (idx = 0; idx < CtrlAggregatesCount; idx++)
+        errcount += AggregateLoadOne(api, &CtrlAggregates[idx], json_object_array_get_idx(aggregatesJ, idx), &CtrlAggEventOf[idx]);
+
+    if (!errcount)
+        AggregatesCompile();
+
+    return errcount;
+}
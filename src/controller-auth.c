@@ -0,0 +1,419 @@
+/*
+ * Copyright (C) 2018 "IoT.bzh"
+ * Author Romain Forlot <romain@iot.bzh>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/types.h>
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/sha.h>
+
+#include "controller-binding.h"
+
+#define AUTH_DEFAULT_CACHE 256
+#define AUTH_DEFAULT_TTL 300
+#define AUTH_MAX_TOKEN 4096
+#define AUTH_MAX_SIGNATURE 64
+#define AUTH_ED25519_KEY 32
+
+/*
+ * Tokens are JWT signed with HMAC-SHA256 ("HS256") or Ed25519 ("EdDSA"):
+ * base64url(header) "." base64url(claims) "." base64url(signature)
+ * The header "kid" selects the key, claims give "loa" (default 1), and
+ * optional "sub", "exp" and "nbf" (seconds since epoch). Signatures are
+ * checked by libcrypto.
+ */
+
+typedef struct {
+    const char *kid;
+    const char *alg;
+    unsigned char *secret;
+    size_t len;
+    EVP_PKEY *pkey;
+} CtrlAuthKeyT;
+
+/* Verified tokens cache, direct mapped on the token digest */
+typedef struct {
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+    time_t expire;
+    unsigned loa;
+    char *sub;
+} CtrlAuthCacheT;
+
+/* Attached to the client session once authenticated */
+static CtrlAuthKeyT *CtrlAuthKeys = NULL;
+static int CtrlAuthKeysCount = 0;
+static CtrlAuthCacheT *CtrlAuthCache = NULL;
+static int CtrlAuthCacheSize = 0;
+static int CtrlAuthTtl = AUTH_DEFAULT_TTL;
+static pthread_mutex_t CtrlAuthLock = PTHREAD_MUTEX_INITIALIZER;
+
+static json_object *Base64UrlDecodeJson(const char *in, size_t len)
+{
+    unsigned char decoded[AUTH_MAX_TOKEN + 1];
+    ssize_t count = CtrlBase64Decode(in, len, decoded, AUTH_MAX_TOKEN);
+
+    if (count < 0)
+        return NULL;
+
+    decoded[count] = '\0';
+    return json_tokener_parse((const char *) decoded);
+}
+
+/*
+ * A token naming a 'kid' needs the key declaring that exact 'kid', one naming
+ * none the only key, declaring none either. The key also fixes the algorithm.
+ */
+static CtrlAuthKeyT *AuthKeyFind(const char *kid, const char *alg)
+{
+    CtrlAuthKeyT *key;
+
+    for (int idx = 0; idx < CtrlAuthKeysCount; idx++) {
+        key = &CtrlAuthKeys[idx];
+        if (kid ? key->kid && !strcmp(kid, key->kid) : !key->kid)
+            return strcmp(alg, key->alg) ? NULL : key;
+    }
+
+    return NULL;
+}
+
+static int AuthSignatureValid(CtrlAuthKeyT *key, const char *data, size_t len, const unsigned char *signature,
+                              size_t sigLen)
+{
+    unsigned char mac[EVP_MAX_MD_SIZE];
+    unsigned macLen = 0;
+    EVP_MD_CTX *ctx;
+    int valid;
+
+    if (!key->pkey)
+        return HMAC(EVP_sha256(), key->secret, (int) key->len, (const unsigned char *) data, len, mac, &macLen) &&
+               macLen == sigLen && !CRYPTO_memcmp(mac, signature, macLen);
+
+    ctx = EVP_MD_CTX_new();
+    valid = ctx && EVP_DigestVerifyInit(ctx, NULL, NULL, NULL, key->pkey) == 1 &&
+            EVP_DigestVerify(ctx, signature, sigLen, (const unsigned char *) data, len) == 1;
+    EVP_MD_CTX_free(ctx);
+
+    return valid;
+}
+
+/* Full token verification, return 0 and fill the claims if the token is valid */
+static int AuthVerify(const char *token, unsigned *loa, time_t *expire, const char **sub, json_object **claimsJ)
+{
+    const char *payload, *signature, *alg = NULL, *kid = NULL;
+    unsigned char provided[AUTH_MAX_SIGNATURE + 3];
+    json_object *headerJ;
+    CtrlAuthKeyT *key = NULL;
+    ssize_t sigLen = -1;
+    int64_t exp = 0, nbf = 0;
+    int claimedLoa = 1, valid;
+    time_t now = time(NULL);
+
+    payload = strchr(token, '.');
+    signature = payload ? strchr(payload + 1, '.') : NULL;
+    if (!signature)
+        return ERROR;
+
+    headerJ = Base64UrlDecodeJson(token, (size_t) (payload - token));
+    if (headerJ && !wrap_json_unpack(headerJ, "{ss,s?s}", "alg", &alg, "kid", &kid))
+        key = AuthKeyFind(kid, alg);
+    if (key)
+        sigLen = CtrlBase64Decode(signature + 1, strlen(signature + 1), provided, sizeof(provided));
+    valid = sigLen > 0 && AuthSignatureValid(key, token, (size_t) (signature - token), provided, (size_t) sigLen);
+    json_object_put(headerJ);
+    if (!valid)
+        return ERROR;
+
+    *claimsJ = Base64UrlDecodeJson(payload + 1, (size_t) (signature - payload - 1));
+    if (!*claimsJ ||
+        wrap_json_unpack(*claimsJ, "{s?i,s?s,s?I,s?I}", "loa", &claimedLoa, "sub", sub, "exp", &exp, "nbf", &nbf) ||
+        claimedLoa < 0 || (exp && exp <= now) || (nbf && nbf > now)) {
+        json_object_put(*claimsJ);
+        *claimsJ = NULL;
+        return ERROR;
+    }
+
+    *loa = (unsigned) claimedLoa;
+    *expire = exp ? (time_t) exp : now + CtrlAuthTtl;
+    return 0;
+}
+
+/**
+ * @brief Verify a token and raise the session LOA to its claimed level. A
+ * verified token is cached until it expires or for the cache TTL, whichever
+ * comes first, so that only a digest and a constant-time comparison are
+ * needed when it is presented again. A claimed LOA the binder refuses fails
+ * the request.
+ *
+ * @param request AFB request with the JSON arguments: { "token": "jwt" }
+ */
+void CtrlAuthRequest(afb_req_t request)
+{
+    const char *token = NULL, *sub = NULL;
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+    json_object *claimsJ = NULL, *responseJ = NULL;
+    CtrlAuthCacheT *entry;
+    CtrlSessionT *session;
+    unsigned loa = 0;
+    time_t expire = 0, now = time(NULL);
+    uint32_t slot;
+    int hit = 0;
+
+    if (wrap_json_unpack(afb_req_json(request), "{ss}", "token", &token) || strlen(token) > AUTH_MAX_TOKEN) {
+        AFB_ReqFail(request, "invalid-args", "Expecting { \"token\": \"...\" }");
+        return;
+    }
+
+    SHA256((const unsigned char *) token, strlen(token), digest);
+    memcpy(&slot, digest, sizeof(slot));
+    entry = &CtrlAuthCache[slot % (uint32_t) CtrlAuthCacheSize];
+
+    pthread_mutex_lock(&CtrlAuthLock);
+    if (entry->expire > now && !CRYPTO_memcmp(entry->digest, digest, SHA256_DIGEST_LENGTH)) {
+        hit = 1;
+        loa = entry->loa;
+        expire = entry->expire;
+        wrap_json_pack(&responseJ, "{si,sI,s?s}", "loa", (int) loa, "exp", (int64_t) expire, "sub", entry->sub);
+    }
+    pthread_mutex_unlock(&CtrlAuthLock);
+
+    if (!hit) {
+        if (AuthVerify(token, &loa, &expire, &sub, &claimsJ)) {
+            AFB_ReqFail(request, "unauthorized", "Invalid or expired token");
+            return;
+        }
+
+        wrap_json_pack(&responseJ, "{si,sI,s?s}", "loa", (int) loa, "exp", (int64_t) expire, "sub", sub);
+
+        pthread_mutex_lock(&CtrlAuthLock);
+        memcpy(entry->digest, digest, SHA256_DIGEST_LENGTH);
+        entry->loa = loa;
+        entry->expire = expire < now + CtrlAuthTtl ? expire : now + CtrlAuthTtl;
+        free(entry->sub);
+        entry->sub = sub ? strdup(sub) : NULL;
+        pthread_mutex_unlock(&CtrlAuthLock);
+        json_object_put(claimsJ);
+    }
+
+    session = CtrlSessionGet(request, 1);
+    if (!session) {
+        json_object_put(responseJ);
+        AFB_ReqFail(request, "internal-error", "Fail to attach the session state");
+        return;
+    }
+
+    if (afb_req_set_LOA(request, loa) < 0) {
+        json_object_put(responseJ);
+        AFB_ReqFailF(request, "unauthorized", "Token LOA %u refused by the binder", loa);
+        return;
+    }
+
+    session->expire = expire;
+    session->loa = loa;
+    CtrlRouterAuthReply(request, responseJ);
+}
+
+/**
+ * @brief Check that the session authentication of a request to a protected
+ * control did not expire. The LOA itself is checked by the binder from the
+ * control's verb auth.
+ *
+ * @param request the request to check.
+ * @return int 0 if OK, other if the session must authenticate again.
+ */
+int CtrlAuthCheck(afb_req_t request)
+{
+    CtrlSessionT *session;
+
+    if (!CtrlAuthKeysCount)
+        return 0;
+
+    session = CtrlSessionGet(request, 0);
+    if (session && session->expire > time(NULL))
+        return 0;
+
+    afb_req_set_LOA(request, 0);
+    return ERROR;
+}
+
+/**
+ * @brief Build the verb auth of a control from its LOA level and privileges.
+ *
+ * @param loa the LOA level required, 0 for none.
+ * @param privileges the permission required, NULL for none.
+ * @return const struct afb_auth* the auth to give afb_api_add_verb, NULL if the
+ * control is not protected.
+ */
+const struct afb_auth *CtrlAuthMake(int loa, const char *privileges)
+{
+    struct afb_auth *auths;
+
+    if (loa <= 0 && !privileges)
+        return NULL;
+
+    /* afb_auth members are const, build them from initialized templates */
+    auths = calloc(3, sizeof(struct afb_auth));
+    {
+        struct afb_auth loaAuth = { .type = afb_auth_LOA, .loa = (unsigned) loa };
+        struct afb_auth permAuth = { .type = afb_auth_Permission, .text = privileges };
+        struct afb_auth andAuth = { .type = afb_auth_And, .first = &auths[1], .next = &auths[2] };
+
+        if (loa > 0 && privileges) {
+            memcpy(&auths[0], &andAuth, sizeof(andAuth));
+            memcpy(&auths[1], &loaAuth, sizeof(loaAuth));
+            memcpy(&auths[2], &permAuth, sizeof(permAuth));
+        }
+        else {
+            memcpy(&auths[0], loa > 0 ? &loaAuth : &permAuth, sizeof(struct afb_auth));
+        }
+    }
+
+    return auths;
+}
+
+static unsigned char *AuthDecodeKey(const char *text, size_t *len)
+{
+    unsigned char *raw = malloc(strlen(text) + 1);
+    ssize_t count = CtrlBase64Decode(text, strlen(text), raw, strlen(text));
+
+    if (count <= 0) {
+        free(raw);
+        return NULL;
+    }
+
+    *len = (size_t) count;
+    return raw;
+}
+
+/* { "kid": "id", "secret": "base64url" } or { "kid": "id", "crv": "Ed25519", "x": "base64url" } */
+static int AuthLoadKey(afb_api_t api, CtrlAuthKeyT *key, json_object *keyJ)
+{
+    const char *kid = NULL, *secret = NULL, *crv = NULL, *x = NULL;
+    unsigned char *raw;
+    size_t len = 0;
+
+    if (wrap_json_unpack(keyJ, "{s?s,s?s,s?s,s?s}", "kid", &kid, "secret", &secret, "crv", &crv, "x", &x) ||
+        !secret == !x || (x && (!crv || strcmp(crv, "Ed25519")))) {
+        AFB_API_ERROR(api, "AuthLoadKey: key needs a 'secret' or an Ed25519 'x': %s", json_object_to_json_string(keyJ));
+        return ERROR;
+    }
+
+    key->kid = kid ? strdup(kid) : NULL;
+    if (secret) {
+        key->alg = "HS256";
+        key->secret = AuthDecodeKey(secret, &key->len);
+        if (!key->secret) {
+            AFB_API_ERROR(api, "AuthLoadKey: key '%s' secret is not base64url", kid ? kid : "");
+            return ERROR;
+        }
+        return 0;
+    }
+
+    key->alg = "EdDSA";
+    raw = AuthDecodeKey(x, &len);
+    if (raw && len == AUTH_ED25519_KEY)
+        key->pkey = EVP_PKEY_new_raw_public_key(EVP_PKEY_ED25519, NULL, raw, len);
+    free(raw);
+    if (!key->pkey) {
+        AFB_API_ERROR(api, "AuthLoadKey: key '%s' is not a base64url Ed25519 public key", kid ? kid : "");
+        return ERROR;
+    }
+
+    return 0;
+}
+
+static int AuthLoadKeys(afb_api_t api, const char *keyfile)
+{
+    json_object *keysJ, *listJ = NULL;
+    int idx, other, count;
+
+    keysJ = json_object_from_file(keyfile);
+    if (!keysJ || wrap_json_unpack(keysJ, "{so}", "keys", &listJ) || !json_object_is_type(listJ, json_type_array)) {
+        AFB_API_ERROR(api, "AuthLoadKeys: '%s' must hold { \"keys\": [ { \"kid\": \"id\", \"secret\": \"base64url\" } ] }", keyfile);
+        json_object_put(keysJ);
+        return ERROR;
+    }
+
+    count = (int) json_object_array_length(listJ);
+    CtrlAuthKeys = calloc(count, sizeof(CtrlAuthKeyT));
+    for (idx = 0; idx < count; idx++) {
+        if (AuthLoadKey(api, &CtrlAuthKeys[idx], json_object_array_get_idx(listJ, idx))) {
+            json_object_put(keysJ);
+            return ERROR;
+        }
+    }
+
+    /* tokens select their key by 'kid', each key needs its own once there are several */
+    for (idx = 0; count > 1 && idx < count; idx++) {
+        for (other = 0; CtrlAuthKeys[idx].kid && other < idx; other++) {
+            if (!strcmp(CtrlAuthKeys[idx].kid, CtrlAuthKeys[other].kid))
+                break;
+        }
+        if (!CtrlAuthKeys[idx].kid || other < idx) {
+            AFB_API_ERROR(api, "AuthLoadKeys: keys of '%s' need distinct 'kid'", keyfile);
+            json_object_put(keysJ);
+            return ERROR;
+        }
+    }
+    CtrlAuthKeysCount = count;
+
+    json_object_put(keysJ);
+    return 0;
+}
+
+/**
+ * @brief Controller's 'auth' section loader:
+ * { "keyfile": "/path/keys.json", "cache": 256, "ttl": 300 }
+ * Without this section the 'auth' verb keeps granting LOA 1 to anyone.
+ *
+ * @param api the API handle being set up.
+ * @param section the section definition.
+ * @param authJ the JSON section, NULL when called at init time.
+ * @return int 0 if OK, other if not.
+ */
+int CtrlAuthConfig(afb_api_t api, CtlSectionT *section, json_object *authJ)
+{
+    const char *keyfile = NULL;
+    int cache = AUTH_DEFAULT_CACHE;
+
+    if (!authJ)
+        return 0;
+
+    if (wrap_json_unpack(authJ, "{ss,s?i,s?i}", "keyfile", &keyfile, "cache", &cache, "ttl", &CtrlAuthTtl) ||
+        cache <= 0 || CtrlAuthTtl <= 0) {
+        AFB_API_ERROR(api, "CtrlAuthConfig: invalid 'auth' section %s", json_object_to_json_string(authJ));
+        return ERROR;
+    }
+
+    CtrlAuthCacheSize = cache;
+    CtrlAuthCache = calloc(cache, sizeof(CtrlAuthCacheT));
+
+    return AuthLoadKeys(api, keyfile);
+}
+
+/**
+ * @brief Whether an 'auth' section configured token verification.
+ */
+int CtrlAuthEnabled(void)
+{
+    return CtrlAuthKeysCount > 0;
+}
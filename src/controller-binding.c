@@ -28,15 +28,52 @@
  * Controller's sections definition. A section map a JSON section key to a
  * callback in charge of loading and processing the JSON object. Default defined
  * callbacks available:
+ * - CtrlImageConfig: read-only strings image shared by the controller
+ *   processes, mapped before the other sections load
  * - PluginConfig: to load controller C or LUA plugins
  * - OnloadConfig: Controller's actions to take at when loading
- * - ControlConfig: declare controller's action which will be add as API's verbs
- * - EventConfig: map event received to a controller's action
+ * - CtrlThreadsConfig: CPU placement and scheduling of the controller's
+ *   threads, optional isolated events dispatch thread
+ * - CtrlAuthConfig: keys to verify the tokens given to the 'auth' verb
+ * - CtrlRouterConfig: router mode forwarding controls to worker processes
+ * - CtrlBreakersConfig: circuit breakers and retry budgets of the APIs
+ *   called by controls
+ * - CtrlSlowLogConfig: flight recorder of the slow control calls
+ * - CtrlShedConfig: overload monitor shedding load as the loop lags
+ * - CtrlCompressConfig: compression of the large control responses
+ * - CtrlBlobsConfig: large binary results handed to local clients as memfds
+ * - CtrlControlConfig: declare controller's action which will be add as API's
+ *   verbs, or static responses and templated events
+ * - CtrlEventsConfig: map event received to a controller's action, optionally
+ *   run on ordered worker lanes partitioned by a key
+ * - CtrlStateMachineConfig: table driven state machines triggered by events
+ *   or controls
+ * - CtrlRulesConfig: event-to-action rules matched incrementally
+ * - CtrlAggregatesConfig: streaming window aggregations of events fields
+ * - CtrlSourcesConfig: file descriptors watched as events sources
+ * - CtrlSinksConfig: batched asynchronous events recording outputs
+ * - CtrlDepsConfig: APIs called by the controller, resolved concurrently at
+ *   init before the onload actions
  */
 static CtlSectionT ctrlSections[] = {
+    { .key = "image", .loadCB = CtrlImageConfig },
     { .key = "plugins", .loadCB = PluginConfig },
-    { .key = "controls", .loadCB = ControlConfig },
-    { .key = "events", .loadCB = EventConfig },
+    { .key = "threads", .loadCB = CtrlThreadsConfig },
+    { .key = "auth", .loadCB = CtrlAuthConfig },
+    { .key = "router", .loadCB = CtrlRouterConfig },
+    { .key = "breakers", .loadCB = CtrlBreakersConfig },
+    { .key = "slowlog", .loadCB = CtrlSlowLogConfig },
+    { .key = "shedding", .loadCB = CtrlShedConfig },
+    { .key = "compression", .loadCB = CtrlCompressConfig },
+    { .key = "blobs", .loadCB = CtrlBlobsConfig },
+    { .key = "controls", .loadCB = CtrlControlConfig },
+    { .key = "events", .loadCB = CtrlEventsConfig },
+    { .key = "statemachines", .loadCB = CtrlStateMachineConfig },
+    { .key = "rules", .loadCB = CtrlRulesConfig },
+    { .key = "aggregates", .loadCB = CtrlAggregatesConfig },
+    { .key = "sources", .loadCB = CtrlSourcesConfig },
+    { .key = "sinks", .loadCB = CtrlSinksConfig },
+    { .key = "dependencies", .loadCB = CtrlDepsConfig },
     { .key = "onload", .loadCB = OnloadConfig },
     { .key = NULL }
 };
@@ -58,20 +95,80 @@ static void ctrlapi_ping(afb_req_t request)
 }
 
 /**
- * @brief Authenticate session to raise Level Of Assurance of the session
+ * @brief Authenticate session to raise Level Of Assurance of the session. When
+ * an 'auth' section is configured the session must present a valid token,
+ * otherwise any session is granted LOA 1.
  *
  * @param request AFB request with the JSON arguments if the request got some.
  */
 void ctrlapi_auth(afb_req_t request)
 {
+    if (CtrlAuthEnabled()) {
+        CtrlAuthRequest(request);
+        return;
+    }
+
     AFB_ReqSetLOA(request, 1);
+    CtrlRouterAuthReply(request, NULL);
+}
+
+/**
+ * @brief Subscribe or unsubscribe the client to an event published by the
+ * controller.
+ *
+ * @param request AFB request with the JSON arguments: { "event": "name" }
+ * @param subscribe 1 to subscribe, 0 to unsubscribe.
+ */
+static void ctrlapi_subscription(afb_req_t request, int subscribe)
+{
+    const char *name = NULL;
+    afb_event_t event;
+
+    if (wrap_json_unpack(afb_req_json(request), "{ss}", "event", &name)) {
+        AFB_ReqFail(request, "invalid-args", "Expecting { \"event\": \"name\" }");
+        return;
+    }
+
+    event = CtrlEventGet(NULL, name);
+    if (!event) {
+        AFB_ReqFailF(request, "unknown-event", "No event '%s' published by this controller", name);
+        return;
+    }
+
+    if ((subscribe ? afb_req_subscribe(request, event) : afb_req_unsubscribe(request, event)) < 0) {
+        AFB_ReqFailF(request, "subscription-error", "Fail to change subscription to '%s'", name);
+        return;
+    }
+
     AFB_ReqSuccess(request, NULL, NULL);
 }
 
+static void ctrlapi_subscribe(afb_req_t request)
+{
+    ctrlapi_subscription(request, 1);
+}
+
+static void ctrlapi_unsubscribe(afb_req_t request)
+{
+    ctrlapi_subscription(request, 0);
+}
+
 static afb_verb_t CtrlApiVerbs[] = {
     /* VERB'S NAME         FUNCTION TO CALL         SHORT DESCRIPTION */
     { .verb = "ping-global", .callback = ctrlapi_ping, .info = "ping test for API" },
     { .verb = "auth", .callback = ctrlapi_auth, .info = "Authenticate session to raise Level Of Assurance of the session" },
+    { .verb = "subscribe", .callback = ctrlapi_subscribe, .info = "Subscribe to an event published by the controller" },
+    { .verb = "unsubscribe", .callback = ctrlapi_unsubscribe, .info = "Unsubscribe from an event published by the controller" },
+    { .verb = "statemachines", .callback = CtrlStateMachineRequest, .info = "Current state of the controller's state machines" },
+    { .verb = "aggregates", .callback = CtrlAggregatesRequest, .info = "Current values of the controller's aggregates" },
+    { .verb = "sink", .callback = CtrlSinksRequest, .info = "Write a record into a sink, or get sinks statistics" },
+    { .verb = "breakers", .callback = CtrlBreakersRequest, .info = "Circuit breakers state of the called APIs" },
+    { .verb = "slowlog", .callback = CtrlSlowLogRequest, .info = "Dump the slow control calls recorded" },
+    { .verb = "shedding", .callback = CtrlShedRequest, .info = "Overload shedding level and counters" },
+    { .verb = "describe", .callback = CtrlDescribeRequest, .info = "Controls and events of the controller, versioned" },
+    { .verb = "stream", .callback = CtrlStreamAckRequest, .info = "Acknowledge or cancel a streamed result" },
+    { .verb = "stats", .callback = CtrlStatsRequest, .info = "Controller's threads placement statistics" },
+    { .verb = "router", .callback = CtrlRouterRequest, .info = "Workers state of a router front" },
     { .verb = NULL } /* marker for end of the array */
 };
 
@@ -88,6 +185,47 @@ static int CtrlLoadStaticVerbs(afb_api_t api, afb_verb_t* verbs)
     return errcount;
 };
 
+/**
+ * @brief Run the controller's own event consumers then the events section
+ * actions on an event. The event's correlation ID, or a new one, tags the
+ * work it triggers.
+ *
+ * @param api the API handle receiving the event.
+ * @param evtLabel the event label, ie: "api/event".
+ * @param eventJ the event payload.
+ */
+void CtrlDispatchRun(afb_api_t api, const char *evtLabel, json_object *eventJ)
+{
+    char cidBuffer[CTRL_CORRELATION_LEN];
+    const char *previous = CtrlCorrelationSet(CtrlCorrelationFrom(eventJ, cidBuffer));
+
+    CtrlStateMachineDispatch(api, evtLabel, eventJ);
+    CtrlRulesDispatch(api, evtLabel, eventJ);
+    CtrlAggregatesDispatch(api, evtLabel, eventJ);
+    CtrlSinksDispatch(api, evtLabel, eventJ);
+    CtrlEventsDispatch(api, evtLabel, eventJ);
+
+    CtrlCorrelationSet(previous);
+}
+
+/**
+ * @brief Events handler of the API, also used by the controller's sources.
+ * Events are dispatched by the calling thread, or by the dispatch thread when
+ * the 'threads' section isolates it.
+ *
+ * @param api the API handle receiving the event.
+ * @param evtLabel the event label, ie: "api/event".
+ * @param eventJ the event payload.
+ */
+void CtrlDispatchEvent(afb_api_t api, const char *evtLabel, json_object *eventJ)
+{
+    if (CtrlShedEvent(evtLabel))
+        return;
+
+    if (!CtrlDispatchHandOver(api, evtLabel, eventJ))
+        CtrlDispatchRun(api, evtLabel, eventJ);
+}
+
 /**
  * @brief Created API init function. Usually here where the controller is
  * finalize its configuration, as its plugins intialized.
@@ -137,8 +275,12 @@ static int CtrlLoadOneApi(void* cbdata, afb_api_t api)
     // load controller's sections for the corresponding for this API
     err = CtlLoadSections(api, ctrlConfig, ctrlSections);
 
+    // describe the loaded controls and events once for all
+    if (!err)
+        CtrlDescribeBuild(api, ctrlConfig);
+
     // declare an event manager for this API
-    afb_api_on_event(api, CtrlDispatchApiEvent);
+    afb_api_on_event(api, CtrlDispatchEvent);
 
 	// declare an init function for this API
 	afb_api_on_init(api, CtrlInitOneApi);
@@ -21,6 +21,9 @@
 #define _CTL_BINDING_INCLUDE_
 
 #include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
 #include <ctl-config.h>
 #include <filescan-utils.h>
 #include <wrap-json.h>
@@ -33,4 +36,243 @@
   #define CONTROL_PREFIX "CTLAPP"
 #endif
 
+/* controller-binding.c */
+void CtrlDispatchEvent(afb_api_t api, const char *evtLabel, json_object *eventJ);
+void CtrlDispatchRun(afb_api_t api, const char *evtLabel, json_object *eventJ);
+
+/* controller-utils.c */
+typedef struct {
+    const char **names;
+    int count;
+    int size;
+    int *slots;
+} CtrlInternT;
+
+typedef enum {
+    CTRL_OP_EQ,
+    CTRL_OP_NE,
+    CTRL_OP_LT,
+    CTRL_OP_LE,
+    CTRL_OP_GT,
+    CTRL_OP_GE,
+    CTRL_OP_EXISTS,
+} CtrlConditionOpT;
+
+typedef struct {
+    char **path;
+    int depth;
+    CtrlConditionOpT op;
+    json_object *valueJ;
+    double number;
+    int isNumber;
+} CtrlConditionT;
+
+#define CTRL_CORRELATION_LEN 40
+
+/* Controller's state of a client session, shared by its features */
+typedef struct {
+    uint64_t id;
+    time_t expire;
+    unsigned loa;
+    int encoding;
+} CtrlSessionT;
+
+uint64_t CtrlNowUsec(void);
+uint64_t CtrlHash(const void *data, size_t length);
+char *CtrlBase64Encode(const unsigned char *data, size_t len);
+ssize_t CtrlBase64Decode(const char *in, size_t len, unsigned char *out, size_t outLen);
+int CtrlInternFind(const CtrlInternT *intern, const char *name);
+int CtrlInternAdd(CtrlInternT *intern, const char *name);
+char **CtrlJsonPathCompile(const char *field, int *depth);
+json_object *CtrlJsonPathGet(json_object *objJ, char **path, int depth);
+json_object *CtrlJsonCopy(json_object *srcJ);
+int CtrlConditionLoad(afb_api_t api, CtrlConditionT *condition, json_object *conditionJ);
+CtrlConditionT *CtrlConditionsLoad(afb_api_t api, json_object *conditionsJ, int *count);
+int CtrlConditionEval(const CtrlConditionT *condition, json_object *payloadJ);
+int CtrlConditionsEval(const CtrlConditionT *conditions, int count, json_object *payloadJ);
+void CtrlLuaLock(void);
+void CtrlLuaUnlock(void);
+json_object *CtrlActionQuery(CtlActionT *action, json_object *queryJ);
+void CtrlActionExec(CtlSourceT *source, CtlActionT *action, json_object *queryJ);
+void CtrlActionsExec(afb_api_t api, const char *uid, CtlActionT *actions, json_object *queryJ);
+CtrlSessionT *CtrlSessionGet(afb_req_t request, int create);
+const char *CtrlCorrelationFrom(json_object *argsJ, char *buffer);
+const char *CtrlCorrelationSet(const char *cid);
+const char *CtrlCorrelationGet(void);
+json_object *CtrlCorrelationArgs(json_object *argsJ, const char *cid);
+json_object *CtrlCorrelationTag(json_object *objJ);
+
+/* controller-image.c */
+int CtrlImageConfig(afb_api_t api, CtlSectionT *section, json_object *imageJ);
+const char *CtrlImageString(const char *text);
+void CtrlImageRelease(json_object *jso, void *text);
+
+/* controller-compress.c */
+enum {
+    CTRL_ENCODING_NONE = 0,
+    CTRL_ENCODING_LZ4,
+    CTRL_ENCODING_ZSTD,
+    CTRL_ENCODINGS,
+};
+
+int CtrlCompressConfig(afb_api_t api, CtlSectionT *section, json_object *compressJ);
+int CtrlCompressEnabled(void);
+int CtrlCompressSupported(int encoding);
+int CtrlCompressNegotiate(afb_req_t request, json_object *queryJ);
+json_object *CtrlCompress(int encoding, json_object *responseJ);
+
+/* controller-blobs.c */
+int CtrlBlobsConfig(afb_api_t api, CtlSectionT *section, json_object *blobsJ);
+int CtrlBlobsWanted(afb_req_t request, json_object *queryJ);
+json_object *CtrlBlobWrap(json_object *responseJ, const char *field);
+
+/* controller-response.c */
+typedef struct CtrlTemplateS CtrlTemplateT;
+
+json_object *CtrlResponseFreeze(json_object *responseJ);
+CtrlTemplateT *CtrlTemplateCompile(afb_api_t api, json_object *skeletonJ);
+json_object *CtrlTemplateRender(CtrlTemplateT *template, json_object *valuesJ);
+afb_event_t CtrlEventGet(afb_api_t api, const char *name);
+
+/* controller-threads.c */
+int CtrlThreadsConfig(afb_api_t api, CtlSectionT *section, json_object *threadsJ);
+int CtrlThreadApply(const char *role);
+int CtrlDispatchHandOver(afb_api_t api, const char *evtLabel, json_object *eventJ);
+void CtrlTimerArm(afb_api_t api, sd_event_source *timer, uint64_t usec);
+void CtrlStatsRequest(afb_req_t request);
+
+/* controller-auth.c */
+int CtrlAuthConfig(afb_api_t api, CtlSectionT *section, json_object *authJ);
+int CtrlAuthEnabled(void);
+int CtrlAuthCheck(afb_req_t request);
+const struct afb_auth *CtrlAuthMake(int loa, const char *privileges);
+void CtrlAuthRequest(afb_req_t request);
+
+/* controller-breakers.c */
+typedef struct CtrlBreakerS CtrlBreakerT;
+
+int CtrlBreakersConfig(afb_api_t api, CtlSectionT *section, json_object *breakersJ);
+CtrlBreakerT *CtrlBreakerGet(const char *api);
+int CtrlBreakerRefuse(CtrlBreakerT *breaker);
+void CtrlBreakerRecord(CtrlBreakerT *breaker, int failed, uint64_t latency);
+uint64_t CtrlBreakerRetry(CtrlBreakerT *breaker, int attempt);
+void CtrlBreakersRequest(afb_req_t request);
+
+/* controller-events.c */
+int CtrlEventsConfig(afb_api_t api, CtlSectionT *section, json_object *eventsJ);
+void CtrlEventsDispatch(afb_api_t api, const char *evtLabel, json_object *eventJ);
+int CtrlEventsLowPriority(const char *evtLabel);
+json_object *CtrlEventsDescribe(void);
+
+/* controller-shedding.c */
+int CtrlShedConfig(afb_api_t api, CtlSectionT *section, json_object *shedJ);
+void CtrlShedQueueDelay(uint64_t queued);
+int CtrlShedEvent(const char *evtLabel);
+int CtrlShedControl(void);
+uint64_t CtrlShedStretch(uint64_t interval);
+void CtrlShedRequest(afb_req_t request);
+
+/* controller-deps.c */
+int CtrlDepsConfig(afb_api_t api, CtlSectionT *section, json_object *depsJ);
+void CtrlDepsAdd(const char *name);
+
+/* controller-slowlog.c */
+#define CTRL_TRACE_SPANS 16
+
+typedef struct {
+    const char *name;
+    uint64_t offset;
+    uint64_t duration;
+} CtrlTraceSpanT;
+
+typedef struct {
+    uint64_t start;
+    int count;
+    CtrlTraceSpanT spans[CTRL_TRACE_SPANS];
+} CtrlTraceT;
+
+int CtrlSlowLogConfig(afb_api_t api, CtlSectionT *section, json_object *slowlogJ);
+int CtrlSlowLogDefault(void);
+void CtrlTraceStart(CtrlTraceT *trace);
+uint64_t CtrlTraceMark(CtrlTraceT *trace);
+void CtrlTraceSpan(CtrlTraceT *trace, const char *name, uint64_t start);
+void CtrlTraceEnd(CtrlTraceT *trace, int threshold, const char *uid, json_object *argsJ);
+void CtrlSlowLogRequest(afb_req_t request);
+
+/* controller-router.c */
+int CtrlRouterConfig(afb_api_t api, CtlSectionT *section, json_object *routerJ);
+int CtrlRouterEnabled(void);
+void CtrlRouterForward(afb_req_t request, const char *verb, json_object *argsJ);
+void CtrlRouterRequest(afb_req_t request);
+void CtrlRouterAuthReply(afb_req_t request, json_object *responseJ);
+
+/* controller-stream.c */
+typedef struct CtrlStreamS CtrlStreamT;
+
+/* Returns the next items of a stream, about budget bytes serialized, NULL once done */
+typedef json_object *(*CtrlStreamProducerT)(void *closure, size_t budget);
+
+CtrlStreamT *CtrlStreamOpen(afb_req_t request, int chunk, int window, int idle);
+void CtrlStreamFeed(CtrlStreamT *stream, CtrlStreamProducerT producer, void *closure, void (*release)(void *closure));
+void CtrlStreamFeedJson(CtrlStreamT *stream, json_object *resultJ, int owned);
+void CtrlStreamFail(CtrlStreamT *stream, const char *error, const char *info);
+void CtrlStreamAckRequest(afb_req_t request);
+
+/* controller-control.c */
+typedef struct CtrlControlS {
+    const char *uid;
+    const char *info;
+    const char *privileges;
+    const struct afb_auth *auth;
+    int loa;
+    json_object *schemaJ;
+    const char *eventName;
+    int timeout;
+    int slow;
+    int critical;
+    int stream;
+    int streamChunk;
+    int streamWindow;
+    int streamIdle;
+    const char *blobField;
+    CtlActionT *action;
+    CtrlBreakerT *breaker;
+    json_object *responseJ;
+    json_object *encodedJ[CTRL_ENCODINGS];
+    CtrlTemplateT *evtTemplate;
+    afb_event_t event;
+    int smTrigger;
+} CtrlControlT;
+
+int CtrlControlConfig(afb_api_t api, CtlSectionT *section, json_object *controlsJ);
+CtrlControlT *CtrlControlFind(const char *uid);
+json_object *CtrlControlsDescribe(void);
+
+/* controller-describe.c */
+void CtrlDescribeBuild(afb_api_t api, CtlConfigT *ctrlConfig);
+void CtrlDescribeRequest(afb_req_t request);
+
+/* controller-statemachine.c */
+int CtrlStateMachineConfig(afb_api_t api, CtlSectionT *section, json_object *machinesJ);
+void CtrlStateMachineDispatch(afb_api_t api, const char *evtLabel, json_object *eventJ);
+void CtrlStateMachineTrigger(afb_api_t api, int trigger, json_object *payloadJ);
+void CtrlStateMachineRequest(afb_req_t request);
+
+/* controller-rules.c */
+int CtrlRulesConfig(afb_api_t api, CtlSectionT *section, json_object *rulesJ);
+void CtrlRulesDispatch(afb_api_t api, const char *evtLabel, json_object *eventJ);
+
+/* controller-aggregates.c */
+int CtrlAggregatesConfig(afb_api_t api, CtlSectionT *section, json_object *aggregatesJ);
+void CtrlAggregatesDispatch(afb_api_t api, const char *evtLabel, json_object *eventJ);
+void CtrlAggregatesRequest(afb_req_t request);
+
+/* controller-sources.c */
+int CtrlSourcesConfig(afb_api_t api, CtlSectionT *section, json_object *sourcesJ);
+
+/* controller-sinks.c */
+int CtrlSinksConfig(afb_api_t api, CtlSectionT *section, json_object *sinksJ);
+void CtrlSinksDispatch(afb_api_t api, const char *evtLabel, json_object *eventJ);
+void CtrlSinksRequest(afb_req_t request);
+
 #endif /* _CTL_BINDING_INCLUDE_ */
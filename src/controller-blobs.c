@@ -0,0 +1,404 @@
+/*
+ * Copyright (C) 2018 "IoT.bzh"
+ * Author Romain Forlot <romain@iot.bzh>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/random.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "controller-binding.h"
+
+#define BLOBS_DEFAULT_PATH "@ctl-blobs"
+#define BLOBS_DEFAULT_THRESHOLD 65536
+#define BLOBS_DEFAULT_TTL 10000
+#define BLOBS_DEFAULT_MAX 64
+#define BLOBS_LISTEN_BACKLOG 16
+#define BLOBS_TOKEN_BYTES 16
+
+/*
+ * A binary result waiting for its client, in a sealed memfd. The client gets
+ * the descriptor in the control reply, connects to the blobs socket, writes
+ * the token and receives the memfd: the blob is handed once, then forgotten.
+ */
+typedef struct CtrlBlobS {
+    struct CtrlBlobS *next;
+    char token[BLOBS_TOKEN_BYTES * 2 + 1];
+    int fd;
+    uint64_t size;
+    uint64_t expire;
+} CtrlBlobT;
+
+typedef struct {
+    int fd;
+    sd_event_source *evtSource;
+} CtrlBlobClientT;
+
+static const char *CtrlBlobsPath = BLOBS_DEFAULT_PATH;
+static int CtrlBlobsThreshold = BLOBS_DEFAULT_THRESHOLD;
+static int CtrlBlobsTtl = BLOBS_DEFAULT_TTL;
+static int CtrlBlobsMax = BLOBS_DEFAULT_MAX;
+static int CtrlBlobsEnabled = 0;
+static afb_api_t CtrlBlobsApi = NULL;
+
+static CtrlBlobT *CtrlBlobs = NULL;
+static int CtrlBlobsCount = 0;
+static pthread_mutex_t CtrlBlobsLock = PTHREAD_MUTEX_INITIALIZER;
+
+static void BlobFree(CtrlBlobT *blob)
+{
+    close(blob->fd);
+    free(blob);
+}
+
+/* Unlink a blob by token, called with the lock held */
+static CtrlBlobT *BlobTake(const char *token)
+{
+    CtrlBlobT **prev, *blob;
+
+    for (prev = &CtrlBlobs; *prev; prev = &(*prev)->next) {
+        if (!strcmp((*prev)->token, token)) {
+            blob = *prev;
+            *prev = blob->next;
+            CtrlBlobsCount--;
+            return blob;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Write the data in a memfd then seal it: the client maps pages nobody can
+ * change or truncate anymore, and needs no copy of its own.
+ */
+static int BlobCreate(const char *text, size_t len, uint64_t *size)
+{
+    size_t bound = (len / 4) * 3 + 3;
+    unsigned char *data;
+    ssize_t count;
+    int fd;
+
+    fd = memfd_create("ctl-blob", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd < 0)
+        return ERROR;
+
+    if (ftruncate(fd, (off_t) bound) ||
+        (data = mmap(NULL, bound, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+        close(fd);
+        return ERROR;
+    }
+
+    count = CtrlBase64Decode(text, len, data, bound);
+    munmap(data, bound);
+
+    if (count < 0 || ftruncate(fd, (off_t) count) ||
+        fcntl(fd, F_ADD_SEALS, F_SEAL_WRITE | F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) < 0) {
+        close(fd);
+        return ERROR;
+    }
+
+    *size = (uint64_t) count;
+    return fd;
+}
+
+static int BlobToken(char *token)
+{
+    unsigned char random[BLOBS_TOKEN_BYTES];
+
+    if (getrandom(random, sizeof(random), 0) != sizeof(random))
+        return ERROR;
+
+    for (int idx = 0; idx < BLOBS_TOKEN_BYTES; idx++)
+        sprintf(token + idx * 2, "%02x", random[idx]);
+
+    return 0;
+}
+
+/*
+ * The binder only knows the peer credentials of clients connected through a
+ * unix socket, the ones able to reach the blobs socket too.
+ */
+static int BlobsClientLocal(afb_req_t request)
+{
+    json_object *infoJ = afb_req_get_client_info(request);
+    int local = json_object_object_get_ex(infoJ, "pid", NULL);
+
+    json_object_put(infoJ);
+    return local;
+}
+
+/**
+ * @brief Whether the client asked for binary results as blobs, with a
+ * { "blob": true } argument. Only local clients get them, the others
+ * asking for blobs get the results inline.
+ *
+ * @param request the control request.
+ * @param queryJ the request arguments.
+ * @return int 1 if so, 0 if not or no 'blobs' section is configured.
+ */
+int CtrlBlobsWanted(afb_req_t request, json_object *queryJ)
+{
+    json_object *blobJ;
+
+    return CtrlBlobsEnabled && json_object_object_get_ex(queryJ, "blob", &blobJ) && json_object_get_boolean(blobJ) &&
+           BlobsClientLocal(request);
+}
+
+/**
+ * @brief Move a base64 field of a response into a sealed memfd, replacing it
+ * by { "blob": "<token>", "size": 123456, "socket": "@ctl-blobs" }. Smaller
+ * fields than the threshold, or when too many blobs wait, are left inline.
+ *
+ * @param responseJ the response, ownership is kept by the caller.
+ * @param field the response's field holding the base64 data.
+ * @return json_object* a new reference on the response to send.
+ */
+json_object *CtrlBlobWrap(json_object *responseJ, const char *field)
+{
+    json_object *dataJ, *wrappedJ, *descriptorJ;
+    CtrlBlobT *blob;
+    size_t len;
+    int full;
+
+    if (!json_object_object_get_ex(responseJ, field, &dataJ) || !json_object_is_type(dataJ, json_type_string) ||
+        (len = (size_t) json_object_get_string_len(dataJ)) < (size_t) CtrlBlobsThreshold)
+        return json_object_get(responseJ);
+
+    pthread_mutex_lock(&CtrlBlobsLock);
+    full = CtrlBlobsCount >= CtrlBlobsMax;
+    pthread_mutex_unlock(&CtrlBlobsLock);
+    if (full)
+        return json_object_get(responseJ);
+
+    blob = calloc(1, sizeof(CtrlBlobT));
+    if (BlobToken(blob->token) || (blob->fd = BlobCreate(json_object_get_string(dataJ), len, &blob->size)) < 0) {
+        AFB_API_WARNING(CtrlBlobsApi, "CtrlBlobWrap: fail to create a blob for field '%s', sent inline", field);
+        free(blob);
+        return json_object_get(responseJ);
+    }
+    blob->expire = CtrlNowUsec() + (uint64_t) CtrlBlobsTtl * 1000;
+
+    /* once registered, the blob may be fetched and freed at any time */
+    wrap_json_pack(&descriptorJ, "{ss,sI,ss}", "blob", blob->token, "size", (int64_t) blob->size,
+                   "socket", CtrlBlobsPath);
+
+    pthread_mutex_lock(&CtrlBlobsLock);
+    blob->next = CtrlBlobs;
+    CtrlBlobs = blob;
+    CtrlBlobsCount++;
+    pthread_mutex_unlock(&CtrlBlobsLock);
+
+    /* the response may be shared, only its top level is copied */
+    wrappedJ = json_object_new_object();
+    json_object_object_foreach(responseJ, key, valJ)
+        json_object_object_add(wrappedJ, key, strcmp(key, field) ? json_object_get(valJ) : json_object_get(descriptorJ));
+    json_object_put(descriptorJ);
+
+    return wrappedJ;
+}
+
+/*
+ * The token is expected in a single write, the client gets back the blob size
+ * with the memfd attached, or a zero size alone for an unknown token.
+ */
+static int BlobClientCB(sd_event_source *evtSource, int fd, uint32_t revents, void *userdata)
+{
+    CtrlBlobClientT *client = (CtrlBlobClientT *) userdata;
+    char token[BLOBS_TOKEN_BYTES * 2 + 2];
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    CtrlBlobT *blob = NULL;
+    uint64_t size = 0;
+    ssize_t len;
+
+    len = read(fd, token, sizeof(token) - 1);
+    if (len < 0 && (errno == EAGAIN || errno == EINTR))
+        return 0;
+
+    if (len > 0) {
+        token[len] = '\0';
+        token[strcspn(token, "\r\n")] = '\0';
+        pthread_mutex_lock(&CtrlBlobsLock);
+        blob = BlobTake(token);
+        pthread_mutex_unlock(&CtrlBlobsLock);
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = &size;
+    iov.iov_len = sizeof(size);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (blob) {
+        size = blob->size;
+        memset(&control, 0, sizeof(control));
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &blob->fd, sizeof(int));
+    }
+    if (len > 0 && sendmsg(fd, &msg, MSG_NOSIGNAL) < 0)
+        AFB_API_WARNING(CtrlBlobsApi, "BlobClientCB: fail to hand a blob: %s", strerror(errno));
+
+    if (blob)
+        BlobFree(blob);
+    sd_event_source_unref(client->evtSource);
+    close(client->fd);
+    free(client);
+
+    return 0;
+}
+
+static int BlobsAcceptCB(sd_event_source *evtSource, int fd, uint32_t revents, void *userdata)
+{
+    CtrlBlobClientT *client;
+    int sock = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+    if (sock < 0) {
+        AFB_API_WARNING(CtrlBlobsApi, "BlobsAcceptCB: accept failed: %s", strerror(errno));
+        return 0;
+    }
+
+    client = calloc(1, sizeof(CtrlBlobClientT));
+    client->fd = sock;
+    if (sd_event_add_io(afb_api_get_event_loop(CtrlBlobsApi), &client->evtSource, sock, EPOLLIN, BlobClientCB, client) < 0) {
+        close(sock);
+        free(client);
+    }
+
+    return 0;
+}
+
+/* Drop the blobs their client never fetched */
+static int BlobsExpireCB(sd_event_source *source, uint64_t usec, void *userdata)
+{
+    uint64_t now = CtrlNowUsec();
+    CtrlBlobT **prev = &CtrlBlobs, *blob;
+    int dropped = 0;
+
+    pthread_mutex_lock(&CtrlBlobsLock);
+    while ((blob = *prev)) {
+        if (blob->expire > now) {
+            prev = &blob->next;
+            continue;
+        }
+        *prev = blob->next;
+        CtrlBlobsCount--;
+        BlobFree(blob);
+        dropped++;
+    }
+    pthread_mutex_unlock(&CtrlBlobsLock);
+
+    if (dropped)
+        AFB_API_NOTICE(CtrlBlobsApi, "BlobsExpireCB: %d blob(s) never fetched dropped", dropped);
+
+    sd_event_source_set_time(source, now + (uint64_t) CtrlBlobsTtl * 1000);
+    sd_event_source_set_enabled(source, SD_EVENT_ONESHOT);
+
+    return 0;
+}
+
+static int BlobsListen(afb_api_t api)
+{
+    struct sockaddr_un addr;
+    sd_event_source *evtSource, *timer;
+    int fd;
+
+    if (strlen(CtrlBlobsPath) >= sizeof(addr.sun_path))
+        return ERROR;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, CtrlBlobsPath);
+    if (addr.sun_path[0] == '@')
+        addr.sun_path[0] = '\0';
+    else
+        unlink(CtrlBlobsPath);
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return ERROR;
+
+    if (bind(fd, (struct sockaddr *) &addr, (socklen_t) (offsetof(struct sockaddr_un, sun_path) + strlen(CtrlBlobsPath))) < 0 ||
+        listen(fd, BLOBS_LISTEN_BACKLOG) < 0) {
+        close(fd);
+        return ERROR;
+    }
+
+    if (sd_event_add_io(afb_api_get_event_loop(api), &evtSource, fd, EPOLLIN, BlobsAcceptCB, NULL) < 0 ||
+        sd_event_add_time(afb_api_get_event_loop(api), &timer, CLOCK_MONOTONIC,
+                          CtrlNowUsec() + (uint64_t) CtrlBlobsTtl * 1000, 1000, BlobsExpireCB, NULL) < 0)
+        return ERROR;
+
+    return 0;
+}
+
+/**
+ * @brief Controller's 'blobs' section loader:
+ * { "path": "@ctl-blobs", "threshold": 65536, "ttl": 10000, "max": 64 }
+ * Lets local clients get the base64 binary fields of control results larger
+ * than 'threshold' bytes as sealed memfds, fetched on the 'path' unix socket
+ * within 'ttl' milliseconds. At most 'max' blobs wait for their client, the
+ * next ones are sent inline.
+ *
+ * @param api the API handle being set up.
+ * @param section the section definition.
+ * @param blobsJ the JSON section, NULL when called at init time.
+ * @return int 0 if OK, other if not.
+ */
+int CtrlBlobsConfig(afb_api_t api, CtlSectionT *section, json_object *blobsJ)
+{
+    if (!blobsJ) {
+        if (!CtrlBlobsEnabled)
+            return 0;
+        CtrlBlobsApi = api;
+        if (BlobsListen(api)) {
+            AFB_API_ERROR(api, "CtrlBlobsConfig: fail to listen on '%s': %s", CtrlBlobsPath, strerror(errno));
+            return ERROR;
+        }
+        return 0;
+    }
+
+    if (wrap_json_unpack(blobsJ, "{s?s,s?i,s?i,s?i}", "path", &CtrlBlobsPath, "threshold", &CtrlBlobsThreshold,
+                         "ttl", &CtrlBlobsTtl, "max", &CtrlBlobsMax) ||
+        CtrlBlobsThreshold < 0 || CtrlBlobsTtl <= 0 || CtrlBlobsMax <= 0) {
+        AFB_API_ERROR(api, "CtrlBlobsConfig: invalid 'blobs' section %s", json_object_to_json_string(blobsJ));
+        return ERROR;
+    }
+
+    CtrlBlobsApi = api;
+    CtrlBlobsEnabled = 1;
+
+    return 0;
+}
@@ -0,0 +1,315 @@
+/*
+ * Copyright (C) 2018 "IoT.bzh"
+ * Author Romain Forlot <romain@iot.bzh>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "controller-binding.h"
+
+#define BREAKER_DEFAULT_WINDOW 20
+#define BREAKER_DEFAULT_RATIO 0.5
+#define BREAKER_DEFAULT_OPEN 5000
+#define BREAKER_DEFAULT_BACKOFF 50
+#define BREAKER_DEFAULT_BUDGET 0.1
+#define BREAKER_MAX_WINDOW 1024
+#define BREAKER_MAX_BACKOFF_SHIFT 10
+
+typedef enum {
+    BREAKER_CLOSED = 0,
+    BREAKER_OPEN,
+    BREAKER_HALF_OPEN,
+} CtrlBreakerStateT;
+
+static const char *CtrlBreakerStates[] = { "closed", "open", "half-open" };
+
+/*
+ * A breaker watches the outcome of the last 'window' calls to its API, a slow
+ * call counting as a failure. Over 'ratio' failures it opens for 'open' ms,
+ * then lets a single probe through: its outcome closes or reopens it.
+ *
+ * Retries draw from a budget credited 'budget' token per successful call, so
+ * that retries stay a bounded fraction of the traffic when the API degrades.
+ */
+struct CtrlBreakerS {
+    const char *api;
+    int window;
+    double ratio;
+    uint64_t latency;
+    uint64_t openDuration;
+    int retries;
+    uint64_t backoff;
+    double budget;
+    double tokens;
+
+    pthread_mutex_t lock;
+    CtrlBreakerStateT state;
+    uint64_t openUntil;
+    int probing;
+    unsigned char *outcomes;
+    int next;
+    int recorded;
+    int failures;
+
+    uint64_t calls;
+    uint64_t rejected;
+    uint64_t retried;
+    uint64_t trips;
+    uint32_t seed;
+};
+
+static CtrlBreakerT *CtrlBreakers = NULL;
+static int CtrlBreakersCount = 0;
+
+/**
+ * @brief Get the breaker guarding an API.
+ *
+ * @param api the API name.
+ * @return CtrlBreakerT* the breaker, NULL if that API has none.
+ */
+CtrlBreakerT *CtrlBreakerGet(const char *api)
+{
+    for (int idx = 0; api && idx < CtrlBreakersCount; idx++) {
+        if (!strcmp(CtrlBreakers[idx].api, api))
+            return &CtrlBreakers[idx];
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Whether the breaker refuses a call to its API, counting the call
+ * when it goes through.
+ *
+ * @param breaker the breaker.
+ * @return int 0 if the call may go, other if the breaker refuses it.
+ */
+int CtrlBreakerRefuse(CtrlBreakerT *breaker)
+{
+    int err = 0;
+
+    pthread_mutex_lock(&breaker->lock);
+    if (breaker->state == BREAKER_OPEN && CtrlNowUsec() >= breaker->openUntil) {
+        breaker->state = BREAKER_HALF_OPEN;
+        breaker->probing = 0;
+    }
+
+    if (breaker->state == BREAKER_OPEN || (breaker->state == BREAKER_HALF_OPEN && breaker->probing)) {
+        breaker->rejected++;
+        err = ERROR;
+    }
+    else {
+        breaker->probing = breaker->state == BREAKER_HALF_OPEN;
+        breaker->calls++;
+    }
+    pthread_mutex_unlock(&breaker->lock);
+
+    return err;
+}
+
+static void BreakerTrip(CtrlBreakerT *breaker)
+{
+    breaker->state = BREAKER_OPEN;
+    breaker->openUntil = CtrlNowUsec() + breaker->openDuration;
+    breaker->trips++;
+}
+
+/**
+ * @brief Record the outcome of a call to the breaker's API.
+ *
+ * @param breaker the breaker.
+ * @param failed whether the call failed.
+ * @param latency the call duration in microseconds.
+ */
+void CtrlBreakerRecord(CtrlBreakerT *breaker, int failed, uint64_t latency)
+{
+    unsigned char outcome = failed || (breaker->latency && latency > breaker->latency);
+
+    pthread_mutex_lock(&breaker->lock);
+    if (breaker->state == BREAKER_HALF_OPEN) {
+        breaker->probing = 0;
+        if (outcome) {
+            BreakerTrip(breaker);
+        }
+        else {
+            breaker->state = BREAKER_CLOSED;
+            breaker->recorded = breaker->failures = breaker->next = 0;
+        }
+    }
+    else if (breaker->state == BREAKER_CLOSED) {
+        if (breaker->recorded == breaker->window)
+            breaker->failures -= breaker->outcomes[breaker->next];
+        else
+            breaker->recorded++;
+        breaker->outcomes[breaker->next] = outcome;
+        breaker->failures += outcome;
+        breaker->next = (breaker->next + 1) % breaker->window;
+
+        if (breaker->recorded == breaker->window &&
+            breaker->failures > breaker->ratio * breaker->window) {
+            BreakerTrip(breaker);
+            breaker->recorded = breaker->failures = breaker->next = 0;
+        }
+    }
+
+    if (!outcome && breaker->tokens < breaker->window)
+        breaker->tokens += breaker->budget;
+    pthread_mutex_unlock(&breaker->lock);
+}
+
+/**
+ * @brief Take a retry from the breaker's budget.
+ *
+ * @param breaker the breaker.
+ * @param attempt the number of attempts already made.
+ * @return uint64_t the jittered backoff delay in microseconds before the
+ * retry, 0 if no retry is allowed.
+ */
+uint64_t CtrlBreakerRetry(CtrlBreakerT *breaker, int attempt)
+{
+    uint64_t delay = 0, ceiling;
+    int shift = attempt - 1 < BREAKER_MAX_BACKOFF_SHIFT ? attempt - 1 : BREAKER_MAX_BACKOFF_SHIFT;
+
+    pthread_mutex_lock(&breaker->lock);
+    if (attempt <= breaker->retries && breaker->tokens >= 1.0 && breaker->state == BREAKER_CLOSED) {
+        breaker->tokens -= 1.0;
+        breaker->retried++;
+        /* full jitter over an exponential ceiling */
+        ceiling = breaker->backoff << shift;
+        breaker->seed = breaker->seed * 1103515245 + 12345;
+        delay = 1 + (uint64_t) (breaker->seed >> 8) % ceiling;
+    }
+    pthread_mutex_unlock(&breaker->lock);
+
+    return delay;
+}
+
+/**
+ * @brief Current state and counters of the breakers.
+ *
+ * @param request AFB request with the JSON arguments: { "api": "name" } for
+ * a single breaker, every breaker otherwise.
+ */
+void CtrlBreakersRequest(afb_req_t request)
+{
+    const char *api = NULL;
+    json_object *resultsJ, *breakerJ;
+
+    wrap_json_unpack(afb_req_json(request), "{s?s}", "api", &api);
+
+    resultsJ = json_object_new_object();
+    for (int idx = 0; idx < CtrlBreakersCount; idx++) {
+        CtrlBreakerT *breaker = &CtrlBreakers[idx];
+        if (api && strcmp(api, breaker->api))
+            continue;
+
+        pthread_mutex_lock(&breaker->lock);
+        if (breaker->state == BREAKER_OPEN && CtrlNowUsec() >= breaker->openUntil)
+            breaker->state = BREAKER_HALF_OPEN;
+        wrap_json_pack(&breakerJ, "{ss,si,si,sI,sI,sI,sI,sd}",
+                       "state", CtrlBreakerStates[breaker->state],
+                       "failures", breaker->failures,
+                       "recorded", breaker->recorded,
+                       "calls", (int64_t) breaker->calls,
+                       "rejected", (int64_t) breaker->rejected,
+                       "retried", (int64_t) breaker->retried,
+                       "trips", (int64_t) breaker->trips,
+                       "budget", breaker->tokens);
+        pthread_mutex_unlock(&breaker->lock);
+        json_object_object_add(resultsJ, breaker->api, breakerJ);
+    }
+
+    if (api && !json_object_object_length(resultsJ)) {
+        json_object_put(resultsJ);
+        AFB_ReqFailF(request, "unknown-breaker", "No breaker for API '%s'", api);
+        return;
+    }
+
+    AFB_ReqSuccess(request, resultsJ, NULL);
+}
+
+static int BreakerLoadOne(afb_api_t api, CtrlBreakerT *breaker, json_object *breakerJ)
+{
+    int latency = 0, open = BREAKER_DEFAULT_OPEN, backoff = BREAKER_DEFAULT_BACKOFF, err;
+
+    breaker->window = BREAKER_DEFAULT_WINDOW;
+    breaker->ratio = BREAKER_DEFAULT_RATIO;
+    breaker->budget = BREAKER_DEFAULT_BUDGET;
+
+    err = wrap_json_unpack(breakerJ, "{ss,s?i,s?F,s?i,s?i,s?i,s?i,s?F}",
+            "api", &breaker->api,
+            "window", &breaker->window,
+            "ratio", &breaker->ratio,
+            "latency", &latency,
+            "open", &open,
+            "retries", &breaker->retries,
+            "backoff", &backoff,
+            "budget", &breaker->budget);
+    if (err) {
+        AFB_API_ERROR(api, "BreakerLoadOne: missing api in %s", json_object_to_json_string(breakerJ));
+        return ERROR;
+    }
+
+    if (breaker->window <= 0 || breaker->window > BREAKER_MAX_WINDOW || breaker->ratio <= 0 || breaker->ratio > 1 ||
+        latency < 0 || open <= 0 || breaker->retries < 0 || backoff <= 0 || breaker->budget < 0) {
+        AFB_API_ERROR(api, "BreakerLoadOne: invalid settings for API '%s'", breaker->api);
+        return ERROR;
+    }
+
+    breaker->latency = (uint64_t) latency * 1000;
+    breaker->openDuration = (uint64_t) open * 1000;
+    breaker->backoff = (uint64_t) backoff * 1000;
+    breaker->tokens = breaker->retries ? 1.0 : 0.0;
+    breaker->outcomes = calloc(breaker->window, sizeof(unsigned char));
+    breaker->seed = (uint32_t) CtrlNowUsec();
+    pthread_mutex_init(&breaker->lock, NULL);
+
+    return 0;
+}
+
+/**
+ * @brief Controller's 'breakers' section loader, one circuit breaker and
+ * retry budget per downstream API targeted by controls' actions.
+ *
+ * @param api the API handle being set up.
+ * @param section the section definition.
+ * @param breakersJ the JSON section, NULL when called at init time.
+ * @return int 0 if OK, other if not.
+ */
+int CtrlBreakersConfig(afb_api_t api, CtlSectionT *section, json_object *breakersJ)
+{
+    int errcount = 0;
+
+    if (!breakersJ)
+        return 0;
+
+    if (json_object_is_type(breakersJ, json_type_array)) {
+        CtrlBreakersCount = (int) json_object_array_length(breakersJ);
+        CtrlBreakers = calloc(CtrlBreakersCount, sizeof(CtrlBreakerT));
+        for (int idx = 0; idx < CtrlBreakersCount; idx++)
+            errcount += BreakerLoadOne(api, &CtrlBreakers[idx], json_object_array_get_idx(breakersJ, idx));
+    }
+    else {
+        CtrlBreakersCount = 1;
+        CtrlBreakers = calloc(1, sizeof(CtrlBreakerT));
+        errcount += BreakerLoadOne(api, CtrlBreakers, breakersJ);
+    }
+
+    return errcount;
+}
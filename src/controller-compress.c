@@ -0,0 +1,267 @@
+/*
+ * Copyright (C) 2018 "IoT.bzh"
+ * Author Romain Forlot <romain@iot.bzh>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "controller-binding.h"
+
+#define COMPRESS_DEFAULT_THRESHOLD 4096
+#define COMPRESS_DEFAULT_LEVEL 3
+#define COMPRESS_MAX_DICTIONARY (1 << 20)
+
+static const char *CtrlEncodings[] = { "none", "lz4", "zstd", NULL };
+
+static int CtrlCompressActive = 0;
+static int CtrlCompressThreshold = COMPRESS_DEFAULT_THRESHOLD;
+static int CtrlCompressLevel = COMPRESS_DEFAULT_LEVEL;
+static char *CtrlCompressDict = NULL;
+static size_t CtrlCompressDictSize = 0;
+#ifdef HAVE_ZSTD
+static ZSTD_CDict *CtrlCompressZstdDict = NULL;
+#endif
+
+/**
+ * @brief Encoding of the response to a control call: the request 'encoding'
+ * argument, remembered as the session's choice, or the session's previous
+ * choice.
+ *
+ * @param request the control request.
+ * @param queryJ the request arguments.
+ * @return int the CTRL_ENCODING_* to apply, CTRL_ENCODING_NONE if disabled.
+ */
+int CtrlCompressNegotiate(afb_req_t request, json_object *queryJ)
+{
+    json_object *encodingJ;
+    CtrlSessionT *session;
+    int encoding;
+
+    if (!CtrlCompressActive)
+        return CTRL_ENCODING_NONE;
+
+    if (json_object_object_get_ex(queryJ, "encoding", &encodingJ)) {
+        for (encoding = 0; CtrlEncodings[encoding]; encoding++) {
+            if (!strcmp(CtrlEncodings[encoding], json_object_get_string(encodingJ)))
+                break;
+        }
+        if (!CtrlEncodings[encoding] || !CtrlCompressSupported(encoding))
+            encoding = CTRL_ENCODING_NONE;
+        if ((session = CtrlSessionGet(request, 1)))
+            session->encoding = encoding;
+        return encoding;
+    }
+
+    session = CtrlSessionGet(request, 0);
+    return session ? session->encoding : CTRL_ENCODING_NONE;
+}
+
+/**
+ * @brief Whether a 'compression' section is configured.
+ *
+ * @return int 1 if so, 0 if not.
+ */
+int CtrlCompressEnabled(void)
+{
+    return CtrlCompressActive;
+}
+
+/**
+ * @brief Whether this build supports an encoding.
+ *
+ * @param encoding the CTRL_ENCODING_* to check.
+ * @return int 1 if supported, 0 if not.
+ */
+int CtrlCompressSupported(int encoding)
+{
+    switch (encoding) {
+        case CTRL_ENCODING_NONE:
+            return 1;
+#ifdef HAVE_LZ4
+        case CTRL_ENCODING_LZ4:
+            return 1;
+#endif
+#ifdef HAVE_ZSTD
+        case CTRL_ENCODING_ZSTD:
+            return 1;
+#endif
+        default:
+            return 0;
+    }
+}
+
+static size_t CompressBound(int encoding, size_t size)
+{
+    switch (encoding) {
+#ifdef HAVE_LZ4
+        case CTRL_ENCODING_LZ4:
+            return (size_t) LZ4_compressBound((int) size);
+#endif
+#ifdef HAVE_ZSTD
+        case CTRL_ENCODING_ZSTD:
+            return ZSTD_compressBound(size);
+#endif
+        default:
+            return 0;
+    }
+}
+
+static size_t CompressData(int encoding, const char *text, size_t size, char *out, size_t bound)
+{
+    switch (encoding) {
+#ifdef HAVE_LZ4
+        case CTRL_ENCODING_LZ4: {
+            LZ4_stream_t stream;
+            int len;
+
+            LZ4_initStream(&stream, sizeof(stream));
+            if (CtrlCompressDict)
+                LZ4_loadDict(&stream, CtrlCompressDict, (int) CtrlCompressDictSize);
+            len = LZ4_compress_fast_continue(&stream, text, out, (int) size, (int) bound, 1);
+            return len > 0 ? (size_t) len : 0;
+        }
+#endif
+#ifdef HAVE_ZSTD
+        case CTRL_ENCODING_ZSTD: {
+            ZSTD_CCtx *cctx = ZSTD_createCCtx();
+            size_t len;
+
+            if (CtrlCompressZstdDict)
+                len = ZSTD_compress_usingCDict(cctx, out, bound, text, size, CtrlCompressZstdDict);
+            else
+                len = ZSTD_compressCCtx(cctx, out, bound, text, size, CtrlCompressLevel);
+            ZSTD_freeCCtx(cctx);
+            return ZSTD_isError(len) ? 0 : len;
+        }
+#endif
+        default:
+            return 0;
+    }
+}
+
+/**
+ * @brief Compress a response serialized larger than the threshold into
+ * { "encoding": "zstd", "size": 123456, "dictionary": false, "data": "<base64>" },
+ * smaller responses, or not shrinking ones, are left as is.
+ *
+ * @param encoding the CTRL_ENCODING_* negotiated with the client.
+ * @param responseJ the response, ownership is kept by the caller.
+ * @return json_object* a new reference on the response to send.
+ */
+json_object *CtrlCompress(int encoding, json_object *responseJ)
+{
+    const char *text;
+    size_t size, bound, len;
+    json_object *envelopeJ;
+    char *out, *data;
+
+    if (encoding == CTRL_ENCODING_NONE || !responseJ)
+        return json_object_get(responseJ);
+
+    text = json_object_to_json_string_ext(responseJ, JSON_C_TO_STRING_PLAIN);
+    size = strlen(text);
+    if (size < (size_t) CtrlCompressThreshold || !(bound = CompressBound(encoding, size)))
+        return json_object_get(responseJ);
+
+    out = malloc(bound);
+    len = CompressData(encoding, text, size, out, bound);
+    if (!len || len * 4 / 3 >= size) {
+        free(out);
+        return json_object_get(responseJ);
+    }
+
+    data = CtrlBase64Encode((const unsigned char *) out, len);
+    free(out);
+
+    wrap_json_pack(&envelopeJ, "{ss,sI,sb,ss}",
+                   "encoding", CtrlEncodings[encoding],
+                   "size", (int64_t) size,
+                   "dictionary", !!CtrlCompressDict,
+                   "data", data);
+    free(data);
+
+    return envelopeJ;
+}
+
+static int CompressLoadDictionary(afb_api_t api, const char *path)
+{
+    FILE *file = fopen(path, "re");
+    long size;
+
+    if (!file || fseek(file, 0, SEEK_END) || (size = ftell(file)) <= 0 || size > COMPRESS_MAX_DICTIONARY ||
+        fseek(file, 0, SEEK_SET)) {
+        AFB_API_ERROR(api, "CompressLoadDictionary: fail to read dictionary '%s'", path);
+        if (file)
+            fclose(file);
+        return ERROR;
+    }
+
+    CtrlCompressDict = malloc((size_t) size);
+    CtrlCompressDictSize = fread(CtrlCompressDict, 1, (size_t) size, file);
+    fclose(file);
+
+#ifdef HAVE_ZSTD
+    CtrlCompressZstdDict = ZSTD_createCDict(CtrlCompressDict, CtrlCompressDictSize, CtrlCompressLevel);
+#endif
+
+    return 0;
+}
+
+/**
+ * @brief Controller's 'compression' section loader:
+ * { "threshold": 4096, "level": 3, "dictionary": "/path/to/dictionary" }
+ * Lets clients ask for control responses larger than 'threshold' bytes to be
+ * compressed, with lz4 or zstd at 'level', the dictionary trained on the
+ * responses schemas being shared by both ends.
+ *
+ * @param api the API handle being set up.
+ * @param section the section definition.
+ * @param compressJ the JSON section, NULL when called at init time.
+ * @return int 0 if OK, other if not.
+ */
+int CtrlCompressConfig(afb_api_t api, CtlSectionT *section, json_object *compressJ)
+{
+    const char *dictionary = NULL;
+
+    if (!compressJ)
+        return 0;
+
+    if (wrap_json_unpack(compressJ, "{s?i,s?i,s?s}", "threshold", &CtrlCompressThreshold,
+                         "level", &CtrlCompressLevel, "dictionary", &dictionary) ||
+        CtrlCompressThreshold < 0) {
+        AFB_API_ERROR(api, "CtrlCompressConfig: invalid 'compression' section %s", json_object_to_json_string(compressJ));
+        return ERROR;
+    }
+
+    if (!CtrlCompressSupported(CTRL_ENCODING_LZ4) && !CtrlCompressSupported(CTRL_ENCODING_ZSTD))
+        AFB_API_WARNING(api, "CtrlCompressConfig: no compression supported by this build");
+
+    if (dictionary && CompressLoadDictionary(api, dictionary))
+        return ERROR;
+
+    CtrlCompressActive = 1;
+
+    return 0;
+}
@@ -0,0 +1,651 @@
+/*
+ * Copyright (C) 2018 "IoT.bzh"
+ * Author Romain Forlot <romain@iot.bzh>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "controller-binding.h"
+
+static CtrlControlT *CtrlControls = NULL;
+static int CtrlControlsCount = 0;
+
+/*
+ * In-flight subcall of a control, bound by a deadline and/or a breaker. The
+ * pending subcall, or its retry, holds one reference and the armed deadline
+ * timer another one: the call is freed when the last of them lets go. Timers
+ * are only added, fired and released by the loop, subcalls callbacks reach it
+ * through binder jobs.
+ */
+typedef struct {
+    afb_req_t request;
+    CtrlControlT *control;
+    json_object *argsJ;
+    uint64_t deadline;
+    uint64_t start;
+    uint64_t retryAt;
+    int attempt;
+    sd_event_source *timer;
+    sd_event_source *retry;
+    char *cid;
+    CtrlTraceT *trace;
+    int threshold;
+    int encoding;
+    int blob;
+    CtrlStreamT *stream;
+    int done;
+    int refs;
+    int timerRef;
+} CtrlControlCallT;
+
+/* Both timers already released their source */
+static void ControlCallFree(CtrlControlCallT *call)
+{
+    if (call->trace) {
+        const char *previous = CtrlCorrelationSet(call->cid);
+        CtrlTraceEnd(call->trace, call->threshold, call->control->uid, call->argsJ);
+        CtrlCorrelationSet(previous);
+        free(call->trace);
+    }
+
+    json_object_put(call->argsJ);
+    afb_req_unref(call->request);
+    free(call->cid);
+    free(call);
+}
+
+static void ControlCallUnref(CtrlControlCallT *call)
+{
+    if (!__atomic_sub_fetch(&call->refs, 1, __ATOMIC_ACQ_REL))
+        ControlCallFree(call);
+}
+
+/* Reply the control call, through its stream when it has one, a blob's
+ * descriptor already being small it is not compressed. The callee's result
+ * is still referenced by the binder: it is serialized from a copy */
+static void ControlCallReply(CtrlControlCallT *call, json_object *responseJ, const char *error, const char *info)
+{
+    json_object *copyJ;
+
+    if (call->stream && error)
+        CtrlStreamFail(call->stream, error, info);
+    else if (call->stream)
+        CtrlStreamFeedJson(call->stream, responseJ, 0);
+    else if (error)
+        AFB_ReqFail(call->request, error, info);
+    else {
+        copyJ = CtrlJsonCopy(responseJ);
+        if (call->blob)
+            AFB_ReqSuccess(call->request, CtrlBlobWrap(copyJ, call->control->blobField), info);
+        else
+            AFB_ReqSuccess(call->request, CtrlCompress(call->encoding, copyJ), info);
+        json_object_put(copyJ);
+    }
+}
+
+/* Whoever takes the timer reference, the timer firing or the cancel job, releases its source */
+static void ControlTimerRelease(CtrlControlCallT *call)
+{
+    if (!__atomic_exchange_n(&call->timerRef, 0, __ATOMIC_ACQ_REL))
+        return;
+
+    sd_event_source_set_enabled(call->timer, SD_EVENT_OFF);
+    sd_event_source_unref(call->timer);
+    call->timer = NULL;
+    ControlCallUnref(call);
+}
+
+static int ControlDeadlineCB(sd_event_source *source, uint64_t usec, void *context)
+{
+    CtrlControlCallT *call = (CtrlControlCallT *) context;
+
+    /* the pending subcall or retry will release its own reference */
+    if (!__atomic_exchange_n(&call->done, 1, __ATOMIC_ACQ_REL)) {
+        AFB_API_NOTICE(afb_req_get_api(call->request), "Control '%s' [%s]: deadline exceeded after %d attempt(s)",
+                       call->control->uid, call->cid, call->attempt);
+        ControlCallReply(call, NULL, "timeout", "Deadline exceeded");
+    }
+
+    ControlTimerRelease(call);
+    return 0;
+}
+
+/* Loop job of a finished subcall still armed with a deadline, carrying the subcall's reference */
+static void ControlTimerCancelJob(int signum, void *arg)
+{
+    CtrlControlCallT *call = (CtrlControlCallT *) arg;
+
+    /* taking the loop for this binder thread */
+    afb_api_get_event_loop(afb_req_get_api(call->request));
+    ControlTimerRelease(call);
+    ControlCallUnref(call);
+}
+
+/* The subcall is over, the deadline timer no longer needs to wait */
+static void ControlSubcallRelease(CtrlControlCallT *call)
+{
+    if (__atomic_load_n(&call->timerRef, __ATOMIC_ACQUIRE) &&
+        afb_api_queue_job(afb_req_get_api(call->request), ControlTimerCancelJob, call, NULL, 0) >= 0)
+        return;
+
+    /* without a job the timer releases its reference when it fires */
+    ControlCallUnref(call);
+}
+
+static void ControlSubcall(CtrlControlCallT *call);
+
+static int ControlRetryCB(sd_event_source *source, uint64_t usec, void *context)
+{
+    CtrlControlCallT *call = (CtrlControlCallT *) context;
+    char info[256];
+
+    sd_event_source_unref(call->retry);
+    call->retry = NULL;
+
+    CtrlTraceSpan(call->trace, "backoff", call->start);
+    if (__atomic_load_n(&call->done, __ATOMIC_ACQUIRE)) {
+        ControlSubcallRelease(call);
+        return 0;
+    }
+
+    if (CtrlBreakerRefuse(call->control->breaker)) {
+        if (!__atomic_exchange_n(&call->done, 1, __ATOMIC_ACQ_REL)) {
+            snprintf(info, sizeof(info), "API '%s' circuit is open", call->control->action->exec.subcall.api);
+            ControlCallReply(call, NULL, "unavailable", info);
+        }
+        ControlSubcallRelease(call);
+        return 0;
+    }
+
+    ControlSubcall(call);
+    return 0;
+}
+
+/* Loop job adding the retry backoff timer */
+static void ControlRetryArmJob(int signum, void *arg)
+{
+    CtrlControlCallT *call = (CtrlControlCallT *) arg;
+    sd_event *loop = afb_api_get_event_loop(afb_req_get_api(call->request));
+
+    if (!signum &&
+        sd_event_add_time(loop, &call->retry, CLOCK_MONOTONIC, call->retryAt, 1000, ControlRetryCB, call) >= 0)
+        return;
+
+    call->retry = NULL;
+    if (!__atomic_exchange_n(&call->done, 1, __ATOMIC_ACQ_REL))
+        ControlCallReply(call, NULL, "unavailable", "Fail to arm the retry backoff");
+    ControlSubcallRelease(call);
+}
+
+static void ControlSubcallCB(void *context, json_object *responseJ, const char *error, const char *info, afb_req_t subreq)
+{
+    CtrlControlCallT *call = (CtrlControlCallT *) context;
+    CtrlBreakerT *breaker = call->control->breaker;
+    uint64_t now = CtrlNowUsec(), delay = 0;
+
+    CtrlTraceSpan(call->trace, "subcall", call->start);
+    if (breaker) {
+        CtrlBreakerRecord(breaker, !!error, now - call->start);
+        if (error && !__atomic_load_n(&call->done, __ATOMIC_ACQUIRE))
+            delay = CtrlBreakerRetry(breaker, call->attempt);
+    }
+
+    /* retry only if the backoff still fits in the deadline */
+    if (delay && (!call->deadline || now + delay < call->deadline)) {
+        call->start = now;
+        call->retryAt = now + delay;
+        if (afb_api_queue_job(afb_req_get_api(call->request), ControlRetryArmJob, call, NULL, 0) >= 0)
+            return;
+    }
+
+    if (!__atomic_exchange_n(&call->done, 1, __ATOMIC_ACQ_REL))
+        ControlCallReply(call, responseJ, error, info);
+
+    ControlSubcallRelease(call);
+}
+
+static void ControlStreamCallCB(void *context, json_object *responseJ, const char *error, const char *info, afb_api_t api)
+{
+    ControlSubcallCB(context, responseJ, error, info, NULL);
+}
+
+static void ControlSubcall(CtrlControlCallT *call)
+{
+    CtlActionT *action = call->control->action;
+    json_object *argsJ = json_object_get(call->argsJ);
+
+    call->attempt++;
+    call->start = CtrlNowUsec();
+    if (call->deadline) {
+        json_object_put(argsJ);
+        argsJ = json_object_new_object();
+        json_object_object_foreach(call->argsJ, key, valJ)
+            json_object_object_add(argsJ, key, json_object_get(valJ));
+        json_object_object_add(argsJ, "deadline", json_object_new_int64((int64_t) (call->deadline - call->start) / 1000));
+    }
+
+    /* a streamed call was already replied, its request can not subcall anymore */
+    if (call->stream)
+        afb_api_call(afb_req_get_api(call->request), action->exec.subcall.api, action->exec.subcall.verb, argsJ,
+                     ControlStreamCallCB, call);
+    else
+        afb_req_subcall(call->request, action->exec.subcall.api, action->exec.subcall.verb, argsJ,
+                        afb_req_subcall_on_behalf, ControlSubcallCB, call);
+}
+
+/*
+ * Run an API action as an asynchronous subcall. With a deadline, the client
+ * is replied 'timeout' as soon as it passes, and the remaining budget is
+ * given to the callee as 'deadline' so that it can drop the work too. With a
+ * breaker, failed calls are retried after a jittered backoff while the
+ * breaker's retry budget and the deadline allow it.
+ */
+static void ControlSubcallStart(afb_req_t request, CtrlControlT *control, json_object *queryJ, uint64_t deadline,
+                                int encoding, int blob, CtrlStreamT *stream, CtrlTraceT *trace, int threshold)
+{
+    CtlActionT *action = control->action;
+    CtrlControlCallT *call;
+
+    call = calloc(1, sizeof(CtrlControlCallT));
+    call->request = afb_req_addref(request);
+    call->control = control;
+    call->deadline = deadline;
+    call->encoding = encoding;
+    call->blob = blob;
+    call->stream = stream;
+    call->cid = strdup(CtrlCorrelationGet());
+    if (trace) {
+        call->trace = malloc(sizeof(CtrlTraceT));
+        memcpy(call->trace, trace, sizeof(CtrlTraceT));
+        call->threshold = threshold;
+    }
+
+    /* the query is forwarded as is, unless the action's args overlay it */
+    if (json_object_is_type(queryJ, json_type_object))
+        call->argsJ = CtrlActionQuery(action, queryJ);
+    else if (json_object_is_type(action->argsJ, json_type_object))
+        call->argsJ = json_object_get(action->argsJ);
+    else
+        call->argsJ = json_object_new_object();
+
+    /* the verb thread takes the loop to add the deadline */
+    call->refs = deadline ? 2 : 1;
+    call->timerRef = !!deadline;
+    if (deadline && sd_event_add_time(afb_api_get_event_loop(afb_req_get_api(request)), &call->timer, CLOCK_MONOTONIC,
+                                      deadline, 1000, ControlDeadlineCB, call) < 0) {
+        call->timer = NULL;
+        call->done = 1;
+        ControlCallReply(call, NULL, "internal-error", "Fail to arm the control deadline");
+        ControlCallFree(call);
+        return;
+    }
+
+    ControlSubcall(call);
+}
+
+static const char *ControlActionSpans[] = { "none", "api", "callback", "lua" };
+
+/* Static responses are compressed at load time, once per encoding, each
+ * request gets its own copy of the frozen response */
+static json_object *ControlStaticResponse(CtrlControlT *control, int encoding)
+{
+    return CtrlJsonCopy(control->encodedJ[encoding] ? control->encodedJ[encoding] : control->responseJ);
+}
+
+/* Freezing goes through the shared image, load time only */
+static void ControlStaticEncode(CtrlControlT *control)
+{
+    json_object *encodedJ;
+
+    if (!CtrlCompressEnabled())
+        return;
+
+    for (int encoding = CTRL_ENCODING_NONE + 1; encoding < CTRL_ENCODINGS; encoding++) {
+        if (!CtrlCompressSupported(encoding))
+            continue;
+        /* responses left as is share the plain frozen one */
+        encodedJ = CtrlCompress(encoding, control->responseJ);
+        if (encodedJ == control->responseJ)
+            json_object_put(encodedJ);
+        else
+            control->encodedJ[encoding] = CtrlResponseFreeze(encodedJ);
+    }
+}
+
+/* Run the control, return 1 when the reply is left to an asynchronous subcall */
+static int ControlRun(afb_req_t request, CtrlControlT *control, json_object *queryJ, CtrlTraceT *trace, int threshold)
+{
+    json_object *deadlineJ = NULL;
+    int64_t budget = control->timeout;
+    int encoding = CtrlCompressNegotiate(request, queryJ);
+    int blob = control->blobField && CtrlBlobsWanted(request, queryJ);
+    uint64_t deadline = 0, step;
+    CtlSourceT source;
+
+    if (control->auth) {
+        step = CtrlTraceMark(trace);
+        if (CtrlAuthCheck(request)) {
+            AFB_ReqFail(request, "unauthorized", "Session authentication expired");
+            return 0;
+        }
+        CtrlTraceSpan(trace, "auth", step);
+    }
+
+    if (json_object_object_get_ex(queryJ, "deadline", &deadlineJ) &&
+        (!budget || json_object_get_int64(deadlineJ) < budget))
+        budget = json_object_get_int64(deadlineJ) > 0 ? json_object_get_int64(deadlineJ) : -1;
+    if (budget < 0) {
+        AFB_ReqFail(request, "timeout", "Deadline exceeded before start");
+        return 0;
+    }
+    if (budget)
+        deadline = CtrlNowUsec() + (uint64_t) budget * 1000;
+
+    if (control->smTrigger) {
+        step = CtrlTraceMark(trace);
+        CtrlStateMachineTrigger(afb_req_get_api(request), control->smTrigger - 1, queryJ);
+        CtrlTraceSpan(trace, "statemachines", step);
+    }
+
+    if (control->event) {
+        step = CtrlTraceMark(trace);
+        afb_event_push(control->event, CtrlTemplateRender(control->evtTemplate, queryJ));
+        CtrlTraceSpan(trace, "event", step);
+    }
+
+    if (!control->action && control->stream) {
+        CtrlStreamT *stream = CtrlStreamOpen(request, control->streamChunk, control->streamWindow, control->streamIdle);
+        json_object *responseJ;
+        if (stream) {
+            responseJ = ControlStaticResponse(control, CTRL_ENCODING_NONE);
+            CtrlStreamFeedJson(stream, responseJ, 1);
+            json_object_put(responseJ);
+        }
+        return 0;
+    }
+
+    if (!control->action) {
+        AFB_ReqSuccess(request, ControlStaticResponse(control, encoding), NULL);
+        return 0;
+    }
+
+    if (control->breaker && CtrlBreakerRefuse(control->breaker)) {
+        AFB_ReqFailF(request, "unavailable", "API '%s' circuit is open", control->action->exec.subcall.api);
+        return 0;
+    }
+
+    /* streamed results are replied a stream right away, then pushed by chunks */
+    if (control->stream) {
+        CtrlStreamT *stream = CtrlStreamOpen(request, control->streamChunk, control->streamWindow, control->streamIdle);
+        if (!stream)
+            return 0;
+        ControlSubcallStart(request, control, queryJ, deadline, encoding, 0, stream, trace, threshold);
+        return 1;
+    }
+
+    /* the controller library would reply API actions itself */
+    if (control->breaker || ((deadline || encoding || blob) && control->action->type == CTL_TYPE_API)) {
+        ControlSubcallStart(request, control, queryJ, deadline, encoding, blob, NULL, trace, threshold);
+        return 1;
+    }
+
+    memset(&source, 0, sizeof(source));
+    source.uid = control->uid;
+    source.api = afb_req_get_api(request);
+    source.request = request;
+
+    step = CtrlTraceMark(trace);
+    CtrlActionExec(&source, control->action, queryJ);
+    CtrlTraceSpan(trace, ControlActionSpans[control->action->type], step);
+
+    return 0;
+}
+
+/**
+ * @brief Generic verb callback of every control. It fires the state machines
+ * transitions the control triggers and pushes the control's templated event
+ * if any, then either replies the pre-serialized static response or executes
+ * the control's action.
+ *
+ * A request carrying a 'deadline' argument (remaining milliseconds), or made
+ * to a control with a 'timeout', fails once the deadline passed: it is not
+ * started when already late, and API actions are replied 'timeout' without
+ * waiting for the late subcall. API actions guarded by a breaker fail fast
+ * while the breaker is open.
+ *
+ * The request 'correlation' argument, or a new one added to a copy of the
+ * arguments, follows the action into its subcalls and is available to event
+ * templates.
+ * Calls slower than the control's 'slow' threshold are kept in the slow log.
+ * In router mode, the call is forwarded to a worker process instead.
+ *
+ * Local clients passing { "blob": true } get the control's 'blob' result
+ * field as the descriptor of a sealed memfd instead of inline base64.
+ *
+ * @param request AFB request with the JSON arguments if the request got some.
+ */
+static void CtrlControlRequest(afb_req_t request)
+{
+    CtrlControlT *control = (CtrlControlT *) afb_req_get_vcbdata(request);
+    json_object *queryJ = afb_req_json(request);
+    char cidBuffer[CTRL_CORRELATION_LEN];
+    const char *cid = CtrlCorrelationFrom(queryJ, cidBuffer), *previous;
+    json_object *argsJ;
+    int threshold = control->slow ? control->slow : CtrlSlowLogDefault();
+    CtrlTraceT trace;
+
+    if (!control->critical && CtrlShedControl()) {
+        AFB_ReqFail(request, "overloaded", "Controller overloaded, retry later");
+        return;
+    }
+
+    /* the session is checked on the front, before forwarding */
+    if (CtrlRouterEnabled() && control->auth && CtrlAuthCheck(request)) {
+        AFB_ReqFail(request, "unauthorized", "Session authentication expired");
+        return;
+    }
+
+    argsJ = CtrlCorrelationArgs(queryJ, cid);
+    if (CtrlRouterEnabled()) {
+        CtrlRouterForward(request, control->uid, argsJ);
+        json_object_put(argsJ);
+        return;
+    }
+
+    previous = CtrlCorrelationSet(cid);
+    if (threshold > 0)
+        CtrlTraceStart(&trace);
+    if (!ControlRun(request, control, argsJ, threshold > 0 ? &trace : NULL, threshold) && threshold > 0)
+        CtrlTraceEnd(&trace, threshold, control->uid, argsJ);
+    CtrlCorrelationSet(previous);
+    json_object_put(argsJ);
+}
+
+static int CtrlControlLoadOne(afb_api_t api, CtrlControlT *control, json_object *controlJ)
+{
+    json_object *actionJ = NULL, *responseJ = NULL, *eventJ = NULL, *templateJ = NULL, *streamJ = NULL;
+    const char *evtName = NULL;
+    int err;
+
+    err = wrap_json_unpack(controlJ, "{ss,s?s,s?s,s?i,s?o,s?i,s?i,s?b,s?o,s?o,s?o,s?o,s?s}",
+            "uid", &control->uid,
+            "info", &control->info,
+            "privileges", &control->privileges,
+            "auth", &control->loa,
+            "schema", &control->schemaJ,
+            "timeout", &control->timeout,
+            "slow", &control->slow,
+            "critical", &control->critical,
+            "action", &actionJ,
+            "response", &responseJ,
+            "event", &eventJ,
+            "stream", &streamJ,
+            "blob", &control->blobField);
+    if (err) {
+        AFB_API_ERROR(api, "CtrlControlLoadOne: missing uid in %s", json_object_to_json_string(controlJ));
+        return ERROR;
+    }
+
+    if (streamJ) {
+        control->stream = 1;
+        if (wrap_json_unpack(streamJ, "{s?i,s?i,s?i}", "chunk", &control->streamChunk, "window", &control->streamWindow,
+                             "idle", &control->streamIdle)) {
+            AFB_API_ERROR(api, "CtrlControlLoadOne: control '%s' invalid stream %s", control->uid,
+                          json_object_to_json_string(streamJ));
+            return ERROR;
+        }
+    }
+
+    if (control->timeout < 0 || control->slow < 0) {
+        AFB_API_ERROR(api, "CtrlControlLoadOne: control '%s' timeout and slow must be positive", control->uid);
+        return ERROR;
+    }
+
+    if (!!actionJ == !!responseJ) {
+        AFB_API_ERROR(api, "CtrlControlLoadOne: control '%s' needs either an 'action' or a 'response'", control->uid);
+        return ERROR;
+    }
+
+    if (actionJ) {
+        control->action = calloc(1, sizeof(CtlActionT));
+        if (ActionLoadOne(api, control->action, controlJ, 0)) {
+            AFB_API_ERROR(api, "CtrlControlLoadOne: fail to load action of control '%s'", control->uid);
+            return ERROR;
+        }
+        if (control->stream && control->action->type != CTL_TYPE_API) {
+            AFB_API_ERROR(api, "CtrlControlLoadOne: control '%s' only streams API actions results", control->uid);
+            return ERROR;
+        }
+        if (control->blobField && (control->stream || control->action->type != CTL_TYPE_API)) {
+            AFB_API_ERROR(api, "CtrlControlLoadOne: control '%s' only hands blobs of non streamed API actions results",
+                          control->uid);
+            return ERROR;
+        }
+        if (control->action->type == CTL_TYPE_API) {
+            control->breaker = CtrlBreakerGet(control->action->exec.subcall.api);
+            /* in router mode the workers call it, not this process */
+            if (!CtrlRouterEnabled())
+                CtrlDepsAdd(control->action->exec.subcall.api);
+        }
+    }
+    else {
+        control->responseJ = CtrlResponseFreeze(json_object_get(responseJ));
+        ControlStaticEncode(control);
+    }
+
+    if (eventJ) {
+        err = wrap_json_unpack(eventJ, "{ss,so}", "name", &evtName, "template", &templateJ);
+        if (err) {
+            AFB_API_ERROR(api, "CtrlControlLoadOne: control '%s' event needs a 'name' and a 'template'", control->uid);
+            return ERROR;
+        }
+        control->evtTemplate = CtrlTemplateCompile(api, templateJ);
+        control->event = CtrlEventGet(api, evtName);
+        control->eventName = evtName;
+        if (!control->evtTemplate || !afb_event_is_valid(control->event)) {
+            AFB_API_ERROR(api, "CtrlControlLoadOne: fail to create event '%s' of control '%s'", evtName, control->uid);
+            return ERROR;
+        }
+    }
+
+    control->auth = CtrlAuthMake(control->loa, control->privileges);
+    err = afb_api_add_verb(api, control->uid, control->info, CtrlControlRequest, control, control->auth, 0, 0);
+    if (err) {
+        AFB_API_ERROR(api, "CtrlControlLoadOne: fail to register verb '%s'", control->uid);
+        return ERROR;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Find a control by uid, load time only.
+ *
+ * @param uid the control uid.
+ * @return CtrlControlT* the control, or NULL if none has that uid.
+ */
+CtrlControlT *CtrlControlFind(const char *uid)
+{
+    for (int idx = 0; idx < CtrlControlsCount; idx++) {
+        if (CtrlControls[idx].uid && !strcmp(CtrlControls[idx].uid, uid))
+            return &CtrlControls[idx];
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Describe the controls: their arguments schema, authentication and
+ * the event they push, for the describe verb.
+ *
+ * @return json_object* the controls description array.
+ */
+json_object *CtrlControlsDescribe(void)
+{
+    json_object *controlsJ = json_object_new_array(), *controlJ;
+
+    for (int idx = 0; idx < CtrlControlsCount; idx++) {
+        CtrlControlT *control = &CtrlControls[idx];
+
+        wrap_json_pack(&controlJ, "{ss,s?s,s?O,si,s?s,sb,sb,s?s,s?s}",
+                       "uid", control->uid,
+                       "info", control->info,
+                       "schema", control->schemaJ,
+                       "auth", control->loa,
+                       "privileges", control->privileges,
+                       "critical", control->critical,
+                       "stream", control->stream,
+                       "event", control->eventName,
+                       "blob", control->blobField);
+        json_object_array_add(controlsJ, controlJ);
+    }
+
+    return controlsJ;
+}
+
+/**
+ * @brief Controller's 'controls' section loader. Replace the default
+ * ControlConfig to handle static responses and templated events while still
+ * relying on the controller library to load the actions.
+ *
+ * @param api the API handle being set up.
+ * @param section the section definition.
+ * @param controlsJ the JSON section, NULL when called at init time.
+ * @return int 0 if OK, other if not.
+ */
+int CtrlControlConfig(afb_api_t api, CtlSectionT *section, json_object *controlsJ)
+{
+    int idx, errcount = 0;
+
+    if (!controlsJ)
+        return 0;
+
+    if (json_object_is_type(controlsJ, json_type_array)) {
+        CtrlControlsCount = (int) json_object_array_length(controlsJ);
+        CtrlControls = calloc(CtrlControlsCount + 1, sizeof(CtrlControlT));
+        for (idx = 0; idx < CtrlControlsCount; idx++)
+            errcount += CtrlControlLoadOne(api, &CtrlControls[idx], json_object_array_get_idx(controlsJ, idx));
+    }
+    else {
+        CtrlControlsCount = 1;
+        CtrlControls = calloc(2, sizeof(CtrlControlT));
+        errcount += CtrlControlLoadOne(api, &CtrlControls[0], controlsJ);
+    }
+
+    return errcount;
+}
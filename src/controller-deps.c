@@ -0,0 +1,290 @@
+/*
+ * Copyright (C) 2018 "IoT.bzh"
+ * Author Romain Forlot <romain@iot.bzh>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "controller-binding.h"
+
+#define DEPS_DEFAULT_TIMEOUT 10000
+
+typedef enum {
+    DEP_PENDING = 0,
+    DEP_READY,
+    DEP_MISSING,
+    DEP_WARMUP_FAILED,
+} CtrlDepStatusT;
+
+static const char *CtrlDepStatus[] = { "timeout", "ready", "missing", "warmup-failed" };
+
+typedef struct {
+    const char *verb;
+    json_object *argsJ;
+} CtrlDepWarmupT;
+
+typedef struct {
+    int id;
+    CtrlDepStatusT status;
+    char *error;
+} CtrlDepResultT;
+
+/*
+ * Shared by the warm-up calls and the init, it outlives the init when some
+ * warm-up did not answer in time. The last one out frees it.
+ */
+typedef struct {
+    afb_api_t api;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int pending;
+    int refcount;
+    CtrlDepResultT *results;
+} CtrlDepsRunT;
+
+typedef struct {
+    CtrlDepsRunT *run;
+    int idx;
+} CtrlDepsJobT;
+
+static CtrlInternT CtrlDeps = { 0 };
+static CtrlDepWarmupT *CtrlDepsWarmups = NULL;
+static int CtrlDepsWarmupsSize = 0;
+static char *CtrlDepsOptional = NULL;
+static int CtrlDepsTimeout = DEPS_DEFAULT_TIMEOUT;
+
+/**
+ * @brief Declare an API the controller depends on, to be resolved at init.
+ *
+ * @param name the API name.
+ */
+void CtrlDepsAdd(const char *name)
+{
+    if (name && *name)
+        CtrlInternAdd(&CtrlDeps, name);
+}
+
+static void DepsCollectActions(CtlActionT *actions)
+{
+    for (int idx = 0; actions && actions[idx].uid; idx++) {
+        if (actions[idx].type == CTL_TYPE_API)
+            CtrlDepsAdd(actions[idx].exec.subcall.api);
+    }
+}
+
+static void DepsRunRelease(CtrlDepsRunT *run)
+{
+    int last;
+
+    pthread_mutex_lock(&run->lock);
+    last = !--run->refcount;
+    pthread_mutex_unlock(&run->lock);
+
+    if (!last)
+        return;
+
+    for (int idx = 0; idx < CtrlDeps.count; idx++)
+        free(run->results[idx].error);
+    free(run->results);
+    pthread_cond_destroy(&run->cond);
+    pthread_mutex_destroy(&run->lock);
+    free(run);
+}
+
+/* A late answer only lands in the results, the init already reported it */
+static void DepsWarmupCB(void *context, json_object *responseJ, const char *error, const char *info, afb_api_t api)
+{
+    CtrlDepsJobT *job = (CtrlDepsJobT *) context;
+    CtrlDepsRunT *run = job->run;
+    CtrlDepResultT *result = &run->results[job->idx];
+
+    free(job);
+
+    pthread_mutex_lock(&run->lock);
+    result->status = error ? DEP_WARMUP_FAILED : DEP_READY;
+    result->error = error ? strdup(error) : NULL;
+    if (!--run->pending)
+        pthread_cond_signal(&run->cond);
+    pthread_mutex_unlock(&run->lock);
+
+    DepsRunRelease(run);
+}
+
+/*
+ * Check every dependency exists, then send all the warm-up calls at once
+ * through the binder, so that the slowest one bounds the boot instead of
+ * their sum, and wait for them up to the timeout. APIs without a warm-up are
+ * started by the binder on their first call.
+ */
+static int DepsResolve(afb_api_t api)
+{
+    CtrlDepsRunT *run;
+    CtrlDepsJobT *job;
+    CtrlDepWarmupT *warmup;
+    json_object *failuresJ;
+    struct timespec until;
+    int idx, errcount = 0;
+
+    run = calloc(1, sizeof(CtrlDepsRunT));
+    run->api = api;
+    run->results = calloc(CtrlDeps.count, sizeof(CtrlDepResultT));
+    run->refcount = 1;
+    pthread_mutex_init(&run->lock, NULL);
+    pthread_cond_init(&run->cond, NULL);
+
+    for (idx = 0; idx < CtrlDeps.count; idx++) {
+        const char *name = CtrlDeps.names[idx];
+
+        run->results[idx].id = idx;
+        warmup = idx < CtrlDepsWarmupsSize ? &CtrlDepsWarmups[idx] : NULL;
+        if (!strcmp(name, afb_api_name(api))) {
+            run->results[idx].status = DEP_READY;
+            continue;
+        }
+        if (afb_api_require_api(api, name, 0)) {
+            run->results[idx].status = DEP_MISSING;
+            continue;
+        }
+        if (!warmup || !warmup->verb) {
+            run->results[idx].status = DEP_READY;
+            continue;
+        }
+
+        job = malloc(sizeof(CtrlDepsJobT));
+        job->run = run;
+        job->idx = idx;
+        pthread_mutex_lock(&run->lock);
+        run->pending++;
+        run->refcount++;
+        pthread_mutex_unlock(&run->lock);
+        afb_api_call(api, name, warmup->verb, json_object_get(warmup->argsJ), DepsWarmupCB, job);
+    }
+
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_sec += CtrlDepsTimeout / 1000;
+    until.tv_nsec += (long) (CtrlDepsTimeout % 1000) * 1000000;
+    if (until.tv_nsec >= 1000000000) {
+        until.tv_sec++;
+        until.tv_nsec -= 1000000000;
+    }
+    pthread_mutex_lock(&run->lock);
+    while (run->pending && pthread_cond_timedwait(&run->cond, &run->lock, &until) != ETIMEDOUT)
+        ;
+
+    /* report every failure at once */
+    failuresJ = json_object_new_array();
+    for (idx = 0; idx < CtrlDeps.count; idx++) {
+        CtrlDepResultT *result = &run->results[idx];
+        const char *name = CtrlDeps.names[idx];
+        json_object *failureJ;
+
+        if (result->status == DEP_READY)
+            continue;
+        wrap_json_pack(&failureJ, "{ss,ss,s?s}", "api", name, "status", CtrlDepStatus[result->status], "error", result->error);
+        json_object_array_add(failuresJ, failureJ);
+
+        if (idx >= CtrlDepsWarmupsSize || !CtrlDepsOptional[idx])
+            errcount++;
+    }
+    pthread_mutex_unlock(&run->lock);
+
+    if (json_object_array_length(failuresJ)) {
+        if (errcount)
+            AFB_API_ERROR(api, "CtrlDepsConfig: unresolved dependencies %s", json_object_to_json_string(failuresJ));
+        else
+            AFB_API_WARNING(api, "CtrlDepsConfig: unresolved optional dependencies %s", json_object_to_json_string(failuresJ));
+    }
+    json_object_put(failuresJ);
+
+    DepsRunRelease(run);
+    return errcount;
+}
+
+static int DepsLoadOne(afb_api_t api, json_object *depJ)
+{
+    const char *name = NULL, *verb = NULL;
+    json_object *argsJ = NULL;
+    int optional = 0, id;
+
+    if (json_object_is_type(depJ, json_type_string)) {
+        name = json_object_get_string(depJ);
+    }
+    else if (wrap_json_unpack(depJ, "{ss,s?s,s?o,s?b}", "api", &name, "warmup", &verb, "args", &argsJ, "optional", &optional)) {
+        AFB_API_ERROR(api, "DepsLoadOne: missing api in %s", json_object_to_json_string(depJ));
+        return ERROR;
+    }
+
+    id = CtrlInternAdd(&CtrlDeps, name);
+    if (id >= CtrlDepsWarmupsSize) {
+        CtrlDepsWarmups = realloc(CtrlDepsWarmups, (size_t) (id + 1) * sizeof(CtrlDepWarmupT));
+        CtrlDepsOptional = realloc(CtrlDepsOptional, (size_t) (id + 1));
+        memset(&CtrlDepsWarmups[CtrlDepsWarmupsSize], 0, (size_t) (id + 1 - CtrlDepsWarmupsSize) * sizeof(CtrlDepWarmupT));
+        memset(&CtrlDepsOptional[CtrlDepsWarmupsSize], 0, (size_t) (id + 1 - CtrlDepsWarmupsSize));
+        CtrlDepsWarmupsSize = id + 1;
+    }
+    CtrlDepsWarmups[id].verb = verb;
+    CtrlDepsWarmups[id].argsJ = json_object_get(argsJ);
+    CtrlDepsOptional[id] = (char) optional;
+
+    return 0;
+}
+
+/**
+ * @brief Controller's 'dependencies' section loader. At init, every API
+ * called by the controls, events and onload actions, plus the ones listed in
+ * the section, are required, and their optional warm-up verbs called
+ * concurrently, before onload actions run.
+ *
+ * @param api the API handle being set up.
+ * @param section the section definition.
+ * @param depsJ the JSON section, NULL when called at init time.
+ * @return int 0 if OK, other if not.
+ */
+int CtrlDepsConfig(afb_api_t api, CtlSectionT *section, json_object *depsJ)
+{
+    json_object *listJ = NULL;
+    CtlConfigT *ctrlConfig;
+    int errcount = 0;
+
+    if (depsJ) {
+        if (wrap_json_unpack(depsJ, "{s?i,s?o}", "timeout", &CtrlDepsTimeout, "apis", &listJ) || CtrlDepsTimeout <= 0) {
+            AFB_API_ERROR(api, "CtrlDepsConfig: invalid 'dependencies' section %s", json_object_to_json_string(depsJ));
+            return ERROR;
+        }
+        if (json_object_is_type(listJ, json_type_array)) {
+            for (int idx = 0; idx < (int) json_object_array_length(listJ); idx++)
+                errcount += DepsLoadOne(api, json_object_array_get_idx(listJ, idx));
+        }
+        else if (listJ) {
+            errcount += DepsLoadOne(api, listJ);
+        }
+        return errcount;
+    }
+
+    ctrlConfig = (CtlConfigT *) afb_api_get_userdata(api);
+    for (int idx = 0; ctrlConfig && ctrlConfig->sections && ctrlConfig->sections[idx].key; idx++)
+        DepsCollectActions(ctrlConfig->sections[idx].actions);
+
+    if (!CtrlDeps.count)
+        return 0;
+
+    return DepsResolve(api);
+}
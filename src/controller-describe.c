@@ -0,0 +1,87 @@
+/*
+ * Copyright (C) 2018 "IoT.bzh"
+ * Author Romain Forlot <romain@iot.bzh>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "controller-binding.h"
+
+#define DESCRIBE_VERSION_LEN 17
+
+/* Built once the API sections are loaded, read-only afterward: only copied */
+static json_object *CtrlDescribeJ = NULL;
+static char CtrlDescribeVersion[DESCRIBE_VERSION_LEN] = "";
+
+/**
+ * @brief Build the controller description served by the describe verb, once
+ * every section is loaded and before the API is sealed. It is serialized
+ * once, its version being a hash of that text so that it only changes with
+ * the configuration.
+ *
+ * @param api the API handle being set up.
+ * @param ctrlConfig the controller's configuration.
+ */
+void CtrlDescribeBuild(afb_api_t api, CtlConfigT *ctrlConfig)
+{
+    json_object *describeJ;
+    const char *text;
+    uint64_t hash;
+
+    wrap_json_pack(&describeJ, "{ss,s?s,s?s,so,so}",
+                   "api", ctrlConfig->api,
+                   "info", ctrlConfig->info,
+                   "config-version", ctrlConfig->version,
+                   "controls", CtrlControlsDescribe(),
+                   "events", CtrlEventsDescribe());
+
+    text = json_object_to_json_string_ext(describeJ, JSON_C_TO_STRING_PLAIN);
+    hash = CtrlHash(text, strlen(text));
+    snprintf(CtrlDescribeVersion, sizeof(CtrlDescribeVersion), "%016llx", (unsigned long long) hash);
+
+    json_object_object_add(describeJ, "version", json_object_new_string(CtrlDescribeVersion));
+    CtrlDescribeJ = CtrlResponseFreeze(describeJ);
+
+    AFB_API_INFO(api, "CtrlDescribeBuild: description version %s", CtrlDescribeVersion);
+}
+
+/**
+ * @brief Verb describing the controls and events of the controller. Given
+ * { "version": "..." } still current, it only answers { "modified": false }.
+ *
+ * @param request AFB request with the JSON arguments if the request got some.
+ */
+void CtrlDescribeRequest(afb_req_t request)
+{
+    const char *version = NULL;
+    json_object *responseJ;
+
+    if (!CtrlDescribeJ) {
+        AFB_ReqFail(request, "unavailable", "Controller description not built yet");
+        return;
+    }
+
+    wrap_json_unpack(afb_req_json(request), "{s?s}", "version", &version);
+    if (version && !strcmp(version, CtrlDescribeVersion)) {
+        wrap_json_pack(&responseJ, "{ss,sb}", "version", CtrlDescribeVersion, "modified", 0);
+        AFB_ReqSuccess(request, responseJ, NULL);
+        return;
+    }
+
+    AFB_ReqSuccess(request, CtrlJsonCopy(CtrlDescribeJ), NULL);
+}
@@ -0,0 +1,582 @@
+/*
+ * Copyright (C) 2018 "IoT.bzh"
+ * Author Romain Forlot <romain@iot.bzh>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "controller-binding.h"
+
+#define EVENTS_MAX_LANES 64
+#define EVENTS_MAX_BATCH 4096
+#define EVENTS_PARTITION_LABEL "$event"
+
+/* Events of a batched label waiting for their actions */
+typedef struct {
+    pthread_mutex_t lock;
+    sd_event_source *timer;
+    json_object *eventsJ;
+    int size;
+    uint64_t delay;
+} CtrlEventBatchT;
+
+/* What the 'events' section binds to one event label */
+typedef struct {
+    char **partition;
+    int depth;
+    int byLabel;
+    int parallel;
+    int join;
+    int lowPriority;
+    CtlActionT **actions;
+    int count;
+    CtrlEventBatchT *batch;
+} CtrlEventBindingT;
+
+typedef struct CtrlLaneItemS {
+    struct CtrlLaneItemS *next;
+    afb_api_t api;
+    CtrlEventBindingT *binding;
+    char *label;
+    char *cid;
+    json_object *eventJ;
+    uint64_t queued;
+} CtrlLaneItemT;
+
+/* A worker lane runs the events actions of its keys in arrival order */
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    CtrlLaneItemT *head;
+    CtrlLaneItemT **tail;
+} CtrlLaneT;
+
+/* Waited by the dispatching thread of a joined fan-out */
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int pending;
+} CtrlFanoutJoinT;
+
+typedef struct CtrlFanoutTaskS {
+    struct CtrlFanoutTaskS *next;
+    afb_api_t api;
+    const char *label;
+    CtlActionT *action;
+    json_object *eventJ;
+    char *cid;
+    CtrlFanoutJoinT *join;
+} CtrlFanoutTaskT;
+
+/* The workers running the actions of parallel bindings */
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    CtrlFanoutTaskT *head;
+    CtrlFanoutTaskT **tail;
+    int count;
+} CtrlFanoutPoolT;
+
+static afb_api_t CtrlEventsApi = NULL;
+static CtrlInternT CtrlEventLabels = { 0 };
+static CtrlEventBindingT *CtrlEventBindings = NULL;
+static int CtrlEventBindingsSize = 0;
+static CtrlLaneT *CtrlLanes = NULL;
+static int CtrlLanesCount = 0;
+static CtrlFanoutPoolT CtrlFanout = { .lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER };
+
+/* The event payload is shared with the action, see CtrlActionQuery */
+static void EventsActionRun(afb_api_t api, const char *label, CtlActionT *action, json_object *eventJ)
+{
+    json_object *queryJ = CtrlActionQuery(action, eventJ);
+    CtlSourceT source;
+
+    memset(&source, 0, sizeof(source));
+    source.uid = label;
+    source.api = api;
+
+    CtrlActionExec(&source, action, queryJ);
+    json_object_put(queryJ);
+}
+
+static void *FanoutThread(void *arg)
+{
+    CtrlFanoutTaskT *task;
+    const char *previous;
+
+    CtrlThreadApply("fanout");
+
+    for (;;) {
+        pthread_mutex_lock(&CtrlFanout.lock);
+        while (!CtrlFanout.head)
+            pthread_cond_wait(&CtrlFanout.cond, &CtrlFanout.lock);
+        task = CtrlFanout.head;
+        CtrlFanout.head = task->next;
+        if (!CtrlFanout.head)
+            CtrlFanout.tail = &CtrlFanout.head;
+        pthread_mutex_unlock(&CtrlFanout.lock);
+
+        previous = CtrlCorrelationSet(task->cid);
+        EventsActionRun(task->api, task->label, task->action, task->eventJ);
+        CtrlCorrelationSet(previous);
+
+        if (task->join) {
+            pthread_mutex_lock(&task->join->lock);
+            if (!--task->join->pending)
+                pthread_cond_signal(&task->join->cond);
+            pthread_mutex_unlock(&task->join->lock);
+        }
+
+        json_object_put(task->eventJ);
+        free(task->cid);
+        free(task);
+    }
+
+    return NULL;
+}
+
+/*
+ * Hand every action of the binding but the first to the fan-out workers, the
+ * dispatching thread runs the first one and, when joined, waits for the others.
+ */
+static void EventsFanout(afb_api_t api, CtrlEventBindingT *binding, const char *label, json_object *eventJ)
+{
+    CtrlFanoutJoinT join = { .lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER };
+    CtrlFanoutTaskT *task, *head = NULL, **tail = &head;
+    const char *cid = CtrlCorrelationGet();
+
+    join.pending = binding->count - 1;
+
+    for (int idx = 1; idx < binding->count; idx++) {
+        task = malloc(sizeof(CtrlFanoutTaskT));
+        task->next = NULL;
+        task->api = api;
+        task->label = label;
+        task->action = binding->actions[idx];
+        /* C actions may modify their payload, json-c refcounts are not atomic */
+        task->eventJ = CtrlJsonCopy(eventJ);
+        task->cid = cid ? strdup(cid) : NULL;
+        task->join = binding->join ? &join : NULL;
+        *tail = task;
+        tail = &task->next;
+    }
+
+    if (head) {
+        pthread_mutex_lock(&CtrlFanout.lock);
+        *CtrlFanout.tail = head;
+        CtrlFanout.tail = tail;
+        pthread_cond_broadcast(&CtrlFanout.cond);
+        pthread_mutex_unlock(&CtrlFanout.lock);
+    }
+
+    EventsActionRun(api, label, binding->actions[0], eventJ);
+
+    if (!binding->join)
+        return;
+
+    pthread_mutex_lock(&join.lock);
+    while (join.pending)
+        pthread_cond_wait(&join.cond, &join.lock);
+    pthread_mutex_unlock(&join.lock);
+    pthread_cond_destroy(&join.cond);
+    pthread_mutex_destroy(&join.lock);
+}
+
+/*
+ * Run the actions bound to the event, without copying its payload unless
+ * they run in parallel. Labels unknown to the section, ie: differing by case,
+ * are left to the controller library.
+ */
+static void LaneDispatch(afb_api_t api, CtrlEventBindingT *binding, const char *label, json_object *eventJ)
+{
+    if (!binding || !binding->count) {
+        CtrlDispatchApiEvent(api, label, eventJ);
+        return;
+    }
+
+    if (binding->parallel && binding->count > 1 && CtrlFanout.count) {
+        EventsFanout(api, binding, label, eventJ);
+        return;
+    }
+
+    for (int idx = 0; idx < binding->count; idx++)
+        EventsActionRun(api, label, binding->actions[idx], eventJ);
+}
+
+static void *LaneThread(void *arg)
+{
+    CtrlLaneT *lane = (CtrlLaneT *) arg;
+    CtrlLaneItemT *item;
+    const char *previous;
+
+    CtrlThreadApply("lanes");
+
+    for (;;) {
+        pthread_mutex_lock(&lane->lock);
+        while (!lane->head)
+            pthread_cond_wait(&lane->cond, &lane->lock);
+        item = lane->head;
+        lane->head = item->next;
+        if (!lane->head)
+            lane->tail = &lane->head;
+        pthread_mutex_unlock(&lane->lock);
+
+        CtrlShedQueueDelay(item->queued);
+        previous = CtrlCorrelationSet(item->cid);
+        LaneDispatch(item->api, item->binding, item->label, item->eventJ);
+        CtrlCorrelationSet(previous);
+
+        json_object_put(item->eventJ);
+        free(item->label);
+        free(item->cid);
+        free(item);
+    }
+
+    return NULL;
+}
+
+/* Take the pending batch, called with the batch lock held */
+static json_object *BatchTake(afb_api_t api, CtrlEventBatchT *batch)
+{
+    json_object *eventsJ = batch->eventsJ;
+
+    batch->eventsJ = NULL;
+    /* queued after the arming of this batch, before the one of the next */
+    CtrlTimerArm(api, batch->timer, 0);
+
+    return eventsJ;
+}
+
+static int BatchTimerCB(sd_event_source *source, uint64_t usec, void *userdata)
+{
+    int id = (int) (intptr_t) userdata;
+    CtrlEventBindingT *binding = &CtrlEventBindings[id];
+    json_object *eventsJ;
+
+    pthread_mutex_lock(&binding->batch->lock);
+    eventsJ = BatchTake(CtrlEventsApi, binding->batch);
+    pthread_mutex_unlock(&binding->batch->lock);
+
+    if (eventsJ) {
+        LaneDispatch(CtrlEventsApi, binding, CtrlEventLabels.names[id], eventsJ);
+        json_object_put(eventsJ);
+    }
+
+    return 0;
+}
+
+/*
+ * Accumulate the event into its label's batch, the actions get the batch as
+ * an array once full or 'delay' after its first event.
+ */
+static void BatchAdd(afb_api_t api, CtrlEventBindingT *binding, const char *label, json_object *eventJ)
+{
+    CtrlEventBatchT *batch = binding->batch;
+    json_object *eventsJ = NULL;
+
+    pthread_mutex_lock(&batch->lock);
+    if (!batch->eventsJ) {
+        batch->eventsJ = json_object_new_array();
+        CtrlTimerArm(api, batch->timer, CtrlNowUsec() + CtrlShedStretch(batch->delay));
+    }
+    /* the batch outlives the caller's reference, json-c refcounts are not atomic */
+    json_object_array_add(batch->eventsJ, CtrlJsonCopy(eventJ));
+    if ((int) json_object_array_length(batch->eventsJ) >= batch->size)
+        eventsJ = BatchTake(api, batch);
+    pthread_mutex_unlock(&batch->lock);
+
+    if (eventsJ) {
+        LaneDispatch(api, binding, label, eventsJ);
+        json_object_put(eventsJ);
+    }
+}
+
+/**
+ * @brief Run the 'events' section actions bound to an event. Events of a
+ * partitioned binding are queued to the worker lane of their key: events with
+ * the same key are processed in order, different keys in parallel.
+ *
+ * @param api the API handle receiving the event.
+ * @param evtLabel the event label.
+ * @param eventJ the event payload.
+ */
+void CtrlEventsDispatch(afb_api_t api, const char *evtLabel, json_object *eventJ)
+{
+    int id = CtrlInternFind(&CtrlEventLabels, evtLabel);
+    CtrlEventBindingT *binding = id >= 0 ? &CtrlEventBindings[id] : NULL;
+    json_object *keyJ;
+    const char *key, *cid;
+    CtrlLaneItemT *item;
+    CtrlLaneT *lane;
+
+    if (binding)
+        evtLabel = CtrlEventLabels.names[id];
+
+    if (binding && binding->batch) {
+        BatchAdd(api, binding, evtLabel, eventJ);
+        return;
+    }
+
+    if (!binding || !CtrlLanesCount || (!binding->partition && !binding->byLabel)) {
+        LaneDispatch(api, binding, evtLabel, eventJ);
+        return;
+    }
+
+    key = evtLabel;
+    if (binding->partition && (keyJ = CtrlJsonPathGet(eventJ, binding->partition, binding->depth)))
+        key = json_object_get_string(keyJ);
+    lane = &CtrlLanes[CtrlHash(key, strlen(key)) % (uint64_t) CtrlLanesCount];
+
+    cid = CtrlCorrelationGet();
+    item = malloc(sizeof(CtrlLaneItemT));
+    item->next = NULL;
+    item->api = api;
+    item->binding = binding;
+    item->label = strdup(evtLabel);
+    item->cid = cid ? strdup(cid) : NULL;
+    /* the lane thread outlives the caller's reference, json-c refcounts are not atomic */
+    item->eventJ = CtrlJsonCopy(eventJ);
+    item->queued = CtrlNowUsec();
+
+    pthread_mutex_lock(&lane->lock);
+    *lane->tail = item;
+    lane->tail = &item->next;
+    pthread_cond_signal(&lane->cond);
+    pthread_mutex_unlock(&lane->lock);
+}
+
+/**
+ * @brief Whether an event is bound with a low priority, the first one to be
+ * dropped under overload.
+ *
+ * @param evtLabel the event label.
+ * @return int 1 if low priority, 0 if not.
+ */
+int CtrlEventsLowPriority(const char *evtLabel)
+{
+    int id = CtrlInternFind(&CtrlEventLabels, evtLabel);
+
+    return id >= 0 && CtrlEventBindings[id].lowPriority;
+}
+
+/**
+ * @brief Describe the events the controller acts on, for the describe verb.
+ *
+ * @return json_object* the events description array.
+ */
+json_object *CtrlEventsDescribe(void)
+{
+    json_object *eventsJ = json_object_new_array(), *eventJ;
+
+    for (int idx = 0; idx < CtrlEventLabels.count; idx++) {
+        CtrlEventBindingT *binding = &CtrlEventBindings[idx];
+
+        wrap_json_pack(&eventJ, "{ss,sb,sb,sb,ss}",
+                       "uid", CtrlEventLabels.names[idx],
+                       "partitioned", binding->partition || binding->byLabel,
+                       "parallel", binding->parallel,
+                       "batched", !!binding->batch,
+                       "priority", binding->lowPriority ? "low" : "normal");
+        json_object_array_add(eventsJ, eventJ);
+    }
+
+    return eventsJ;
+}
+
+static int EventsLoadBinding(afb_api_t api, json_object *bindingJ)
+{
+    const char *label = NULL, *partition = NULL, *priority = NULL;
+    json_object *batchJ = NULL;
+    CtrlEventBindingT *binding;
+    int id, parallel = 0, join = 0, size = 0, delay = 0;
+
+    if (wrap_json_unpack(bindingJ, "{ss,s?s,s?b,s?b,s?o,s?s}", "uid", &label, "partition", &partition,
+                         "parallel", &parallel, "join", &join, "batch", &batchJ, "priority", &priority)) {
+        AFB_API_ERROR(api, "EventsLoadBinding: missing uid in %s", json_object_to_json_string(bindingJ));
+        return ERROR;
+    }
+
+    if (batchJ && (wrap_json_unpack(batchJ, "{si,si}", "size", &size, "delay", &delay) ||
+                   size <= 0 || size > EVENTS_MAX_BATCH || delay <= 0)) {
+        AFB_API_ERROR(api, "EventsLoadBinding: invalid batch of '%s', needs size (max %d) and delay",
+                      label, EVENTS_MAX_BATCH);
+        return ERROR;
+    }
+
+    id = CtrlInternAdd(&CtrlEventLabels, label);
+    if (id >= CtrlEventBindingsSize) {
+        CtrlEventBindings = realloc(CtrlEventBindings, (size_t) (id + 1) * sizeof(CtrlEventBindingT));
+        memset(&CtrlEventBindings[CtrlEventBindingsSize], 0, (size_t) (id + 1 - CtrlEventBindingsSize) * sizeof(CtrlEventBindingT));
+        CtrlEventBindingsSize = id + 1;
+    }
+    binding = &CtrlEventBindings[id];
+
+    binding->parallel |= parallel;
+    binding->join |= join;
+    if (priority && !strcmp(priority, "low"))
+        binding->lowPriority = 1;
+
+    /* the first binding of a label giving a batch sets it */
+    if (batchJ && !binding->batch) {
+        binding->batch = calloc(1, sizeof(CtrlEventBatchT));
+        pthread_mutex_init(&binding->batch->lock, NULL);
+        binding->batch->size = size;
+        binding->batch->delay = (uint64_t) delay * 1000;
+    }
+
+    /* the first binding of a label giving a partition key sets it */
+    if (partition && !binding->partition && !binding->byLabel) {
+        if (!strcmp(partition, EVENTS_PARTITION_LABEL))
+            binding->byLabel = 1;
+        else
+            binding->partition = CtrlJsonPathCompile(partition, &binding->depth);
+    }
+
+    return 0;
+}
+
+/* Bind the actions loaded by the controller library to their labels */
+static void EventsCollectActions(CtlActionT *actions)
+{
+    CtrlEventBindingT *binding;
+    int id;
+
+    for (int idx = 0; actions && actions[idx].uid; idx++) {
+        id = CtrlInternFind(&CtrlEventLabels, actions[idx].uid);
+        if (id < 0)
+            continue;
+        binding = &CtrlEventBindings[id];
+        binding->actions = realloc(binding->actions, (size_t) (binding->count + 1) * sizeof(CtlActionT *));
+        binding->actions[binding->count++] = &actions[idx];
+    }
+}
+
+static int EventsStartThreads(afb_api_t api, int count, void *(*routine)(void *), void *arg, size_t argSize)
+{
+    pthread_attr_t attr;
+    pthread_t thread;
+    int started = 0;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    for (; started < count; started++) {
+        if (pthread_create(&thread, &attr, routine, (char *) arg + (size_t) started * argSize)) {
+            AFB_API_ERROR(api, "EventsStartThreads: fail to start events thread %d", started);
+            break;
+        }
+    }
+    pthread_attr_destroy(&attr);
+
+    return started;
+}
+
+/**
+ * @brief Controller's 'events' section loader. Wraps the controller
+ * library's EventConfig to handle the bindings extra keys:
+ * - 'partition': a payload field, or "$event" for the event label, spreading
+ *   the bindings actions on ordered worker lanes.
+ * - 'parallel': run every action bound to the event label concurrently, and
+ *   'join' to wait for all of them before the next event.
+ * - 'batch': { "size": 64, "delay": 10 } hand the events to the actions as an
+ *   array of up to 'size' events, at most 'delay' milliseconds late.
+ * - 'priority': "low" for events dropped first under overload.
+ * The section is either the bindings array, or
+ * { "lanes": 4, "workers": 4, "bindings": [...] }, lanes and fan-out workers
+ * defaulting to the online CPUs.
+ *
+ * @param api the API handle being set up.
+ * @param section the section definition.
+ * @param eventsJ the JSON section, NULL when called at init time.
+ * @return int 0 if OK, other if not.
+ */
+int CtrlEventsConfig(afb_api_t api, CtlSectionT *section, json_object *eventsJ)
+{
+    json_object *bindingsJ = eventsJ;
+    int errcount = 0, partitioned = 0, parallel = 0;
+    int lanes = (int) sysconf(_SC_NPROCESSORS_ONLN), workers = lanes;
+
+    if (!eventsJ) {
+        CtrlEventsApi = api;
+        EventsCollectActions(section->actions);
+
+        /* batches are flushed by timers on the binder's loop */
+        for (int idx = 0; idx < CtrlEventLabels.count; idx++) {
+            CtrlEventBatchT *batch = CtrlEventBindings[idx].batch;
+            if (!batch)
+                continue;
+            if (sd_event_add_time(afb_api_get_event_loop(api), &batch->timer, CLOCK_MONOTONIC,
+                                  CtrlNowUsec() + batch->delay, 1000, BatchTimerCB, (void *) (intptr_t) idx) < 0) {
+                AFB_API_ERROR(api, "CtrlEventsConfig: fail to create batch timer of '%s'", CtrlEventLabels.names[idx]);
+                errcount++;
+                continue;
+            }
+            sd_event_source_set_enabled(batch->timer, SD_EVENT_OFF);
+        }
+        if (errcount)
+            return errcount;
+
+        return EventConfig(api, section, NULL);
+    }
+
+    if (json_object_is_type(eventsJ, json_type_object) && json_object_object_get_ex(eventsJ, "bindings", NULL) &&
+        (wrap_json_unpack(eventsJ, "{s?i,s?i,so}", "lanes", &lanes, "workers", &workers, "bindings", &bindingsJ) ||
+         lanes <= 0 || lanes > EVENTS_MAX_LANES || workers <= 0 || workers > EVENTS_MAX_LANES)) {
+        AFB_API_ERROR(api, "CtrlEventsConfig: invalid 'events' section %s", json_object_to_json_string(eventsJ));
+        return ERROR;
+    }
+
+    if (json_object_is_type(bindingsJ, json_type_array)) {
+        for (int idx = 0; idx < (int) json_object_array_length(bindingsJ); idx++)
+            errcount += EventsLoadBinding(api, json_object_array_get_idx(bindingsJ, idx));
+    }
+    else {
+        errcount += EventsLoadBinding(api, bindingsJ);
+    }
+    if (errcount)
+        return errcount;
+
+    for (int idx = 0; idx < CtrlEventLabels.count; idx++) {
+        partitioned |= CtrlEventBindings[idx].partition || CtrlEventBindings[idx].byLabel;
+        parallel |= CtrlEventBindings[idx].parallel;
+    }
+
+    if (partitioned) {
+        lanes = lanes < EVENTS_MAX_LANES ? lanes : EVENTS_MAX_LANES;
+        CtrlLanes = calloc(lanes, sizeof(CtrlLaneT));
+        for (int idx = 0; idx < lanes; idx++) {
+            pthread_mutex_init(&CtrlLanes[idx].lock, NULL);
+            pthread_cond_init(&CtrlLanes[idx].cond, NULL);
+            CtrlLanes[idx].tail = &CtrlLanes[idx].head;
+        }
+        CtrlLanesCount = EventsStartThreads(api, lanes, LaneThread, CtrlLanes, sizeof(CtrlLaneT));
+        if (CtrlLanesCount < lanes)
+            return ERROR;
+    }
+
+    if (parallel) {
+        CtrlFanout.tail = &CtrlFanout.head;
+        CtrlFanout.count = EventsStartThreads(api, workers < EVENTS_MAX_LANES ? workers : EVENTS_MAX_LANES,
+                                              FanoutThread, NULL, 0);
+        if (!CtrlFanout.count)
+            return ERROR;
+    }
+
+    return EventConfig(api, section, bindingsJ);
+}
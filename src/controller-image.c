@@ -0,0 +1,331 @@
+/*
+ * Copyright (C) 2018 "IoT.bzh"
+ * Author Romain Forlot <romain@iot.bzh>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "controller-binding.h"
+
+#define IMAGE_MAGIC "CTLIMG1"
+
+/*
+ * The image is a read-only file mapped by every controller process using it,
+ * so that the page cache holds a single copy of the controller's load time
+ * strings. Everything in it is addressed by offsets from its start:
+ *
+ *   header | entries sorted by hash | NUL terminated strings
+ *
+ * Strings are looked up by content, an image built from another
+ * configuration only costs the strings it misses. Only strings are shared,
+ * the tables indexing them (interned names, triggers) stay private.
+ */
+typedef struct {
+    char magic[8];
+    uint32_t count;
+    uint32_t size;
+} CtrlImageHeaderT;
+
+typedef struct {
+    uint64_t hash;
+    uint32_t offset;
+    uint32_t length;
+} CtrlImageEntryT;
+
+/* Strings missing from the mapped image, written to the next one */
+typedef struct CtrlImageMissS {
+    struct CtrlImageMissS *next;
+    uint64_t hash;
+    size_t length;
+    char *text;
+} CtrlImageMissT;
+
+static const char *CtrlImagePath = NULL;
+static const char *CtrlImageBase = NULL;
+static size_t CtrlImageSize = 0;
+static const CtrlImageEntryT *CtrlImageEntries = NULL;
+static uint32_t CtrlImageCount = 0;
+static uint8_t *CtrlImageUsed = NULL;
+static uint32_t CtrlImageUsedCount = 0;
+static CtrlImageMissT *CtrlImageMisses = NULL;
+static int CtrlImageMissCount = 0;
+
+static const char *ImageLookup(uint64_t hash, const char *text, size_t length)
+{
+    uint32_t low = 0, high = CtrlImageCount, mid;
+
+    while (low < high) {
+        mid = low + (high - low) / 2;
+        if (CtrlImageEntries[mid].hash < hash)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+
+    for (; low < CtrlImageCount && CtrlImageEntries[low].hash == hash; low++) {
+        const CtrlImageEntryT *entry = &CtrlImageEntries[low];
+        if (entry->length == length && !memcmp(CtrlImageBase + entry->offset, text, length)) {
+            if (!CtrlImageUsed[low]) {
+                CtrlImageUsed[low] = 1;
+                CtrlImageUsedCount++;
+            }
+            return CtrlImageBase + entry->offset;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Get a load time string, from the shared image when it holds it, or
+ * a private copy recorded for the next image.
+ *
+ * @param text the string.
+ * @return const char* the string to keep, release it with CtrlImageRelease.
+ */
+const char *CtrlImageString(const char *text)
+{
+    size_t length = strlen(text);
+    uint64_t hash = CtrlHash(text, length);
+    const char *shared;
+    CtrlImageMissT *miss;
+
+    if (CtrlImageBase && (shared = ImageLookup(hash, text, length)))
+        return shared;
+
+    if (!CtrlImagePath)
+        return strdup(text);
+
+    miss = malloc(sizeof(CtrlImageMissT));
+    miss->hash = hash;
+    miss->length = length;
+    miss->text = strdup(text);
+    miss->next = CtrlImageMisses;
+    CtrlImageMisses = miss;
+    CtrlImageMissCount++;
+
+    return miss->text;
+}
+
+/**
+ * @brief Release a string given by CtrlImageString, shared ones are left
+ * alone. Usable as a json-c user data destructor.
+ *
+ * @param jso unused, the json-c object owning the string.
+ * @param text the string.
+ */
+void CtrlImageRelease(json_object *jso, void *text)
+{
+    CtrlImageMissT **miss;
+
+    if (CtrlImageBase && (const char *) text >= CtrlImageBase && (const char *) text < CtrlImageBase + CtrlImageSize)
+        return;
+
+    for (miss = &CtrlImageMisses; *miss; miss = &(*miss)->next) {
+        if ((*miss)->text == text) {
+            CtrlImageMissT *found = *miss;
+            *miss = found->next;
+            CtrlImageMissCount--;
+            free(found);
+            break;
+        }
+    }
+
+    free(text);
+}
+
+static int ImageCompareEntries(const void *a, const void *b)
+{
+    const CtrlImageEntryT *left = (const CtrlImageEntryT *) a, *right = (const CtrlImageEntryT *) b;
+
+    return left->hash < right->hash ? -1 : left->hash > right->hash;
+}
+
+/*
+ * A truncated or foreign image must not make lookups read past the mapping:
+ * every string has to lie after the entries, NUL terminated, and the entries
+ * be sorted for the binary search.
+ */
+static int ImageEntriesValid(const char *base, size_t size, uint32_t count)
+{
+    const CtrlImageEntryT *entries = (const CtrlImageEntryT *) (base + sizeof(CtrlImageHeaderT));
+    size_t strings = sizeof(CtrlImageHeaderT) + (size_t) count * sizeof(CtrlImageEntryT);
+
+    for (uint32_t idx = 0; idx < count; idx++) {
+        size_t offset = entries[idx].offset, length = entries[idx].length;
+
+        if (offset < strings || offset + length >= size || base[offset + length] != '\0' ||
+            (idx && entries[idx - 1].hash > entries[idx].hash))
+            return 0;
+    }
+
+    return 1;
+}
+
+static int ImageMap(afb_api_t api)
+{
+    const CtrlImageHeaderT *header;
+    struct stat st;
+    void *base;
+    int fd;
+
+    fd = open(CtrlImagePath, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return 0;
+
+    if (fstat(fd, &st) || (size_t) st.st_size < sizeof(CtrlImageHeaderT) ||
+        (base = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+        close(fd);
+        return 0;
+    }
+    close(fd);
+
+    header = (const CtrlImageHeaderT *) base;
+    if (memcmp(header->magic, IMAGE_MAGIC, sizeof(header->magic)) || header->size != (uint32_t) st.st_size ||
+        sizeof(CtrlImageHeaderT) + (size_t) header->count * sizeof(CtrlImageEntryT) > (size_t) st.st_size ||
+        !ImageEntriesValid((const char *) base, (size_t) st.st_size, header->count)) {
+        AFB_API_WARNING(api, "ImageMap: ignoring invalid image %s", CtrlImagePath);
+        munmap(base, (size_t) st.st_size);
+        return 0;
+    }
+
+    CtrlImageBase = (const char *) base;
+    CtrlImageSize = (size_t) st.st_size;
+    CtrlImageEntries = (const CtrlImageEntryT *) (CtrlImageBase + sizeof(CtrlImageHeaderT));
+    CtrlImageCount = header->count;
+    CtrlImageUsed = calloc(CtrlImageCount ? CtrlImageCount : 1, sizeof(uint8_t));
+
+    return 1;
+}
+
+/*
+ * Write a new image with the mapped strings this configuration looked up and
+ * the missed ones, next to the current one then renamed over it: processes
+ * mapping the previous image keep their mapping, the next ones get the new
+ * image. Strings no longer referenced are dropped.
+ */
+static int ImageWrite(afb_api_t api)
+{
+    uint32_t count = CtrlImageUsedCount + (uint32_t) CtrlImageMissCount, idx = 0;
+    size_t offset = sizeof(CtrlImageHeaderT) + (size_t) count * sizeof(CtrlImageEntryT), size = offset;
+    CtrlImageHeaderT header;
+    CtrlImageEntryT *entries;
+    CtrlImageMissT *miss;
+    char *tmpPath;
+    FILE *file;
+    int err = 0;
+
+    for (idx = 0; idx < CtrlImageCount; idx++) {
+        if (CtrlImageUsed[idx])
+            size += CtrlImageEntries[idx].length + 1;
+    }
+    for (miss = CtrlImageMisses; miss; miss = miss->next)
+        size += miss->length + 1;
+    if (size > UINT32_MAX) {
+        AFB_API_ERROR(api, "ImageWrite: image would be too large (%zu bytes)", size);
+        return ERROR;
+    }
+
+    entries = malloc((size_t) (count ? count : 1) * sizeof(CtrlImageEntryT));
+    idx = 0;
+    for (uint32_t old = 0; old < CtrlImageCount; old++) {
+        if (!CtrlImageUsed[old])
+            continue;
+        entries[idx] = CtrlImageEntries[old];
+        entries[idx].offset = (uint32_t) offset;
+        offset += entries[idx++].length + 1;
+    }
+    for (miss = CtrlImageMisses; miss; miss = miss->next, idx++) {
+        entries[idx].hash = miss->hash;
+        entries[idx].length = (uint32_t) miss->length;
+        entries[idx].offset = (uint32_t) offset;
+        offset += miss->length + 1;
+    }
+
+    /* strings are written in the entries order before sorting them */
+    if (asprintf(&tmpPath, "%s.%d", CtrlImagePath, (int) getpid()) < 0 || !(file = fopen(tmpPath, "we"))) {
+        AFB_API_ERROR(api, "ImageWrite: fail to create image %s", CtrlImagePath);
+        free(entries);
+        return ERROR;
+    }
+
+    memcpy(header.magic, IMAGE_MAGIC, sizeof(header.magic));
+    header.count = count;
+    header.size = (uint32_t) size;
+    fseek(file, (long) (sizeof(CtrlImageHeaderT) + (size_t) count * sizeof(CtrlImageEntryT)), SEEK_SET);
+    for (idx = 0; idx < CtrlImageCount; idx++) {
+        if (CtrlImageUsed[idx])
+            err |= fwrite(CtrlImageBase + CtrlImageEntries[idx].offset, CtrlImageEntries[idx].length + 1, 1, file) != 1;
+    }
+    for (miss = CtrlImageMisses; miss; miss = miss->next)
+        err |= fwrite(miss->text, miss->length + 1, 1, file) != 1;
+
+    qsort(entries, count, sizeof(CtrlImageEntryT), ImageCompareEntries);
+    fseek(file, 0, SEEK_SET);
+    err |= fwrite(&header, sizeof(header), 1, file) != 1;
+    err |= fwrite(entries, sizeof(CtrlImageEntryT), count, file) != count;
+    err |= fclose(file) != 0;
+    free(entries);
+
+    if (err || rename(tmpPath, CtrlImagePath)) {
+        AFB_API_ERROR(api, "ImageWrite: fail to write image %s", CtrlImagePath);
+        unlink(tmpPath);
+        free(tmpPath);
+        return ERROR;
+    }
+    free(tmpPath);
+
+    AFB_API_NOTICE(api, "ImageWrite: image %s written with %u strings", CtrlImagePath, count);
+    return 0;
+}
+
+/**
+ * @brief Controller's 'image' section loader: { "path": "/var/cache/ctl.img" }
+ * Maps the image shared by the controller processes of a same configuration
+ * before the other sections load, and writes an updated image at init when
+ * this process had to keep private copies of some strings, or did not use
+ * some of the image's. Failing to write the image is not fatal, it only costs
+ * memory.
+ *
+ * @param api the API handle being set up.
+ * @param section the section definition.
+ * @param imageJ the JSON section, NULL when called at init time.
+ * @return int 0 if OK, other if not.
+ */
+int CtrlImageConfig(afb_api_t api, CtlSectionT *section, json_object *imageJ)
+{
+    if (!imageJ) {
+        if (CtrlImagePath && (CtrlImageMissCount || CtrlImageUsedCount < CtrlImageCount))
+            ImageWrite(api);
+        return 0;
+    }
+
+    if (wrap_json_unpack(imageJ, "{ss}", "path", &CtrlImagePath)) {
+        AFB_API_ERROR(api, "CtrlImageConfig: invalid 'image' section %s", json_object_to_json_string(imageJ));
+        return ERROR;
+    }
+
+    if (!ImageMap(api))
+        AFB_API_NOTICE(api, "CtrlImageConfig: no usable image %s yet", CtrlImagePath);
+
+    return 0;
+}
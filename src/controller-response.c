@@ -0,0 +1,249 @@
+/*
+ * Copyright (C) 2018 "IoT.bzh"
+ * Author Romain Forlot <romain@iot.bzh>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "controller-binding.h"
+
+/*
+ * A template node is either a frozen constant subtree, a slot substituted at
+ * render time by a field of the values object, or a container holding at
+ * least one slot somewhere below it.
+ */
+typedef struct CtrlTemplateNodeS {
+    const char *key;
+    const char *slot;
+    json_object *constJ;
+    int isArray;
+    int count;
+    struct CtrlTemplateNodeS *children;
+} CtrlTemplateNodeT;
+
+struct CtrlTemplateS {
+    CtrlTemplateNodeT root;
+};
+
+typedef struct CtrlPublishedEventS {
+    const char *name;
+    afb_event_t event;
+    struct CtrlPublishedEventS *next;
+} CtrlPublishedEventT;
+
+static CtrlPublishedEventT *CtrlPublishedEvents = NULL;
+static pthread_mutex_t CtrlPublishedLock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * @brief Serialize once a JSON object and make json-c reuse that text each time
+ * the object, or any object holding it, gets serialized again.
+ *
+ * The object must not be modified afterward, nor shared between threads with
+ * json_object_get whose reference count is not atomic: hand each user its own
+ * CtrlJsonCopy, serializing the same frozen text. Load time only, the text
+ * comes from the shared image when there is one.
+ *
+ * @param responseJ JSON object to freeze, ownership is kept by the caller.
+ * @return json_object* the same object, for convenience.
+ */
+json_object *CtrlResponseFreeze(json_object *responseJ)
+{
+    const char *text;
+
+    if (!json_object_is_type(responseJ, json_type_object) &&
+        !json_object_is_type(responseJ, json_type_array))
+        return responseJ;
+
+    text = json_object_to_json_string_ext(responseJ, JSON_C_TO_STRING_PLAIN);
+    json_object_set_serializer(responseJ,
+                               json_object_userdata_to_json_string,
+                               (void *) CtrlImageString(text),
+                               CtrlImageRelease);
+
+    return responseJ;
+}
+
+/* Check whether valueJ is a "${name}" slot string */
+static int TemplateIsSlot(json_object *valueJ)
+{
+    const char *value;
+    size_t len;
+
+    if (!json_object_is_type(valueJ, json_type_string))
+        return 0;
+
+    value = json_object_get_string(valueJ);
+    len = strlen(value);
+
+    return len >= 4 && !strncmp(value, "${", 2) && value[len - 1] == '}';
+}
+
+static int TemplateHasSlot(json_object *valueJ)
+{
+    struct json_object_iter iter;
+    size_t idx, count;
+
+    if (TemplateIsSlot(valueJ))
+        return 1;
+
+    if (json_object_is_type(valueJ, json_type_object)) {
+        json_object_object_foreachC(valueJ, iter) {
+            if (TemplateHasSlot(iter.val))
+                return 1;
+        }
+    }
+    else if (json_object_is_type(valueJ, json_type_array)) {
+        count = json_object_array_length(valueJ);
+        for (idx = 0; idx < count; idx++) {
+            if (TemplateHasSlot(json_object_array_get_idx(valueJ, idx)))
+                return 1;
+        }
+    }
+
+    return 0;
+}
+
+static void TemplateCompileNode(CtrlTemplateNodeT *node, const char *key, json_object *valueJ)
+{
+    int idx = 0;
+
+    node->key = key ? strdup(key) : NULL;
+
+    if (TemplateIsSlot(valueJ)) {
+        node->slot = strndup(json_object_get_string(valueJ) + 2,
+                             (size_t) json_object_get_string_len(valueJ) - 3);
+        return;
+    }
+
+    if (!TemplateHasSlot(valueJ)) {
+        node->constJ = CtrlResponseFreeze(CtrlJsonCopy(valueJ));
+        return;
+    }
+
+    if (json_object_is_type(valueJ, json_type_array)) {
+        node->isArray = 1;
+        node->count = (int) json_object_array_length(valueJ);
+        node->children = calloc(node->count, sizeof(CtrlTemplateNodeT));
+        for (idx = 0; idx < node->count; idx++)
+            TemplateCompileNode(&node->children[idx], NULL, json_object_array_get_idx(valueJ, idx));
+        return;
+    }
+
+    node->count = json_object_object_length(valueJ);
+    node->children = calloc(node->count, sizeof(CtrlTemplateNodeT));
+    json_object_object_foreach(valueJ, memberKey, memberJ) {
+        TemplateCompileNode(&node->children[idx++], memberKey, memberJ);
+    }
+}
+
+/**
+ * @brief Compile a JSON skeleton into a template. String leaves written as
+ * "${field}" are slots, everything else is frozen once for every rendered
+ * instance.
+ *
+ * @param api the API handle used for logging.
+ * @param skeletonJ the JSON skeleton, ownership is kept by the caller.
+ * @return CtrlTemplateT* the compiled template or NULL on error.
+ */
+CtrlTemplateT *CtrlTemplateCompile(afb_api_t api, json_object *skeletonJ)
+{
+    CtrlTemplateT *template;
+
+    if (!skeletonJ) {
+        AFB_API_ERROR(api, "CtrlTemplateCompile: missing skeleton");
+        return NULL;
+    }
+
+    template = calloc(1, sizeof(CtrlTemplateT));
+    TemplateCompileNode(&template->root, NULL, skeletonJ);
+
+    return template;
+}
+
+static json_object *TemplateRenderNode(CtrlTemplateNodeT *node, json_object *valuesJ)
+{
+    json_object *renderedJ, *valueJ = NULL;
+    int idx;
+
+    if (node->constJ)
+        return CtrlJsonCopy(node->constJ);
+
+    if (node->slot) {
+        json_object_object_get_ex(valuesJ, node->slot, &valueJ);
+        return json_object_get(valueJ);
+    }
+
+    if (node->isArray) {
+        renderedJ = json_object_new_array();
+        for (idx = 0; idx < node->count; idx++)
+            json_object_array_add(renderedJ, TemplateRenderNode(&node->children[idx], valuesJ));
+        return renderedJ;
+    }
+
+    renderedJ = json_object_new_object();
+    for (idx = 0; idx < node->count; idx++)
+        json_object_object_add(renderedJ, node->children[idx].key,
+                               TemplateRenderNode(&node->children[idx], valuesJ));
+
+    return renderedJ;
+}
+
+/**
+ * @brief Render a template. Constant parts are copied with their serialized
+ * text already cached, only the slots get serialized again.
+ *
+ * @param template a compiled template.
+ * @param valuesJ JSON object providing the slots values, ownership is kept by
+ * the caller.
+ * @return json_object* a new reference to the rendered object.
+ */
+json_object *CtrlTemplateRender(CtrlTemplateT *template, json_object *valuesJ)
+{
+    return TemplateRenderNode(&template->root, valuesJ);
+}
+
+/**
+ * @brief Retrieve, or create on first use, an event published by the
+ * controller API under the given name.
+ *
+ * @param api the controller API handle.
+ * @param name the event name.
+ * @return afb_event_t the event, invalid if it could not be created.
+ */
+afb_event_t CtrlEventGet(afb_api_t api, const char *name)
+{
+    CtrlPublishedEventT *published;
+
+    pthread_mutex_lock(&CtrlPublishedLock);
+    for (published = CtrlPublishedEvents; published; published = published->next) {
+        if (!strcmp(published->name, name))
+            break;
+    }
+
+    if (!published && api) {
+        published = calloc(1, sizeof(CtrlPublishedEventT));
+        published->name = strdup(name);
+        published->event = afb_api_make_event(api, name);
+        published->next = CtrlPublishedEvents;
+        CtrlPublishedEvents = published;
+    }
+    pthread_mutex_unlock(&CtrlPublishedLock);
+
+    return published ? published->event : NULL;
+}
@@ -0,0 +1,433 @@
+/*
+ * Copyright (C) 2018 "IoT.bzh"
+ * Author Romain Forlot <romain@iot.bzh>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "controller-binding.h"
+
+#define ROUTER_VNODES 64
+#define ROUTER_DEFAULT_INTERVAL 1000
+#define ROUTER_DEFAULT_FAILURES 3
+#define ROUTER_DEFAULT_VERB "ping-global"
+
+/*
+ * Router mode: the front process forwards controls to worker processes
+ * running the same configuration. Workers are APIs imported by the front
+ * binder over local sockets (--ws-client). A process is the front only when
+ * the environment variable CONTROL_PREFIX "_ROUTER" is set, so that the
+ * workers load the same configuration and run the controls themselves. Workers
+ * check the LOA of their controls like any controller: the front forwards the
+ * 'auth' calls to every worker for them to authenticate the session too.
+ */
+
+typedef enum {
+    ROUTER_HASH = 0,
+    ROUTER_LEAST_LOADED,
+} CtrlRouterStrategyT;
+
+typedef struct {
+    const char *api;
+    int healthy;
+    int failures;
+    int inflight;
+    uint64_t forwarded;
+    uint64_t failovers;
+} CtrlRouterWorkerT;
+
+typedef struct {
+    uint32_t hash;
+    int worker;
+} CtrlRouterVnodeT;
+
+/* A forwarded request, kept to fail over to another worker */
+typedef struct {
+    afb_req_t request;
+    const char *verb;
+    json_object *argsJ;
+    int worker;
+    int tries;
+} CtrlRouterCallT;
+
+/* An authenticated session, waiting for the workers to authenticate it too */
+typedef struct {
+    afb_req_t request;
+    json_object *responseJ;
+    int pending;
+    int refused;
+} CtrlRouterAuthT;
+
+static CtrlRouterWorkerT *CtrlRouterWorkers = NULL;
+static int CtrlRouterWorkersCount = 0;
+static CtrlRouterVnodeT *CtrlRouterRing = NULL;
+static CtrlRouterStrategyT CtrlRouterStrategy = ROUTER_HASH;
+static char **CtrlRouterKey = NULL;
+static int CtrlRouterKeyDepth = 0;
+static const char *CtrlRouterHealthVerb = ROUTER_DEFAULT_VERB;
+static int CtrlRouterInterval = ROUTER_DEFAULT_INTERVAL;
+static int CtrlRouterMaxFailures = ROUTER_DEFAULT_FAILURES;
+static sd_event_source *CtrlRouterTimer = NULL;
+static afb_api_t CtrlRouterApi = NULL;
+
+static uint32_t RouterHash(const char *data)
+{
+    uint64_t wide = CtrlHash(data, strlen(data));
+    uint32_t hash = (uint32_t) (wide ^ (wide >> 32));
+
+    /* final avalanche, FNV alone clusters close keys on the ring */
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6b;
+    hash ^= hash >> 13;
+    return hash;
+}
+
+static int RouterVnodeCompare(const void *a, const void *b)
+{
+    uint32_t ha = ((const CtrlRouterVnodeT *) a)->hash, hb = ((const CtrlRouterVnodeT *) b)->hash;
+
+    return ha < hb ? -1 : ha > hb;
+}
+
+static int RouterHealthy(int worker)
+{
+    return __atomic_load_n(&CtrlRouterWorkers[worker].healthy, __ATOMIC_RELAXED);
+}
+
+/* First healthy worker clockwise from the key on the ring */
+static int RouterPickHash(const char *key, int exclude)
+{
+    int count = CtrlRouterWorkersCount * ROUTER_VNODES, low = 0, high = count;
+    uint32_t hash = RouterHash(key);
+
+    while (low < high) {
+        int mid = (low + high) / 2;
+        if (CtrlRouterRing[mid].hash < hash)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+
+    for (int step = 0; step < count; step++) {
+        int worker = CtrlRouterRing[(low + step) % count].worker;
+        if (worker != exclude && RouterHealthy(worker))
+            return worker;
+    }
+
+    return -1;
+}
+
+static int RouterPickLeastLoaded(int exclude)
+{
+    int best = -1, load, bestLoad = 0;
+
+    for (int idx = 0; idx < CtrlRouterWorkersCount; idx++) {
+        if (idx == exclude || !RouterHealthy(idx))
+            continue;
+        load = __atomic_load_n(&CtrlRouterWorkers[idx].inflight, __ATOMIC_RELAXED);
+        if (best < 0 || load < bestLoad) {
+            best = idx;
+            bestLoad = load;
+        }
+    }
+
+    return best;
+}
+
+static int RouterPick(json_object *queryJ, int exclude)
+{
+    json_object *keyJ;
+
+    if (CtrlRouterStrategy == ROUTER_HASH) {
+        keyJ = CtrlJsonPathGet(queryJ, CtrlRouterKey, CtrlRouterKeyDepth);
+        if (keyJ)
+            return RouterPickHash(json_object_get_string(keyJ), exclude);
+    }
+
+    /* requests without key spread on the load */
+    return RouterPickLeastLoaded(exclude);
+}
+
+static void RouterWorkerDown(int worker)
+{
+    if (__atomic_exchange_n(&CtrlRouterWorkers[worker].healthy, 0, __ATOMIC_ACQ_REL))
+        AFB_API_NOTICE(CtrlRouterApi, "Router: worker '%s' is down", CtrlRouterWorkers[worker].api);
+}
+
+static void RouterSend(CtrlRouterCallT *call);
+
+static void RouterReplyCB(void *context, json_object *responseJ, const char *error, const char *info, afb_req_t subreq)
+{
+    CtrlRouterCallT *call = (CtrlRouterCallT *) context;
+    CtrlRouterWorkerT *worker = &CtrlRouterWorkers[call->worker];
+    int next;
+
+    __atomic_sub_fetch(&worker->inflight, 1, __ATOMIC_RELAXED);
+
+    /* the worker itself is unreachable, fail over once to another one */
+    if (error && (!strcmp(error, "disconnected") || !strcmp(error, "unknown-api"))) {
+        RouterWorkerDown(call->worker);
+        if (call->tries < 2 && (next = RouterPick(call->argsJ, call->worker)) >= 0) {
+            __atomic_add_fetch(&worker->failovers, 1, __ATOMIC_RELAXED);
+            call->worker = next;
+            RouterSend(call);
+            return;
+        }
+    }
+
+    if (error)
+        AFB_ReqFail(call->request, error, info);
+    else
+        AFB_ReqSuccess(call->request, json_object_get(responseJ), info);
+
+    json_object_put(call->argsJ);
+    afb_req_unref(call->request);
+    free(call);
+}
+
+static void RouterSend(CtrlRouterCallT *call)
+{
+    CtrlRouterWorkerT *worker = &CtrlRouterWorkers[call->worker];
+
+    call->tries++;
+    __atomic_add_fetch(&worker->inflight, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&worker->forwarded, 1, __ATOMIC_RELAXED);
+    afb_req_subcall(call->request, worker->api, call->verb, json_object_get(call->argsJ),
+                    afb_req_subcall_on_behalf | afb_req_subcall_pass_events, RouterReplyCB, call);
+}
+
+/**
+ * @brief Whether this process is a router front.
+ */
+int CtrlRouterEnabled(void)
+{
+    return CtrlRouterWorkersCount > 0;
+}
+
+/**
+ * @brief Forward a control call to a worker process chosen by the router.
+ * The caller checked the session authentication first.
+ *
+ * @param request the control request, replied with the worker's reply.
+ * @param verb the control name.
+ * @param argsJ the arguments to forward, with their correlation ID, a
+ * reference is taken.
+ */
+void CtrlRouterForward(afb_req_t request, const char *verb, json_object *argsJ)
+{
+    CtrlRouterCallT *call;
+    int worker = RouterPick(argsJ, -1);
+
+    if (worker < 0) {
+        AFB_ReqFail(request, "unavailable", "No healthy worker");
+        return;
+    }
+
+    call = calloc(1, sizeof(CtrlRouterCallT));
+    call->request = afb_req_addref(request);
+    call->verb = verb;
+    call->argsJ = json_object_get(argsJ);
+    call->worker = worker;
+    RouterSend(call);
+}
+
+static void RouterAuthCB(void *context, json_object *responseJ, const char *error, const char *info, afb_req_t subreq)
+{
+    CtrlRouterAuthT *auth = (CtrlRouterAuthT *) context;
+
+    /* a worker down now will refuse the session until it authenticates again */
+    if (error && strcmp(error, "disconnected") && strcmp(error, "unknown-api"))
+        __atomic_store_n(&auth->refused, 1, __ATOMIC_RELAXED);
+
+    if (__atomic_sub_fetch(&auth->pending, 1, __ATOMIC_ACQ_REL))
+        return;
+
+    if (__atomic_load_n(&auth->refused, __ATOMIC_RELAXED)) {
+        json_object_put(auth->responseJ);
+        afb_req_set_LOA(auth->request, 0);
+        AFB_ReqFail(auth->request, "unauthorized", "Session authentication refused by a worker");
+    }
+    else
+        AFB_ReqSuccess(auth->request, auth->responseJ, NULL);
+
+    afb_req_unref(auth->request);
+    free(auth);
+}
+
+/**
+ * @brief Reply a successful 'auth' call. On a router front, the call is first
+ * forwarded on behalf of the session to every healthy worker, each one
+ * verifying the token and raising the LOA of the session on its side: workers
+ * never take the front's word for it.
+ *
+ * @param request the 'auth' request, authenticated by this process.
+ * @param responseJ the reply, ownership is taken.
+ */
+void CtrlRouterAuthReply(afb_req_t request, json_object *responseJ)
+{
+    CtrlRouterAuthT *auth;
+
+    if (!CtrlRouterEnabled()) {
+        AFB_ReqSuccess(request, responseJ, NULL);
+        return;
+    }
+
+    auth = calloc(1, sizeof(CtrlRouterAuthT));
+    auth->request = afb_req_addref(request);
+    auth->responseJ = responseJ;
+    /* held while sending, so that early replies do not complete it */
+    auth->pending = 1;
+
+    for (int idx = 0; idx < CtrlRouterWorkersCount; idx++) {
+        if (!RouterHealthy(idx))
+            continue;
+        __atomic_add_fetch(&auth->pending, 1, __ATOMIC_RELAXED);
+        afb_req_subcall(request, CtrlRouterWorkers[idx].api, "auth", json_object_get(afb_req_json(request)),
+                        afb_req_subcall_on_behalf, RouterAuthCB, auth);
+    }
+
+    RouterAuthCB(auth, NULL, NULL, NULL, NULL);
+}
+
+static void RouterHealthCB(void *context, json_object *responseJ, const char *error, const char *info, afb_api_t api)
+{
+    CtrlRouterWorkerT *worker = (CtrlRouterWorkerT *) context;
+
+    if (!error) {
+        worker->failures = 0;
+        if (!__atomic_exchange_n(&worker->healthy, 1, __ATOMIC_ACQ_REL))
+            AFB_API_NOTICE(api, "Router: worker '%s' is up", worker->api);
+    }
+    else if (++worker->failures >= CtrlRouterMaxFailures) {
+        RouterWorkerDown((int) (worker - CtrlRouterWorkers));
+    }
+}
+
+static int RouterHealthTimerCB(sd_event_source *source, uint64_t usec, void *context)
+{
+    afb_api_t api = (afb_api_t) context;
+
+    for (int idx = 0; idx < CtrlRouterWorkersCount; idx++)
+        afb_api_call(api, CtrlRouterWorkers[idx].api, CtrlRouterHealthVerb, NULL, RouterHealthCB, &CtrlRouterWorkers[idx]);
+
+    sd_event_source_set_time(source, usec + (uint64_t) CtrlRouterInterval * 1000);
+    sd_event_source_set_enabled(source, SD_EVENT_ONESHOT);
+    return 0;
+}
+
+/**
+ * @brief Verb returning the router's workers state.
+ *
+ * @param request AFB request with the JSON arguments if the request got some.
+ */
+void CtrlRouterRequest(afb_req_t request)
+{
+    json_object *workersJ, *workerJ;
+
+    if (!CtrlRouterEnabled()) {
+        AFB_ReqFail(request, "disabled", "This controller is not a router");
+        return;
+    }
+
+    workersJ = json_object_new_object();
+    for (int idx = 0; idx < CtrlRouterWorkersCount; idx++) {
+        CtrlRouterWorkerT *worker = &CtrlRouterWorkers[idx];
+        wrap_json_pack(&workerJ, "{sb,si,sI,sI}",
+                       "healthy", RouterHealthy(idx),
+                       "inflight", __atomic_load_n(&worker->inflight, __ATOMIC_RELAXED),
+                       "forwarded", (int64_t) __atomic_load_n(&worker->forwarded, __ATOMIC_RELAXED),
+                       "failovers", (int64_t) __atomic_load_n(&worker->failovers, __ATOMIC_RELAXED));
+        json_object_object_add(workersJ, worker->api, workerJ);
+    }
+
+    AFB_ReqSuccess(request, workersJ, NULL);
+}
+
+/**
+ * @brief Controller's 'router' section loader, only honored when the
+ * CONTROL_PREFIX "_ROUTER" environment variable is set:
+ * { "workers": [ "ctl-w0", "ctl-w1" ], "strategy": "hash", "key": "vin",
+ *   "health": { "verb": "ping-global", "interval": 1000, "failures": 3 } }
+ *
+ * @param api the API handle being set up.
+ * @param section the section definition.
+ * @param routerJ the JSON section, NULL when called at init time.
+ * @return int 0 if OK, other if not.
+ */
+int CtrlRouterConfig(afb_api_t api, CtlSectionT *section, json_object *routerJ)
+{
+    json_object *workersJ = NULL, *healthJ = NULL;
+    const char *strategy = "hash", *key = NULL;
+    char vnode[256];
+
+    if (!routerJ) {
+        if (!CtrlRouterWorkersCount)
+            return 0;
+        /* workers start healthy, the first health check runs right away */
+        if (sd_event_add_time(afb_api_get_event_loop(api), &CtrlRouterTimer, CLOCK_MONOTONIC,
+                              CtrlNowUsec(), 1000, RouterHealthTimerCB, api) < 0) {
+            AFB_API_ERROR(api, "CtrlRouterConfig: fail to create the health check timer");
+            return ERROR;
+        }
+        return sd_event_source_set_enabled(CtrlRouterTimer, SD_EVENT_ONESHOT) < 0;
+    }
+
+    /* workers load the same configuration and just ignore the section */
+    if (!getenv(CONTROL_PREFIX "_ROUTER"))
+        return 0;
+
+    if (wrap_json_unpack(routerJ, "{so,s?s,s?s,s?o}", "workers", &workersJ, "strategy", &strategy,
+                         "key", &key, "health", &healthJ) ||
+        !json_object_is_type(workersJ, json_type_array) || !json_object_array_length(workersJ) ||
+        wrap_json_unpack(healthJ, "{s?s,s?i,s?i}", "verb", &CtrlRouterHealthVerb, "interval", &CtrlRouterInterval,
+                         "failures", &CtrlRouterMaxFailures) ||
+        CtrlRouterInterval <= 0 || CtrlRouterMaxFailures <= 0) {
+        AFB_API_ERROR(api, "CtrlRouterConfig: invalid 'router' section %s", json_object_to_json_string(routerJ));
+        return ERROR;
+    }
+
+    if (!strcmp(strategy, "least-loaded")) {
+        CtrlRouterStrategy = ROUTER_LEAST_LOADED;
+    }
+    else if (!strcmp(strategy, "hash") && key) {
+        CtrlRouterStrategy = ROUTER_HASH;
+        CtrlRouterKey = CtrlJsonPathCompile(key, &CtrlRouterKeyDepth);
+    }
+    else {
+        AFB_API_ERROR(api, "CtrlRouterConfig: strategy must be 'hash' with a 'key', or 'least-loaded'");
+        return ERROR;
+    }
+
+    CtrlRouterApi = api;
+    CtrlRouterWorkersCount = (int) json_object_array_length(workersJ);
+    CtrlRouterWorkers = calloc(CtrlRouterWorkersCount, sizeof(CtrlRouterWorkerT));
+    CtrlRouterRing = malloc((size_t) CtrlRouterWorkersCount * ROUTER_VNODES * sizeof(CtrlRouterVnodeT));
+    for (int idx = 0; idx < CtrlRouterWorkersCount; idx++) {
+        CtrlRouterWorkers[idx].api = json_object_get_string(json_object_array_get_idx(workersJ, idx));
+        CtrlRouterWorkers[idx].healthy = 1;
+        for (int node = 0; node < ROUTER_VNODES; node++) {
+            snprintf(vnode, sizeof(vnode), "%s#%d", CtrlRouterWorkers[idx].api, node);
+            CtrlRouterRing[idx * ROUTER_VNODES + node].hash = RouterHash(vnode);
+            CtrlRouterRing[idx * ROUTER_VNODES + node].worker = idx;
+        }
+    }
+    qsort(CtrlRouterRing, (size_t) CtrlRouterWorkersCount * ROUTER_VNODES, sizeof(CtrlRouterVnodeT), RouterVnodeCompare);
+
+    AFB_API_NOTICE(api, "Router: forwarding controls to %d workers", CtrlRouterWorkersCount);
+    return 0;
+}
@@ -0,0 +1,294 @@
+/*
+ * Copyright (C) 2018 "IoT.bzh"
+ * Author Romain Forlot <romain@iot.bzh>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <systemd/sd-event.h>
+
+#include "controller-binding.h"
+
+/*
+ * Rules are compiled into a small matching network:
+ * - an alpha index, giving for each interned event label the patterns it
+ *   could update,
+ * - per rule partial matches: each pattern remembers when it matched and with
+ *   which payload, and the rule keeps how many of its patterns currently
+ *   match.
+ * An event therefore only touches the patterns listening to it, and a rule is
+ * only checked for completion when one of its patterns changed. Matches older
+ * than the rule's window are expired by a timer.
+ */
+
+typedef struct {
+    int event;
+    CtrlConditionT *conditions;
+    int conditionsCount;
+    uint64_t matchedAt;
+    json_object *payloadJ;
+} CtrlRulePatternT;
+
+typedef struct {
+    const char *uid;
+    CtrlRulePatternT *patterns;
+    int patternsCount;
+    int matchedCount;
+    uint64_t window;
+    CtlActionT *actions;
+    afb_api_t api;
+    sd_event_source *timer;
+    pthread_mutex_t lock;
+} CtrlRuleT;
+
+typedef struct {
+    CtrlRuleT *rule;
+    int pattern;
+} CtrlRuleRefT;
+
+static CtrlInternT CtrlRulesEvents = { 0 };
+static CtrlRuleT *CtrlRules = NULL;
+static int CtrlRulesCount = 0;
+static int *CtrlRulesIndex = NULL;
+static CtrlRuleRefT *CtrlRulesRefs = NULL;
+
+static void RuleUnmatch(CtrlRuleT *rule, CtrlRulePatternT *pattern)
+{
+    if (!pattern->matchedAt)
+        return;
+
+    pattern->matchedAt = 0;
+    json_object_put(pattern->payloadJ);
+    pattern->payloadJ = NULL;
+    rule->matchedCount--;
+}
+
+/* Expire matches out of the rule window, return the oldest remaining one */
+static uint64_t RuleExpire(CtrlRuleT *rule, uint64_t now)
+{
+    uint64_t oldest = 0;
+
+    for (int idx = 0; idx < rule->patternsCount; idx++) {
+        CtrlRulePatternT *pattern = &rule->patterns[idx];
+        if (!pattern->matchedAt)
+            continue;
+        if (now - pattern->matchedAt > rule->window)
+            RuleUnmatch(rule, pattern);
+        else if (!oldest || pattern->matchedAt < oldest)
+            oldest = pattern->matchedAt;
+    }
+
+    return oldest;
+}
+
+static void RuleArmTimer(CtrlRuleT *rule, uint64_t oldest)
+{
+    if (!rule->timer)
+        return;
+
+    CtrlTimerArm(rule->api, rule->timer, oldest ? oldest + rule->window + 1 : 0);
+}
+
+static int RuleTimerCB(sd_event_source *source, uint64_t usec, void *userdata)
+{
+    CtrlRuleT *rule = (CtrlRuleT *) userdata;
+
+    pthread_mutex_lock(&rule->lock);
+    RuleArmTimer(rule, RuleExpire(rule, CtrlNowUsec()));
+    pthread_mutex_unlock(&rule->lock);
+
+    return 0;
+}
+
+/* Update one pattern with an event, fire the rule if it becomes complete */
+static void RuleUpdate(CtrlRuleT *rule, int patternIdx, json_object *eventJ)
+{
+    CtrlRulePatternT *pattern = &rule->patterns[patternIdx];
+    json_object *queryJ = NULL, *eventsJ;
+    uint64_t now = CtrlNowUsec();
+
+    pthread_mutex_lock(&rule->lock);
+    if (CtrlConditionsEval(pattern->conditions, pattern->conditionsCount, eventJ)) {
+        if (!pattern->matchedAt)
+            rule->matchedCount++;
+        json_object_put(pattern->payloadJ);
+        pattern->payloadJ = json_object_get(eventJ);
+        pattern->matchedAt = now;
+    }
+    else {
+        RuleUnmatch(rule, pattern);
+    }
+
+    if (rule->window)
+        RuleArmTimer(rule, RuleExpire(rule, now));
+
+    if (rule->matchedCount == rule->patternsCount) {
+        eventsJ = json_object_new_array();
+        for (int idx = 0; idx < rule->patternsCount; idx++) {
+            json_object_array_add(eventsJ, json_object_get(rule->patterns[idx].payloadJ));
+            RuleUnmatch(rule, &rule->patterns[idx]);
+        }
+        RuleArmTimer(rule, 0);
+        wrap_json_pack(&queryJ, "{ss,so}", "rule", rule->uid, "events", eventsJ);
+    }
+    pthread_mutex_unlock(&rule->lock);
+
+    if (queryJ) {
+        CtrlActionsExec(rule->api, rule->uid, rule->actions, CtrlCorrelationTag(queryJ));
+        json_object_put(queryJ);
+    }
+}
+
+/**
+ * @brief Feed an event received by the controller API to the rules engine.
+ * Only the patterns listening to this event label are updated.
+ *
+ * @param api the controller API handle.
+ * @param evtLabel the event label, ie: "api/event".
+ * @param eventJ the event payload.
+ */
+void CtrlRulesDispatch(afb_api_t api, const char *evtLabel, json_object *eventJ)
+{
+    int event = CtrlInternFind(&CtrlRulesEvents, evtLabel);
+
+    if (event < 0)
+        return;
+
+    for (int idx = CtrlRulesIndex[event]; idx < CtrlRulesIndex[event + 1]; idx++)
+        RuleUpdate(CtrlRulesRefs[idx].rule, CtrlRulesRefs[idx].pattern, eventJ);
+}
+
+static int RuleLoadOne(afb_api_t api, CtrlRuleT *rule, json_object *ruleJ)
+{
+    json_object *whenJ = NULL, *actionsJ = NULL, *patternJ, *conditionJ;
+    const char *event;
+    int idx, within = 0;
+
+    if (wrap_json_unpack(ruleJ, "{ss,so,s?i,so}",
+            "uid", &rule->uid,
+            "when", &whenJ,
+            "within", &within,
+            "actions", &actionsJ) ||
+        !json_object_is_type(whenJ, json_type_array) ||
+        !json_object_array_length(whenJ)) {
+        AFB_API_ERROR(api, "RuleLoadOne: rule needs a 'uid', a 'when' patterns array and 'actions': %s",
+            json_object_to_json_string(ruleJ));
+        return ERROR;
+    }
+
+    rule->api = api;
+    rule->window = (uint64_t) within * 1000;
+    pthread_mutex_init(&rule->lock, NULL);
+
+    rule->patternsCount = (int) json_object_array_length(whenJ);
+    rule->patterns = calloc(rule->patternsCount, sizeof(CtrlRulePatternT));
+    for (idx = 0; idx < rule->patternsCount; idx++) {
+        patternJ = json_object_array_get_idx(whenJ, idx);
+        conditionJ = NULL;
+        if (wrap_json_unpack(patternJ, "{ss,s?o}", "event", &event, "condition", &conditionJ)) {
+            AFB_API_ERROR(api, "RuleLoadOne: rule '%s' pattern needs an 'event': %s",
+                rule->uid, json_object_to_json_string(patternJ));
+            return ERROR;
+        }
+        rule->patterns[idx].event = CtrlInternAdd(&CtrlRulesEvents, event);
+        rule->patterns[idx].conditions = CtrlConditionsLoad(api, conditionJ, &rule->patterns[idx].conditionsCount);
+        if (rule->patterns[idx].conditionsCount < 0)
+            return ERROR;
+    }
+
+    rule->actions = ActionConfig(api, actionsJ, 0);
+    if (!rule->actions) {
+        AFB_API_ERROR(api, "RuleLoadOne: rule '%s' fail to load actions", rule->uid);
+        return ERROR;
+    }
+
+    return 0;
+}
+
+/* Build the alpha index: event id -> range of (rule, pattern) references */
+static void RulesCompile(void)
+{
+    int idx, pattern, event, *fill;
+
+    CtrlRulesIndex = calloc(CtrlRulesEvents.count + 1, sizeof(int));
+    for (idx = 0; idx < CtrlRulesCount; idx++) {
+        for (pattern = 0; pattern < CtrlRules[idx].patternsCount; pattern++)
+            CtrlRulesIndex[CtrlRules[idx].patterns[pattern].event + 1]++;
+    }
+
+    for (event = 0; event < CtrlRulesEvents.count; event++)
+        CtrlRulesIndex[event + 1] += CtrlRulesIndex[event];
+
+    CtrlRulesRefs = calloc(CtrlRulesIndex[CtrlRulesEvents.count] + 1, sizeof(CtrlRuleRefT));
+    fill = calloc(CtrlRulesEvents.count, sizeof(int));
+    for (idx = 0; idx < CtrlRulesCount; idx++) {
+        for (pattern = 0; pattern < CtrlRules[idx].patternsCount; pattern++) {
+            event = CtrlRules[idx].patterns[pattern].event;
+            CtrlRulesRefs[CtrlRulesIndex[event] + fill[event]].rule = &CtrlRules[idx];
+            CtrlRulesRefs[CtrlRulesIndex[event] + fill[event]++].pattern = pattern;
+        }
+    }
+    free(fill);
+}
+
+/**
+ * @brief Controller's 'rules' section loader. A rule fires its actions when
+ * all of its 'when' patterns, an event label with optional conditions on its
+ * payload, currently match, optionally all within 'within' milliseconds.
+ *
+ * @param api the API handle being set up.
+ * @param section the section definition.
+ * @param rulesJ the JSON section, NULL when called at init time.
+ * @return int 0 if OK, other if not.
+ */
+int CtrlRulesConfig(afb_api_t api, CtlSectionT *section, json_object *rulesJ)
+{
+    int idx, errcount = 0;
+
+    /* Windows timers are created on the binder's event loop at init time */
+    if (!rulesJ) {
+        for (idx = 0; idx < CtrlRulesCount; idx++) {
+            CtrlRuleT *rule = &CtrlRules[idx];
+            if (!rule->window)
+                continue;
+            if (sd_event_add_time(afb_api_get_event_loop(api), &rule->timer, CLOCK_MONOTONIC,
+                                  UINT64_MAX, 1000, RuleTimerCB, rule) < 0) {
+                AFB_API_ERROR(api, "CtrlRulesConfig: fail to create window timer of rule '%s'", rule->uid);
+                errcount++;
+                continue;
+            }
+            sd_event_source_set_enabled(rule->timer, SD_EVENT_OFF);
+        }
+        return errcount;
+    }
+
+    if (!json_object_is_type(rulesJ, json_type_array)) {
+        AFB_API_ERROR(api, "CtrlRulesConfig: 'rules' section must be an array");
+        return ERROR;
+    }
+
+    CtrlRulesCount = (int) json_object_array_length(rulesJ);
+    CtrlRules = calloc(CtrlRulesCount, sizeof(CtrlRuleT));
+    for (idx = 0; idx < CtrlRulesCount; idx++)
+        errcount += RuleLoadOne(api, &CtrlRules[idx], json_object_array_get_idx(rulesJ, idx));
+
+    if (!errcount)
+        RulesCompile();
+
+    return errcount;
+}
@@ -0,0 +1,227 @@
+/*
+ * Copyright (C) 2018 "IoT.bzh"
+ * Author Romain Forlot <romain@iot.bzh>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "controller-binding.h"
+
+#define SHED_DEFAULT_INTERVAL 100
+#define SHED_DEFAULT_STRETCH 4
+
+/*
+ * Shedding levels, each one adding to the previous ones. A level is entered
+ * as soon as the measured delay crosses its threshold, and left one level at
+ * a time once the delay went back under it for a whole interval.
+ */
+typedef enum {
+    SHED_NONE = 0,
+    SHED_EVENTS,
+    SHED_CONTROLS,
+    SHED_THROTTLES,
+    SHED_LEVELS,
+} CtrlShedLevelT;
+
+static const char *CtrlShedLevels[] = { "none", "events", "controls", "throttles" };
+
+static int CtrlShedThresholds[SHED_LEVELS] = { 0 };
+static int CtrlShedInterval = SHED_DEFAULT_INTERVAL;
+static int CtrlShedStretchFactor = SHED_DEFAULT_STRETCH;
+static int CtrlShedEnabled = 0;
+static int CtrlShedLevel = SHED_NONE;
+
+/* Worst queue delay reported since the last tick, and last measurements */
+static uint64_t CtrlShedQueueMax = 0;
+static uint64_t CtrlShedLag = 0;
+static uint64_t CtrlShedQueue = 0;
+
+static uint64_t CtrlShedDroppedEvents = 0;
+static uint64_t CtrlShedRejectedControls = 0;
+static uint64_t CtrlShedTransitions = 0;
+
+/**
+ * @brief Report how long an item waited in one of the controller's queues,
+ * accounted for at the next tick of the overload monitor.
+ *
+ * @param queued when the item was queued, as given by CtrlNowUsec.
+ */
+void CtrlShedQueueDelay(uint64_t queued)
+{
+    uint64_t delay = CtrlNowUsec() - queued, max;
+
+    if (!CtrlShedEnabled)
+        return;
+
+    max = __atomic_load_n(&CtrlShedQueueMax, __ATOMIC_RELAXED);
+    while (delay > max &&
+           !__atomic_compare_exchange_n(&CtrlShedQueueMax, &max, delay, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+/**
+ * @brief Whether a low priority event has to be dropped.
+ *
+ * @param evtLabel the event label.
+ * @return int 1 if the event is dropped, 0 if not.
+ */
+int CtrlShedEvent(const char *evtLabel)
+{
+    if (__atomic_load_n(&CtrlShedLevel, __ATOMIC_RELAXED) < SHED_EVENTS || !CtrlEventsLowPriority(evtLabel))
+        return 0;
+
+    __atomic_add_fetch(&CtrlShedDroppedEvents, 1, __ATOMIC_RELAXED);
+    return 1;
+}
+
+/**
+ * @brief Whether a non critical control call has to be rejected, the caller
+ * replies with a retryable error.
+ *
+ * @return int 1 if the call is rejected, 0 if not.
+ */
+int CtrlShedControl(void)
+{
+    if (__atomic_load_n(&CtrlShedLevel, __ATOMIC_RELAXED) < SHED_CONTROLS)
+        return 0;
+
+    __atomic_add_fetch(&CtrlShedRejectedControls, 1, __ATOMIC_RELAXED);
+    return 1;
+}
+
+/**
+ * @brief Stretch a throttling interval while the controller is overloaded.
+ *
+ * @param interval the configured interval.
+ * @return uint64_t the interval to apply.
+ */
+uint64_t CtrlShedStretch(uint64_t interval)
+{
+    if (__atomic_load_n(&CtrlShedLevel, __ATOMIC_RELAXED) < SHED_THROTTLES)
+        return interval;
+
+    return interval * (uint64_t) CtrlShedStretchFactor;
+}
+
+/*
+ * The monitor tick runs on the binder's loop: how late it fires is the loop
+ * lag, added to the worst queue delay reported since the previous tick.
+ */
+static int ShedTimerCB(sd_event_source *source, uint64_t usec, void *userdata)
+{
+    afb_api_t api = (afb_api_t) userdata;
+    uint64_t now = CtrlNowUsec(), delay;
+    int level = CtrlShedLevel, target = SHED_NONE;
+
+    CtrlShedLag = now > usec ? now - usec : 0;
+    CtrlShedQueue = __atomic_exchange_n(&CtrlShedQueueMax, 0, __ATOMIC_RELAXED);
+    delay = (CtrlShedLag > CtrlShedQueue ? CtrlShedLag : CtrlShedQueue) / 1000;
+
+    for (int idx = SHED_EVENTS; idx < SHED_LEVELS; idx++) {
+        if (CtrlShedThresholds[idx] && delay >= (uint64_t) CtrlShedThresholds[idx])
+            target = idx;
+    }
+
+    if (target > level)
+        level = target;
+    else if (target < level)
+        level--;
+
+    if (level != CtrlShedLevel) {
+        AFB_API_NOTICE(api, "CtrlShed: overload level %s -> %s, delay %dms",
+                       CtrlShedLevels[CtrlShedLevel], CtrlShedLevels[level], (int) delay);
+        __atomic_store_n(&CtrlShedLevel, level, __ATOMIC_RELAXED);
+        CtrlShedTransitions++;
+    }
+
+    sd_event_source_set_time(source, now + (uint64_t) CtrlShedInterval * 1000);
+    sd_event_source_set_enabled(source, SD_EVENT_ONESHOT);
+
+    return 0;
+}
+
+/**
+ * @brief Verb reporting the overload shedding state and counters.
+ *
+ * @param request AFB request with the JSON arguments if the request got some.
+ */
+void CtrlShedRequest(afb_req_t request)
+{
+    json_object *responseJ;
+
+    if (!CtrlShedEnabled) {
+        AFB_ReqFail(request, "disabled", "No 'shedding' section configured");
+        return;
+    }
+
+    wrap_json_pack(&responseJ, "{ss,sI,sI,sI,sI,sI}",
+                   "level", CtrlShedLevels[__atomic_load_n(&CtrlShedLevel, __ATOMIC_RELAXED)],
+                   "lag", (int64_t) CtrlShedLag,
+                   "queue-delay", (int64_t) CtrlShedQueue,
+                   "dropped-events", (int64_t) __atomic_load_n(&CtrlShedDroppedEvents, __ATOMIC_RELAXED),
+                   "rejected-controls", (int64_t) __atomic_load_n(&CtrlShedRejectedControls, __ATOMIC_RELAXED),
+                   "transitions", (int64_t) CtrlShedTransitions);
+    AFB_ReqSuccess(request, responseJ, NULL);
+}
+
+/**
+ * @brief Controller's 'shedding' section loader:
+ * { "interval": 100, "events": 20, "controls": 50, "throttles": 200, "stretch": 4 }
+ * Every 'interval' milliseconds, the loop lag and the worst events queue
+ * delay are measured. Past 'events' milliseconds low priority events are
+ * dropped, past 'controls' the controls not marked critical are rejected,
+ * past 'throttles' the aggregates publish intervals and events batches delays
+ * are multiplied by 'stretch'. Each level includes the previous ones, a
+ * threshold left out skips its level.
+ *
+ * @param api the API handle being set up.
+ * @param section the section definition.
+ * @param shedJ the JSON section, NULL when called at init time.
+ * @return int 0 if OK, other if not.
+ */
+int CtrlShedConfig(afb_api_t api, CtlSectionT *section, json_object *shedJ)
+{
+    sd_event_source *timer;
+
+    if (!shedJ) {
+        if (!CtrlShedEnabled)
+            return 0;
+        if (sd_event_add_time(afb_api_get_event_loop(api), &timer, CLOCK_MONOTONIC,
+                              CtrlNowUsec() + (uint64_t) CtrlShedInterval * 1000, 1000, ShedTimerCB, api) < 0) {
+            AFB_API_ERROR(api, "CtrlShedConfig: fail to create the overload monitor timer");
+            return ERROR;
+        }
+        return 0;
+    }
+
+    if (wrap_json_unpack(shedJ, "{s?i,s?i,s?i,s?i,s?i}",
+                         "interval", &CtrlShedInterval,
+                         "events", &CtrlShedThresholds[SHED_EVENTS],
+                         "controls", &CtrlShedThresholds[SHED_CONTROLS],
+                         "throttles", &CtrlShedThresholds[SHED_THROTTLES],
+                         "stretch", &CtrlShedStretchFactor) ||
+        CtrlShedInterval <= 0 || CtrlShedStretchFactor < 1 || CtrlShedThresholds[SHED_EVENTS] < 0 ||
+        CtrlShedThresholds[SHED_CONTROLS] < 0 || CtrlShedThresholds[SHED_THROTTLES] < 0) {
+        AFB_API_ERROR(api, "CtrlShedConfig: invalid 'shedding' section %s", json_object_to_json_string(shedJ));
+        return ERROR;
+    }
+
+    CtrlShedEnabled = 1;
+
+    return 0;
+}
@@ -0,0 +1,88 @@
+/*
+ * Copyright (C) 2018 "IoT.bzh"
+ * Author Romain Forlot <romain@iot.bzh>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Shared memory ingestion ring of the controller's 'shm' sources, this header
+ * is also meant to be used by producers.
+ *
+ * A producer connects to the source's unix socket and receives, through
+ * SCM_RIGHTS, a memfd holding one CtrlShmRingT and an eventfd. The ring is
+ * single producer, single consumer: the producer writes records at 'head',
+ * the controller reads them from 'tail'. Records have the fixed layout
+ * declared in the controller's configuration, fields packed in declaration
+ * order with host endianness.
+ */
+
+#ifndef _CTL_SHM_INCLUDE_
+#define _CTL_SHM_INCLUDE_
+
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#define CTRL_SHM_MAGIC 0x43544c52
+#define CTRL_SHM_VERSION 1
+#define CTRL_SHM_CACHELINE 64
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t recordSize;
+    uint32_t capacity;
+    uint64_t head __attribute__((aligned(CTRL_SHM_CACHELINE)));
+    uint64_t tail __attribute__((aligned(CTRL_SHM_CACHELINE)));
+    unsigned char records[] __attribute__((aligned(CTRL_SHM_CACHELINE)));
+} CtrlShmRingT;
+
+#define CTRL_SHM_RECORD(ring, seq) \
+    ((ring)->records + ((seq) & ((uint64_t) (ring)->capacity - 1)) * (ring)->recordSize)
+
+/**
+ * @brief Producer side: append one record to the ring and wake the controller
+ * up if it may be sleeping on an empty ring.
+ *
+ * The full fence pairs with the one of the controller after it publishes its
+ * tail: either the controller sees the new head, or the producer sees the
+ * ring was drained and writes the eventfd, so no wake-up is lost.
+ *
+ * @param ring the mapped ring.
+ * @param evfd the eventfd received with the ring.
+ * @param record the record, 'recordSize' bytes long.
+ * @return int 0 if OK, -1 if the ring is full.
+ */
+static inline int CtrlShmPush(CtrlShmRingT *ring, int evfd, const void *record)
+{
+    uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    uint64_t one = 1;
+    ssize_t rc;
+
+    if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >= ring->capacity)
+        return -1;
+
+    memcpy(CTRL_SHM_RECORD(ring, head), record, ring->recordSize);
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n(&ring->tail, __ATOMIC_RELAXED) == head) {
+        rc = write(evfd, &one, sizeof(one));
+        (void) rc;
+    }
+
+    return 0;
+}
+
+#endif /* _CTL_SHM_INCLUDE_ */
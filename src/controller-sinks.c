@@ -0,0 +1,633 @@
+/*
+ * Copyright (C) 2018 "IoT.bzh"
+ * Author Romain Forlot <romain@iot.bzh>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#include "controller-binding.h"
+
+#define SINK_BATCH_MAX 256
+#define SINK_DEFAULT_QUEUE 65536
+#define SINK_ALL_EVENTS "*"
+
+typedef enum {
+    SINK_TYPE_FILE,
+    SINK_TYPE_DGRAM,
+    SINK_TYPE_PIPE,
+} CtrlSinkTypeT;
+
+static const char *SinkTypesNames[] = { "file", "dgram", "pipe", NULL };
+
+typedef struct CtrlSinkRecordS CtrlSinkRecordT;
+
+typedef struct {
+    const char *uid;
+    const char *path;
+    CtrlSinkTypeT type;
+    size_t rotate;
+    int keep;
+    int compress;
+    int fd;
+    size_t written;
+    CtrlSinkRecordT *batch[SINK_BATCH_MAX];
+    int batchCount;
+    size_t offset;
+    uint64_t records;
+    uint64_t dropped;
+    uint64_t errors;
+    afb_api_t api;
+} CtrlSinkT;
+
+struct CtrlSinkRecordS {
+    CtrlSinkRecordT *next;
+    CtrlSinkT *sink;
+    size_t len;
+    char data[];
+};
+
+/*
+ * Records from every sink go through one intrusive multi-producer
+ * single-consumer queue: producers only do an atomic exchange, and the
+ * background writer is woken through an eventfd when the queue gets non-empty.
+ */
+static CtrlSinkRecordT SinkStub;
+static CtrlSinkRecordT *SinkHead = &SinkStub;
+static CtrlSinkRecordT *SinkTail = &SinkStub;
+static uint64_t SinkPending = 0;
+static uint64_t SinkQueueMax = SINK_DEFAULT_QUEUE;
+static int SinkWakeFd = -1;
+
+static CtrlSinkT *CtrlSinks = NULL;
+static int CtrlSinksCount = 0;
+static CtrlInternT CtrlSinksEvents = { 0 };
+static int *CtrlSinksIndex = NULL;
+static CtrlSinkT **CtrlSinksRefs = NULL;
+static CtrlSinkT **CtrlSinksAll = NULL;
+static int CtrlSinksAllCount = 0;
+
+static void SinkQueuePush(CtrlSinkRecordT *record)
+{
+    CtrlSinkRecordT *prev;
+
+    record->next = NULL;
+    prev = __atomic_exchange_n(&SinkHead, record, __ATOMIC_ACQ_REL);
+    __atomic_store_n(&prev->next, record, __ATOMIC_RELEASE);
+}
+
+/* Consumer side only, NULL when empty or when a push is half done */
+static CtrlSinkRecordT *SinkQueuePop(void)
+{
+    CtrlSinkRecordT *tail = SinkTail, *next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+
+    if (tail == &SinkStub) {
+        if (!next)
+            return NULL;
+        SinkTail = tail = next;
+        next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    }
+
+    if (next) {
+        SinkTail = next;
+        return tail;
+    }
+
+    if (tail != __atomic_load_n(&SinkHead, __ATOMIC_ACQUIRE))
+        return NULL;
+
+    SinkQueuePush(&SinkStub);
+    next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    if (next) {
+        SinkTail = next;
+        return tail;
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Queue one record for a sink. The payload is serialized on the
+ * caller's thread, the I/O is done by the background writer.
+ *
+ * @param sink the sink.
+ * @param label the event label or the record source.
+ * @param dataJ the record payload, ownership is kept by the caller.
+ */
+static void SinkWrite(CtrlSinkT *sink, const char *label, json_object *dataJ)
+{
+    CtrlSinkRecordT *record;
+    json_object *labelJ, *cidJ;
+    const char *data, *cid = CtrlCorrelationGet();
+    unsigned long long ts = (unsigned long long) CtrlNowUsec();
+    uint64_t one = 1;
+    int len;
+
+    if (__atomic_load_n(&SinkPending, __ATOMIC_RELAXED) >= SinkQueueMax) {
+        __atomic_add_fetch(&sink->dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    labelJ = json_object_new_string(label);
+    cidJ = json_object_new_string(cid ? cid : "");
+    data = json_object_to_json_string_ext(dataJ, JSON_C_TO_STRING_PLAIN);
+    len = snprintf(NULL, 0, "{\"ts\":%llu,\"label\":%s,\"correlation\":%s,\"data\":%s}\n",
+                   ts, json_object_to_json_string(labelJ), json_object_to_json_string(cidJ), data);
+    record = malloc(sizeof(CtrlSinkRecordT) + (size_t) len + 1);
+    record->sink = sink;
+    record->len = (size_t) len;
+    snprintf(record->data, (size_t) len + 1, "{\"ts\":%llu,\"label\":%s,\"correlation\":%s,\"data\":%s}\n",
+             ts, json_object_to_json_string(labelJ), json_object_to_json_string(cidJ), data);
+    json_object_put(labelJ);
+    json_object_put(cidJ);
+
+    SinkQueuePush(record);
+    if (!__atomic_fetch_add(&SinkPending, 1, __ATOMIC_ACQ_REL) && write(SinkWakeFd, &one, sizeof(one)) < 0)
+        AFB_API_WARNING(sink->api, "Sink '%s': fail to wake the writer up", sink->uid);
+}
+
+#ifdef HAVE_ZLIB
+static void SinkCompress(CtrlSinkT *sink, const char *src, const char *dst)
+{
+    char buffer[65536];
+    ssize_t count;
+    gzFile out;
+    int in = open(src, O_RDONLY | O_CLOEXEC);
+
+    out = in < 0 ? NULL : gzopen(dst, "wb");
+    if (!out) {
+        AFB_API_WARNING(sink->api, "Sink '%s': fail to compress '%s'", sink->uid, src);
+        if (in >= 0)
+            close(in);
+        return;
+    }
+
+    while ((count = read(in, buffer, sizeof(buffer))) > 0)
+        gzwrite(out, buffer, (unsigned) count);
+
+    gzclose(out);
+    close(in);
+    unlink(src);
+}
+#endif
+
+static void SinkRotatedName(CtrlSinkT *sink, char *name, size_t len, int idx)
+{
+    snprintf(name, len, "%s.%d%s", sink->path, idx, sink->compress ? ".gz" : "");
+}
+
+/* Rotate path -> path.1[.gz] -> ... -> path.keep[.gz], writer thread only */
+static void SinkRotate(CtrlSinkT *sink)
+{
+    char from[PATH_MAX], to[PATH_MAX];
+
+    close(sink->fd);
+    sink->fd = -1;
+    sink->written = 0;
+
+    for (int idx = sink->keep - 1; idx > 0; idx--) {
+        SinkRotatedName(sink, from, sizeof(from), idx);
+        SinkRotatedName(sink, to, sizeof(to), idx + 1);
+        rename(from, to);
+    }
+
+    if (!sink->keep) {
+        unlink(sink->path);
+        return;
+    }
+
+#ifdef HAVE_ZLIB
+    if (sink->compress) {
+        snprintf(from, sizeof(from), "%s.rotating", sink->path);
+        rename(sink->path, from);
+        SinkRotatedName(sink, to, sizeof(to), 1);
+        SinkCompress(sink, from, to);
+        return;
+    }
+#endif
+    SinkRotatedName(sink, to, sizeof(to), 1);
+    rename(sink->path, to);
+}
+
+static int SinkOpen(CtrlSinkT *sink)
+{
+    struct sockaddr_un addr;
+    struct stat st;
+
+    switch (sink->type) {
+        case SINK_TYPE_DGRAM:
+            memset(&addr, 0, sizeof(addr));
+            addr.sun_family = AF_UNIX;
+            strncpy(addr.sun_path, sink->path, sizeof(addr.sun_path) - 1);
+            if (addr.sun_path[0] == '@')
+                addr.sun_path[0] = '\0';
+            sink->fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+            if (sink->fd >= 0 &&
+                connect(sink->fd, (struct sockaddr *) &addr, (socklen_t) (offsetof(struct sockaddr_un, sun_path) + strlen(sink->path))) < 0) {
+                close(sink->fd);
+                sink->fd = -1;
+            }
+            break;
+
+        case SINK_TYPE_PIPE:
+            /* Opening a FIFO with no reader fails, it is retried at next batch */
+            sink->fd = open(sink->path, O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+            break;
+
+        default:
+            sink->fd = open(sink->path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+            if (sink->fd >= 0 && !fstat(sink->fd, &st))
+                sink->written = (size_t) st.st_size;
+            break;
+    }
+
+    return sink->fd < 0 ? ERROR : 0;
+}
+
+/* Drop the batch records from the first one, counting them, the previous ones are already released */
+static void SinkDrop(CtrlSinkT *sink, int first)
+{
+    __atomic_add_fetch(&sink->dropped, (uint64_t) (sink->batchCount - first), __ATOMIC_RELAXED);
+    for (int idx = first; idx < sink->batchCount; idx++)
+        free(sink->batch[idx]);
+    sink->batchCount = 0;
+    sink->offset = 0;
+}
+
+/*
+ * Write the batch until done or the output would block. A pipe reader falling
+ * behind leaves the unwritten tail for the next flush, starting with the rest
+ * of a partially written record so that lines are never cut.
+ */
+static int SinkWriteBatch(CtrlSinkT *sink)
+{
+    struct iovec iov[SINK_BATCH_MAX];
+    ssize_t count;
+    size_t left;
+    int idx, first = 0, err = 0;
+
+    while (first < sink->batchCount) {
+        for (idx = first; idx < sink->batchCount; idx++) {
+            iov[idx - first].iov_base = sink->batch[idx]->data;
+            iov[idx - first].iov_len = sink->batch[idx]->len;
+        }
+        iov[0].iov_base = sink->batch[first]->data + sink->offset;
+        iov[0].iov_len -= sink->offset;
+
+        count = writev(sink->fd, iov, sink->batchCount - first);
+        if (count < 0 && errno == EINTR)
+            continue;
+        if (count < 0 && errno != EAGAIN)
+            err = ERROR;
+        if (count <= 0)
+            break;
+
+        sink->written += (size_t) count;
+        while (count > 0) {
+            left = sink->batch[first]->len - sink->offset;
+            if ((size_t) count < left) {
+                sink->offset += (size_t) count;
+                break;
+            }
+            count -= (ssize_t) left;
+            sink->offset = 0;
+            free(sink->batch[first++]);
+        }
+    }
+
+    __atomic_add_fetch(&sink->records, (uint64_t) first, __ATOMIC_RELAXED);
+    sink->batchCount -= first;
+    memmove(sink->batch, sink->batch + first, (size_t) sink->batchCount * sizeof(CtrlSinkRecordT *));
+
+    return err;
+}
+
+static void SinkFlush(CtrlSinkT *sink)
+{
+    struct iovec iov[SINK_BATCH_MAX];
+    struct mmsghdr msgs[SINK_BATCH_MAX];
+    int idx, count;
+
+    if (!sink->batchCount)
+        return;
+
+    if (sink->fd < 0 && SinkOpen(sink)) {
+        SinkDrop(sink, 0);
+        return;
+    }
+
+    if (sink->type != SINK_TYPE_DGRAM) {
+        if (SinkWriteBatch(sink)) {
+            __atomic_add_fetch(&sink->errors, 1, __ATOMIC_RELAXED);
+            AFB_API_WARNING(sink->api, "Sink '%s': write failed: %s", sink->uid, strerror(errno));
+            close(sink->fd);
+            sink->fd = -1;
+            SinkDrop(sink, 0);
+        }
+        else if (sink->type == SINK_TYPE_FILE && sink->rotate && sink->written >= sink->rotate && !sink->batchCount) {
+            SinkRotate(sink);
+        }
+        return;
+    }
+
+    /* One datagram per record, without the line terminator */
+    memset(msgs, 0, sizeof(struct mmsghdr) * (size_t) sink->batchCount);
+    for (idx = 0; idx < sink->batchCount; idx++) {
+        iov[idx].iov_base = sink->batch[idx]->data;
+        iov[idx].iov_len = sink->batch[idx]->len - 1;
+        msgs[idx].msg_hdr.msg_iov = &iov[idx];
+        msgs[idx].msg_hdr.msg_iovlen = 1;
+    }
+
+    count = sendmmsg(sink->fd, msgs, (unsigned) sink->batchCount, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (count < 0) {
+        __atomic_add_fetch(&sink->errors, 1, __ATOMIC_RELAXED);
+        AFB_API_WARNING(sink->api, "Sink '%s': write failed: %s", sink->uid, strerror(errno));
+        if (errno != EAGAIN) {
+            close(sink->fd);
+            sink->fd = -1;
+        }
+        count = 0;
+    }
+
+    __atomic_add_fetch(&sink->records, (uint64_t) count, __ATOMIC_RELAXED);
+    for (idx = 0; idx < count; idx++)
+        free(sink->batch[idx]);
+    SinkDrop(sink, count);
+}
+
+static void *SinkWriterThread(void *arg)
+{
+    CtrlSinkRecordT *record;
+    uint64_t counter, drained;
+    int idx;
+
+    CtrlThreadApply("sinks");
+
+    for (;;) {
+        if (read(SinkWakeFd, &counter, sizeof(counter)) < 0 && errno != EINTR)
+            break;
+
+        do {
+            drained = 0;
+            while (drained < __atomic_load_n(&SinkPending, __ATOMIC_ACQUIRE)) {
+                record = SinkQueuePop();
+                if (!record) {
+                    sched_yield();
+                    continue;
+                }
+                drained++;
+                if (record->sink->batchCount == SINK_BATCH_MAX)
+                    SinkFlush(record->sink);
+                /* still full, the output is blocked: the new record is dropped */
+                if (record->sink->batchCount == SINK_BATCH_MAX) {
+                    __atomic_add_fetch(&record->sink->dropped, 1, __ATOMIC_RELAXED);
+                    free(record);
+                    continue;
+                }
+                record->sink->batch[record->sink->batchCount++] = record;
+            }
+
+            for (idx = 0; idx < CtrlSinksCount; idx++)
+                SinkFlush(&CtrlSinks[idx]);
+        } while (__atomic_sub_fetch(&SinkPending, drained, __ATOMIC_ACQ_REL));
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Record an event received by the controller API into the sinks bound
+ * to its label.
+ *
+ * @param api the controller API handle.
+ * @param evtLabel the event label, ie: "api/event".
+ * @param eventJ the event payload.
+ */
+void CtrlSinksDispatch(afb_api_t api, const char *evtLabel, json_object *eventJ)
+{
+    int idx, event = CtrlInternFind(&CtrlSinksEvents, evtLabel);
+
+    for (idx = 0; idx < CtrlSinksAllCount; idx++)
+        SinkWrite(CtrlSinksAll[idx], evtLabel, eventJ);
+
+    if (event < 0)
+        return;
+
+    for (idx = CtrlSinksIndex[event]; idx < CtrlSinksIndex[event + 1]; idx++)
+        SinkWrite(CtrlSinksRefs[idx], evtLabel, eventJ);
+}
+
+/**
+ * @brief Verb writing a record into a sink: { "uid": "sink", "data": {...} },
+ * without arguments it returns the sinks statistics.
+ *
+ * @param request AFB request with the JSON arguments if the request got some.
+ */
+void CtrlSinksRequest(afb_req_t request)
+{
+    json_object *dataJ = NULL, *statsJ, *sinkJ;
+    const char *uid = NULL, *label = NULL;
+    int idx;
+
+    if (!wrap_json_unpack(afb_req_json(request), "{ss,so,s?s}", "uid", &uid, "data", &dataJ, "label", &label)) {
+        for (idx = 0; idx < CtrlSinksCount; idx++) {
+            if (!strcmp(CtrlSinks[idx].uid, uid))
+                break;
+        }
+        if (idx == CtrlSinksCount) {
+            AFB_ReqFailF(request, "unknown-sink", "No sink '%s'", uid);
+            return;
+        }
+        SinkWrite(&CtrlSinks[idx], label ? label : afb_req_get_called_verb(request), dataJ);
+        AFB_ReqSuccess(request, NULL, NULL);
+        return;
+    }
+
+    statsJ = json_object_new_object();
+    for (idx = 0; idx < CtrlSinksCount; idx++) {
+        sinkJ = NULL;
+        wrap_json_pack(&sinkJ, "{sI,sI,sI}",
+            "records", (int64_t) __atomic_load_n(&CtrlSinks[idx].records, __ATOMIC_RELAXED),
+            "dropped", (int64_t) __atomic_load_n(&CtrlSinks[idx].dropped, __ATOMIC_RELAXED),
+            "errors", (int64_t) __atomic_load_n(&CtrlSinks[idx].errors, __ATOMIC_RELAXED));
+        json_object_object_add(statsJ, CtrlSinks[idx].uid, sinkJ);
+    }
+    AFB_ReqSuccess(request, statsJ, NULL);
+}
+
+static int SinkLoadOne(afb_api_t api, CtrlSinkT *sink, json_object *sinkJ, json_object **eventsJ)
+{
+    const char *type = NULL;
+    int idx, rotate = 0;
+
+    sink->keep = 5;
+    if (wrap_json_unpack(sinkJ, "{ss,ss,ss,s?i,s?i,s?b,s?o}",
+            "uid", &sink->uid,
+            "type", &type,
+            "path", &sink->path,
+            "rotate", &rotate,
+            "keep", &sink->keep,
+            "compress", &sink->compress,
+            "events", eventsJ) || rotate < 0 || sink->keep < 0 ||
+        (*eventsJ && !json_object_is_type(*eventsJ, json_type_array))) {
+        AFB_API_ERROR(api, "SinkLoadOne: sink needs 'uid', 'type', 'path' and an optional 'events' array: %s",
+            json_object_to_json_string(sinkJ));
+        return ERROR;
+    }
+
+    for (idx = 0; SinkTypesNames[idx]; idx++) {
+        if (!strcasecmp(SinkTypesNames[idx], type))
+            break;
+    }
+    if (!SinkTypesNames[idx]) {
+        AFB_API_ERROR(api, "SinkLoadOne: sink '%s' unknown type '%s'", sink->uid, type);
+        return ERROR;
+    }
+
+#ifndef HAVE_ZLIB
+    if (sink->compress) {
+        AFB_API_WARNING(api, "SinkLoadOne: sink '%s' compression not supported by this build", sink->uid);
+        sink->compress = 0;
+    }
+#endif
+
+    sink->type = (CtrlSinkTypeT) idx;
+    sink->rotate = (size_t) rotate;
+    sink->fd = -1;
+    sink->api = api;
+
+    return 0;
+}
+
+/* Build the index: event id -> range of sinks recording it */
+static void SinksCompile(json_object **eventsJ)
+{
+    int idx, evt, event, count, *fill;
+    const char *label;
+
+    CtrlSinksAll = calloc(CtrlSinksCount + 1, sizeof(CtrlSinkT *));
+    for (idx = 0; idx < CtrlSinksCount; idx++) {
+        count = eventsJ[idx] ? (int) json_object_array_length(eventsJ[idx]) : 0;
+        for (evt = 0; evt < count; evt++) {
+            label = json_object_get_string(json_object_array_get_idx(eventsJ[idx], evt));
+            if (!strcmp(label, SINK_ALL_EVENTS))
+                CtrlSinksAll[CtrlSinksAllCount++] = &CtrlSinks[idx];
+            else
+                CtrlInternAdd(&CtrlSinksEvents, label);
+        }
+    }
+
+    CtrlSinksIndex = calloc(CtrlSinksEvents.count + 1, sizeof(int));
+    for (idx = 0; idx < CtrlSinksCount; idx++) {
+        count = eventsJ[idx] ? (int) json_object_array_length(eventsJ[idx]) : 0;
+        for (evt = 0; evt < count; evt++) {
+            event = CtrlInternFind(&CtrlSinksEvents, json_object_get_string(json_object_array_get_idx(eventsJ[idx], evt)));
+            if (event >= 0)
+                CtrlSinksIndex[event + 1]++;
+        }
+    }
+
+    for (event = 0; event < CtrlSinksEvents.count; event++)
+        CtrlSinksIndex[event + 1] += CtrlSinksIndex[event];
+
+    CtrlSinksRefs = calloc(CtrlSinksIndex[CtrlSinksEvents.count] + 1, sizeof(CtrlSinkT *));
+    fill = calloc(CtrlSinksEvents.count + 1, sizeof(int));
+    for (idx = 0; idx < CtrlSinksCount; idx++) {
+        count = eventsJ[idx] ? (int) json_object_array_length(eventsJ[idx]) : 0;
+        for (evt = 0; evt < count; evt++) {
+            event = CtrlInternFind(&CtrlSinksEvents, json_object_get_string(json_object_array_get_idx(eventsJ[idx], evt)));
+            if (event >= 0)
+                CtrlSinksRefs[CtrlSinksIndex[event] + fill[event]++] = &CtrlSinks[idx];
+        }
+    }
+    free(fill);
+}
+
+/**
+ * @brief Controller's 'sinks' section loader. Sinks are rotating files, unix
+ * datagram sockets or FIFOs recording events, either bound through their
+ * 'events' labels list or written with the 'sink' verb. Records are queued
+ * lock-free and written by batches from a background thread.
+ *
+ * @param api the API handle being set up.
+ * @param section the section definition.
+ * @param sinksJ the JSON section, NULL when called at init time.
+ * @return int 0 if OK, other if not.
+ */
+int CtrlSinksConfig(afb_api_t api, CtlSectionT *section, json_object *sinksJ)
+{
+    json_object **eventsJ;
+    pthread_t writer;
+    int idx, errcount = 0;
+
+    if (!sinksJ) {
+        if (!CtrlSinksCount)
+            return 0;
+        SinkWakeFd = eventfd(0, EFD_CLOEXEC);
+        if (SinkWakeFd < 0 || pthread_create(&writer, NULL, SinkWriterThread, NULL)) {
+            AFB_API_ERROR(api, "CtrlSinksConfig: fail to start the sinks writer");
+            return ERROR;
+        }
+        pthread_detach(writer);
+        return 0;
+    }
+
+    if (json_object_is_type(sinksJ, json_type_object)) {
+        int queue = SINK_DEFAULT_QUEUE;
+        json_object *listJ = NULL;
+        if (wrap_json_unpack(sinksJ, "{s?i,so}", "queue", &queue, "sinks", &listJ) || queue <= 0) {
+            AFB_API_ERROR(api, "CtrlSinksConfig: invalid 'sinks' section %s", json_object_to_json_string(sinksJ));
+            return ERROR;
+        }
+        SinkQueueMax = (uint64_t) queue;
+        sinksJ = listJ;
+    }
+
+    if (!json_object_is_type(sinksJ, json_type_array)) {
+        AFB_API_ERROR(api, "CtrlSinksConfig: 'sinks' section must be an array");
+        return ERROR;
+    }
+
+    CtrlSinksCount = (int) json_object_array_length(sinksJ);
+    CtrlSinks = calloc(CtrlSinksCount, sizeof(CtrlSinkT));
+    eventsJ = calloc(CtrlSinksCount, sizeof(json_object *));
+    for (idx = 0; idx < CtrlSinksCount; idx++)
+        errcount += SinkLoadOne(api, &CtrlSinks[idx], json_object_array_get_idx(sinksJ, idx), &eventsJ[idx]);
+
+    if (!errcount)
+        SinksCompile(eventsJ);
+
+    free(eventsJ);
+    return errcount;
+}
@@ -0,0 +1,218 @@
+/*
+ * Copyright (C) 2018 "IoT.bzh"
+ * Author Romain Forlot <romain@iot.bzh>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "controller-binding.h"
+
+#define SLOWLOG_DEFAULT_SIZE 64
+#define SLOWLOG_DEFAULT_ARGS 512
+
+/* One captured slow request, spans are relative to its start */
+typedef struct {
+    char *uid;
+    char *cid;
+    char *args;
+    time_t date;
+    uint64_t duration;
+    int count;
+    CtrlTraceSpanT spans[CTRL_TRACE_SPANS];
+} CtrlSlowRecordT;
+
+static CtrlSlowRecordT *CtrlSlowLog = NULL;
+static int CtrlSlowLogSize = 0;
+static uint64_t CtrlSlowLogNext = 0;
+static int CtrlSlowLogArgs = SLOWLOG_DEFAULT_ARGS;
+static int CtrlSlowLogThreshold = 0;
+static pthread_mutex_t CtrlSlowLogLock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * @brief Default threshold in milliseconds of the controls without their own.
+ *
+ * @return int the threshold, 0 when the slow log is disabled.
+ */
+int CtrlSlowLogDefault(void)
+{
+    return CtrlSlowLog ? CtrlSlowLogThreshold : 0;
+}
+
+/**
+ * @brief Start tracing a request.
+ *
+ * @param trace the trace to initialize.
+ */
+void CtrlTraceStart(CtrlTraceT *trace)
+{
+    trace->start = CtrlNowUsec();
+    trace->count = 0;
+}
+
+/**
+ * @brief Mark the start of a traced step.
+ *
+ * @param trace the request's trace, NULL if not traced.
+ * @return uint64_t the step start, 0 if not traced.
+ */
+uint64_t CtrlTraceMark(CtrlTraceT *trace)
+{
+    return trace ? CtrlNowUsec() : 0;
+}
+
+/**
+ * @brief Record a step of a traced request ending now, extra steps are
+ * dropped.
+ *
+ * @param trace the request's trace, NULL if not traced.
+ * @param name the step name, a static string.
+ * @param start the step start as given by CtrlTraceMark.
+ */
+void CtrlTraceSpan(CtrlTraceT *trace, const char *name, uint64_t start)
+{
+    if (!trace || trace->count >= CTRL_TRACE_SPANS)
+        return;
+
+    trace->spans[trace->count].name = name;
+    trace->spans[trace->count].offset = start - trace->start;
+    trace->spans[trace->count].duration = CtrlNowUsec() - start;
+    trace->count++;
+}
+
+/**
+ * @brief End a request's trace and capture it into the slow log if it lasted
+ * longer than its threshold. Only slow requests pay for the capture.
+ *
+ * @param trace the request's trace.
+ * @param threshold the threshold in milliseconds, 0 to never capture.
+ * @param uid the control uid.
+ * @param argsJ the request arguments, serialized up to the configured size.
+ */
+void CtrlTraceEnd(CtrlTraceT *trace, int threshold, const char *uid, json_object *argsJ)
+{
+    uint64_t duration = CtrlNowUsec() - trace->start;
+    const char *args, *cid = CtrlCorrelationGet();
+    CtrlSlowRecordT *record;
+    json_object *copyJ;
+
+    if (!CtrlSlowLog || threshold <= 0 || duration < (uint64_t) threshold * 1000)
+        return;
+
+    /* the arguments share their members with the request, serialize a copy */
+    copyJ = CtrlJsonCopy(argsJ);
+    args = copyJ ? json_object_to_json_string_ext(copyJ, JSON_C_TO_STRING_PLAIN) : "null";
+
+    pthread_mutex_lock(&CtrlSlowLogLock);
+    record = &CtrlSlowLog[CtrlSlowLogNext++ % (uint64_t) CtrlSlowLogSize];
+    free(record->uid);
+    free(record->cid);
+    free(record->args);
+    record->uid = strdup(uid);
+    record->cid = cid ? strdup(cid) : NULL;
+    record->args = strndup(args, (size_t) CtrlSlowLogArgs);
+    record->date = time(NULL);
+    record->duration = duration;
+    record->count = trace->count;
+    memcpy(record->spans, trace->spans, (size_t) trace->count * sizeof(CtrlTraceSpanT));
+    pthread_mutex_unlock(&CtrlSlowLogLock);
+    json_object_put(copyJ);
+}
+
+/**
+ * @brief Verb dumping the slow log, oldest first. { "clear": true } empties it
+ * once dumped.
+ *
+ * @param request AFB request with the JSON arguments if the request got some.
+ */
+void CtrlSlowLogRequest(afb_req_t request)
+{
+    json_object *recordsJ, *recordJ, *spansJ, *spanJ;
+    uint64_t first, seq;
+    int clear = 0;
+
+    if (!CtrlSlowLog) {
+        AFB_ReqFail(request, "disabled", "No 'slowlog' section configured");
+        return;
+    }
+
+    wrap_json_unpack(afb_req_json(request), "{s?b}", "clear", &clear);
+
+    recordsJ = json_object_new_array();
+    pthread_mutex_lock(&CtrlSlowLogLock);
+    first = CtrlSlowLogNext > (uint64_t) CtrlSlowLogSize ? CtrlSlowLogNext - (uint64_t) CtrlSlowLogSize : 0;
+    for (seq = first; seq < CtrlSlowLogNext; seq++) {
+        CtrlSlowRecordT *record = &CtrlSlowLog[seq % (uint64_t) CtrlSlowLogSize];
+
+        spansJ = json_object_new_array();
+        for (int idx = 0; idx < record->count; idx++) {
+            wrap_json_pack(&spanJ, "{ss,sI,sI}",
+                           "name", record->spans[idx].name,
+                           "offset", (int64_t) record->spans[idx].offset,
+                           "duration", (int64_t) record->spans[idx].duration);
+            json_object_array_add(spansJ, spanJ);
+        }
+
+        wrap_json_pack(&recordJ, "{ss,s?s,sI,sI,ss,so}",
+                       "uid", record->uid,
+                       "correlation", record->cid,
+                       "date", (int64_t) record->date,
+                       "duration", (int64_t) record->duration,
+                       "args", record->args,
+                       "spans", spansJ);
+        json_object_array_add(recordsJ, recordJ);
+    }
+    if (clear)
+        CtrlSlowLogNext = 0;
+    pthread_mutex_unlock(&CtrlSlowLogLock);
+
+    AFB_ReqSuccess(request, recordsJ, NULL);
+}
+
+/**
+ * @brief Controller's 'slowlog' section loader:
+ * { "size": 64, "threshold": 100, "args": 512 }
+ * Keeps the last 'size' control calls slower than their 'slow' threshold, or
+ * than 'threshold' milliseconds for controls without one, with their
+ * arguments cut to 'args' bytes and their steps timings.
+ *
+ * @param api the API handle being set up.
+ * @param section the section definition.
+ * @param slowlogJ the JSON section, NULL when called at init time.
+ * @return int 0 if OK, other if not.
+ */
+int CtrlSlowLogConfig(afb_api_t api, CtlSectionT *section, json_object *slowlogJ)
+{
+    int size = SLOWLOG_DEFAULT_SIZE;
+
+    if (!slowlogJ)
+        return 0;
+
+    if (wrap_json_unpack(slowlogJ, "{s?i,s?i,s?i}", "size", &size, "threshold", &CtrlSlowLogThreshold,
+                         "args", &CtrlSlowLogArgs) ||
+        size <= 0 || CtrlSlowLogThreshold < 0 || CtrlSlowLogArgs < 0) {
+        AFB_API_ERROR(api, "CtrlSlowLogConfig: invalid 'slowlog' section %s", json_object_to_json_string(slowlogJ));
+        return ERROR;
+    }
+
+    CtrlSlowLogSize = size;
+    CtrlSlowLog = calloc(size, sizeof(CtrlSlowRecordT));
+
+    return 0;
+}
@@ -0,0 +1,676 @@
+/*
+ * Copyright (C) 2018 "IoT.bzh"
+ * Author Romain Forlot <romain@iot.bzh>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stddef.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/inotify.h>
+#include <arpa/inet.h>
+#include <systemd/sd-event.h>
+
+#include "controller-binding.h"
+#include "controller-shm.h"
+
+#define SOURCE_DEFAULT_BUFFER 65536
+#define SOURCE_MAX_READS 16
+#define SOURCE_LISTEN_BACKLOG 8
+#define SOURCE_SHM_DEFAULT_CAPACITY 4096
+
+typedef enum {
+    SOURCE_TYPE_FILE,
+    SOURCE_TYPE_UNIX,
+    SOURCE_TYPE_INOTIFY,
+    SOURCE_TYPE_SHM,
+} CtrlFdSourceTypeT;
+
+typedef enum {
+    SOURCE_FRAMING_LINE,
+    SOURCE_FRAMING_JSONL,
+    SOURCE_FRAMING_LENGTH,
+} CtrlFramingT;
+
+typedef enum {
+    SHM_FIELD_INT8,
+    SHM_FIELD_UINT8,
+    SHM_FIELD_INT16,
+    SHM_FIELD_UINT16,
+    SHM_FIELD_INT32,
+    SHM_FIELD_UINT32,
+    SHM_FIELD_INT64,
+    SHM_FIELD_UINT64,
+    SHM_FIELD_FLOAT,
+    SHM_FIELD_DOUBLE,
+} CtrlShmFieldTypeT;
+
+static const char *SourceTypesNames[] = { "file", "unix", "inotify", "shm", NULL };
+static const char *ShmFieldTypesNames[] = { "int8", "uint8", "int16", "uint16", "int32", "uint32", "int64", "uint64", "float", "double", NULL };
+static const size_t ShmFieldTypesSizes[] = { 1, 1, 2, 2, 4, 4, 8, 8, sizeof(float), sizeof(double) };
+static const char *SourceFramingsNames[] = { "line", "jsonl", "length", NULL };
+
+typedef struct {
+    const char *name;
+    CtrlShmFieldTypeT type;
+    size_t offset;
+} CtrlShmFieldT;
+
+typedef struct {
+    const char *uid;
+    const char *path;
+    CtrlFdSourceTypeT type;
+    CtrlFramingT framing;
+    size_t bufferSize;
+    CtlActionT *actions;
+    afb_api_t api;
+    int fd;
+    sd_event_source *evtSource;
+    CtrlShmFieldT *fields;
+    int fieldsCount;
+    uint32_t recordSize;
+    uint32_t capacity;
+} CtrlFdSourceT;
+
+/* One reader per opened file or accepted connection, with reusable buffers */
+typedef struct {
+    CtrlFdSourceT *source;
+    int fd;
+    char *buffer;
+    size_t used;
+    struct json_tokener *tokener;
+    sd_event_source *evtSource;
+} CtrlReaderT;
+
+/* One shared memory ring per connected producer */
+typedef struct {
+    CtrlFdSourceT *source;
+    int sock;
+    int evfd;
+    CtrlShmRingT *ring;
+    size_t mapSize;
+    uint64_t tail;
+    sd_event_source *sockSource;
+    sd_event_source *evSource;
+} CtrlShmReaderT;
+
+static CtrlFdSourceT *CtrlFdSources = NULL;
+static int CtrlFdSourcesCount = 0;
+
+static int SourceNameIndex(const char **names, const char *name)
+{
+    for (int idx = 0; names[idx]; idx++) {
+        if (!strcasecmp(names[idx], name))
+            return idx;
+    }
+
+    return -1;
+}
+
+static void SourceDispatch(CtrlFdSourceT *source, json_object *payloadJ)
+{
+    if (!payloadJ)
+        return;
+
+    CtrlActionsExec(source->api, source->uid, source->actions, payloadJ);
+    CtrlDispatchEvent(source->api, source->uid, payloadJ);
+    json_object_put(payloadJ);
+}
+
+static json_object *ReaderParse(CtrlReaderT *reader, const char *data, size_t len)
+{
+    json_object *payloadJ;
+
+    json_tokener_reset(reader->tokener);
+    payloadJ = json_tokener_parse_ex(reader->tokener, data, (int) len);
+    if (!payloadJ)
+        AFB_API_WARNING(reader->source->api, "Source '%s': dropping invalid JSON frame", reader->source->uid);
+
+    return payloadJ;
+}
+
+/* Extract and dispatch every complete frame, return the consumed length */
+static size_t ReaderFrames(CtrlReaderT *reader)
+{
+    CtrlFdSourceT *source = reader->source;
+    size_t offset = 0, len;
+    char *end;
+    uint32_t frameLen;
+
+    while (offset < reader->used) {
+        if (source->framing == SOURCE_FRAMING_LENGTH) {
+            if (reader->used - offset < sizeof(frameLen))
+                break;
+            memcpy(&frameLen, reader->buffer + offset, sizeof(frameLen));
+            frameLen = ntohl(frameLen);
+            if (frameLen > source->bufferSize - sizeof(frameLen)) {
+                AFB_API_ERROR(source->api, "Source '%s': frame of %u bytes exceeds the buffer, resetting",
+                    source->uid, frameLen);
+                return reader->used;
+            }
+            if (reader->used - offset - sizeof(frameLen) < frameLen)
+                break;
+            SourceDispatch(source, ReaderParse(reader, reader->buffer + offset + sizeof(frameLen), frameLen));
+            offset += sizeof(frameLen) + frameLen;
+            continue;
+        }
+
+        end = memchr(reader->buffer + offset, '\n', reader->used - offset);
+        if (!end)
+            break;
+
+        len = (size_t) (end - (reader->buffer + offset));
+        if (len && reader->buffer[offset + len - 1] == '\r')
+            len--;
+
+        if (len) {
+            if (source->framing == SOURCE_FRAMING_JSONL)
+                SourceDispatch(source, ReaderParse(reader, reader->buffer + offset, len));
+            else
+                SourceDispatch(source, json_object_new_string_len(reader->buffer + offset, (int) len));
+        }
+        offset = (size_t) (end - reader->buffer) + 1;
+    }
+
+    /* A line longer than the whole buffer is dropped */
+    if (!offset && reader->used == source->bufferSize) {
+        AFB_API_ERROR(source->api, "Source '%s': frame exceeds the buffer, resetting", source->uid);
+        return reader->used;
+    }
+
+    return offset;
+}
+
+static void ReaderFree(CtrlReaderT *reader)
+{
+    sd_event_source_unref(reader->evtSource);
+    if (reader->fd != reader->source->fd)
+        close(reader->fd);
+    json_tokener_free(reader->tokener);
+    free(reader->buffer);
+    free(reader);
+}
+
+static void ReaderInotify(CtrlReaderT *reader, ssize_t count)
+{
+    struct inotify_event *event;
+    json_object *payloadJ;
+    ssize_t offset = 0;
+
+    while (offset + (ssize_t) sizeof(struct inotify_event) <= count) {
+        event = (struct inotify_event *) (reader->buffer + offset);
+        payloadJ = NULL;
+        wrap_json_pack(&payloadJ, "{ss,ss,si}",
+            "path", reader->source->path,
+            "name", event->len ? event->name : "",
+            "mask", (int) event->mask);
+        SourceDispatch(reader->source, payloadJ);
+        offset += (ssize_t) sizeof(struct inotify_event) + event->len;
+    }
+}
+
+static int ReaderIoCB(sd_event_source *evtSource, int fd, uint32_t revents, void *userdata)
+{
+    CtrlReaderT *reader = (CtrlReaderT *) userdata;
+    size_t consumed;
+    ssize_t count = 0;
+
+    /* Read a bounded number of batches per wakeup to stay fair with the loop */
+    for (int reads = 0; reads < SOURCE_MAX_READS; reads++) {
+        count = read(fd, reader->buffer + reader->used, reader->source->bufferSize - reader->used);
+        if (count <= 0)
+            break;
+
+        if (reader->source->type == SOURCE_TYPE_INOTIFY) {
+            ReaderInotify(reader, count);
+            continue;
+        }
+
+        reader->used += (size_t) count;
+        consumed = ReaderFrames(reader);
+        if (consumed) {
+            memmove(reader->buffer, reader->buffer + consumed, reader->used - consumed);
+            reader->used -= consumed;
+        }
+    }
+
+    if (!count || (count < 0 && errno != EAGAIN && errno != EINTR)) {
+        AFB_API_NOTICE(reader->source->api, "Source '%s': input closed", reader->source->uid);
+        ReaderFree(reader);
+    }
+
+    return 0;
+}
+
+static int ReaderCreate(CtrlFdSourceT *source, int fd)
+{
+    CtrlReaderT *reader = calloc(1, sizeof(CtrlReaderT));
+
+    reader->source = source;
+    reader->fd = fd;
+    reader->buffer = malloc(source->bufferSize);
+    reader->tokener = json_tokener_new();
+
+    if (sd_event_add_io(afb_api_get_event_loop(source->api), &reader->evtSource, fd, EPOLLIN, ReaderIoCB, reader) < 0) {
+        AFB_API_ERROR(source->api, "Source '%s': fail to watch input", source->uid);
+        ReaderFree(reader);
+        return ERROR;
+    }
+
+    return 0;
+}
+
+static json_object *ShmDecode(CtrlFdSourceT *source, const unsigned char *record)
+{
+    json_object *recordJ = json_object_new_object(), *valueJ;
+    union {
+        int8_t i8; uint8_t u8; int16_t i16; uint16_t u16; int32_t i32; uint32_t u32;
+        int64_t i64; uint64_t u64; float f; double d;
+    } value;
+
+    for (int idx = 0; idx < source->fieldsCount; idx++) {
+        CtrlShmFieldT *field = &source->fields[idx];
+        memcpy(&value, record + field->offset, ShmFieldTypesSizes[field->type]);
+        switch (field->type) {
+            case SHM_FIELD_INT8: valueJ = json_object_new_int(value.i8); break;
+            case SHM_FIELD_UINT8: valueJ = json_object_new_int(value.u8); break;
+            case SHM_FIELD_INT16: valueJ = json_object_new_int(value.i16); break;
+            case SHM_FIELD_UINT16: valueJ = json_object_new_int(value.u16); break;
+            case SHM_FIELD_INT32: valueJ = json_object_new_int(value.i32); break;
+            case SHM_FIELD_UINT32: valueJ = json_object_new_int64(value.u32); break;
+            case SHM_FIELD_INT64: valueJ = json_object_new_int64(value.i64); break;
+            case SHM_FIELD_UINT64: valueJ = json_object_new_int64((int64_t) value.u64); break;
+            case SHM_FIELD_FLOAT: valueJ = json_object_new_double(value.f); break;
+            default: valueJ = json_object_new_double(value.d); break;
+        }
+        json_object_object_add(recordJ, field->name, valueJ);
+    }
+
+    return recordJ;
+}
+
+static void ShmReaderFree(CtrlShmReaderT *reader)
+{
+    sd_event_source_unref(reader->sockSource);
+    sd_event_source_unref(reader->evSource);
+    if (reader->ring)
+        munmap(reader->ring, reader->mapSize);
+    if (reader->evfd >= 0)
+        close(reader->evfd);
+    if (reader->sock >= 0)
+        close(reader->sock);
+    free(reader);
+}
+
+/*
+ * Drain the ring by batches. Only the head index is read back from the shared
+ * memory, the layout and the tail are the controller's own copies, and head is
+ * bounded by capacity so a misbehaving producer cannot make the controller
+ * read out of the mapping.
+ */
+static int ShmEventCB(sd_event_source *evtSource, int fd, uint32_t revents, void *userdata)
+{
+    CtrlShmReaderT *reader = (CtrlShmReaderT *) userdata;
+    CtrlFdSourceT *source = reader->source;
+    CtrlShmRingT *ring = reader->ring;
+    uint64_t head, tail, counter;
+    const unsigned char *record;
+    int batches = 0;
+
+    if (read(fd, &counter, sizeof(counter)) < 0 && errno != EAGAIN)
+        return 0;
+
+    tail = reader->tail;
+    for (;;) {
+        head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        if (head - tail > source->capacity) {
+            AFB_API_ERROR(source->api, "Source '%s': producer corrupted the ring, disconnecting", source->uid);
+            ShmReaderFree(reader);
+            return 0;
+        }
+
+        for (; tail != head; tail++) {
+            record = ring->records + (tail & ((uint64_t) source->capacity - 1)) * source->recordSize;
+            SourceDispatch(source, ShmDecode(source, record));
+        }
+
+        reader->tail = tail;
+        __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&ring->head, __ATOMIC_RELAXED) == tail)
+            break;
+
+        /* Producer keeps up: yield to the loop and come back on our own wake-up */
+        if (++batches >= SOURCE_MAX_READS) {
+            counter = 1;
+            if (write(fd, &counter, sizeof(counter)) < 0)
+                AFB_API_WARNING(source->api, "Source '%s': fail to reschedule ring drain", source->uid);
+            break;
+        }
+    }
+
+    return 0;
+}
+
+static int ShmSocketCB(sd_event_source *evtSource, int fd, uint32_t revents, void *userdata)
+{
+    CtrlShmReaderT *reader = (CtrlShmReaderT *) userdata;
+    char discard[64];
+    ssize_t count = read(fd, discard, sizeof(discard));
+
+    if (!count || (count < 0 && errno != EAGAIN)) {
+        AFB_API_NOTICE(reader->source->api, "Source '%s': producer disconnected", reader->source->uid);
+        ShmReaderFree(reader);
+    }
+
+    return 0;
+}
+
+/* Create a ring for a new producer and send it the memfd and the eventfd */
+static int ShmReaderCreate(CtrlFdSourceT *source, int sock)
+{
+    CtrlShmReaderT *reader = calloc(1, sizeof(CtrlShmReaderT));
+    sd_event *loop = afb_api_get_event_loop(source->api);
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    union {
+        char buf[CMSG_SPACE(2 * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    int memfd, fds[2];
+    uint32_t layout[2] = { source->recordSize, source->capacity };
+
+    reader->source = source;
+    reader->sock = sock;
+    reader->evfd = -1;
+    reader->mapSize = sizeof(CtrlShmRingT) + (size_t) source->recordSize * source->capacity;
+
+    memfd = memfd_create(source->uid, MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (memfd < 0 || ftruncate(memfd, (off_t) reader->mapSize) < 0)
+        goto OnErrorExit;
+
+    /* Producer must not be able to shrink the memfd under our mapping */
+    if (fcntl(memfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) < 0)
+        goto OnErrorExit;
+
+    reader->ring = mmap(NULL, reader->mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    if (reader->ring == MAP_FAILED) {
+        reader->ring = NULL;
+        goto OnErrorExit;
+    }
+    reader->ring->magic = CTRL_SHM_MAGIC;
+    reader->ring->version = CTRL_SHM_VERSION;
+    reader->ring->recordSize = source->recordSize;
+    reader->ring->capacity = source->capacity;
+
+    reader->evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (reader->evfd < 0)
+        goto OnErrorExit;
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = layout;
+    iov.iov_len = sizeof(layout);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    fds[0] = memfd;
+    fds[1] = reader->evfd;
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    if (sendmsg(sock, &msg, MSG_NOSIGNAL) < 0)
+        goto OnErrorExit;
+    close(memfd);
+    memfd = -1;
+
+    if (sd_event_add_io(loop, &reader->evSource, reader->evfd, EPOLLIN, ShmEventCB, reader) < 0 ||
+        sd_event_add_io(loop, &reader->sockSource, sock, EPOLLIN | EPOLLRDHUP, ShmSocketCB, reader) < 0)
+        goto OnErrorExit;
+
+    return 0;
+
+OnErrorExit:
+    AFB_API_ERROR(source->api, "Source '%s': fail to setup producer ring: %s", source->uid, strerror(errno));
+    if (memfd >= 0)
+        close(memfd);
+    reader->sock = -1;
+    ShmReaderFree(reader);
+    return ERROR;
+}
+
+static int SourceAcceptCB(sd_event_source *evtSource, int fd, uint32_t revents, void *userdata)
+{
+    CtrlFdSourceT *source = (CtrlFdSourceT *) userdata;
+    int client = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+    if (client < 0) {
+        AFB_API_WARNING(source->api, "Source '%s': accept failed: %s", source->uid, strerror(errno));
+        return 0;
+    }
+
+    if ((source->type == SOURCE_TYPE_SHM ? ShmReaderCreate(source, client) : ReaderCreate(source, client)))
+        close(client);
+
+    return 0;
+}
+
+static int SourceOpenUnix(CtrlFdSourceT *source)
+{
+    struct sockaddr_un addr;
+    int fd;
+
+    if (strlen(source->path) >= sizeof(addr.sun_path))
+        return ERROR;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, source->path);
+    if (addr.sun_path[0] == '@')
+        addr.sun_path[0] = '\0';
+    else
+        unlink(source->path);
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return ERROR;
+
+    if (bind(fd, (struct sockaddr *) &addr, (socklen_t) (offsetof(struct sockaddr_un, sun_path) + strlen(source->path))) < 0 ||
+        listen(fd, SOURCE_LISTEN_BACKLOG) < 0) {
+        close(fd);
+        return ERROR;
+    }
+
+    source->fd = fd;
+    if (sd_event_add_io(afb_api_get_event_loop(source->api), &source->evtSource, fd, EPOLLIN, SourceAcceptCB, source) < 0)
+        return ERROR;
+
+    return 0;
+}
+
+static int SourceStart(CtrlFdSourceT *source)
+{
+    struct stat st;
+
+    switch (source->type) {
+        case SOURCE_TYPE_UNIX:
+        case SOURCE_TYPE_SHM:
+            return SourceOpenUnix(source);
+
+        case SOURCE_TYPE_INOTIFY:
+            source->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+            if (source->fd < 0 ||
+                inotify_add_watch(source->fd, source->path, IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_TO) < 0)
+                return ERROR;
+            break;
+
+        default:
+            /* A FIFO is also opened for writing so it never reports EOF */
+            if (stat(source->path, &st) < 0)
+                return ERROR;
+            /* epoll refuses regular files, they are always readable */
+            if (S_ISREG(st.st_mode)) {
+                AFB_API_ERROR(source->api, "SourceStart: source '%s' path '%s' is a regular file, "
+                              "only FIFOs and character devices could be watched", source->uid, source->path);
+                errno = EPERM;
+                return ERROR;
+            }
+            source->fd = open(source->path, (S_ISFIFO(st.st_mode) ? O_RDWR : O_RDONLY) | O_NONBLOCK | O_CLOEXEC);
+            if (source->fd < 0)
+                return ERROR;
+            break;
+    }
+
+    return ReaderCreate(source, source->fd);
+}
+
+static int ShmLoadRecord(afb_api_t api, CtrlFdSourceT *source, json_object *recordJ, int capacity)
+{
+    json_object *fieldJ;
+    const char *type;
+    int idx, fieldType;
+
+    if (!json_object_is_type(recordJ, json_type_array) || !json_object_array_length(recordJ) ||
+        capacity <= 0 || (capacity & (capacity - 1))) {
+        AFB_API_ERROR(api, "ShmLoadRecord: shm source '%s' needs a 'record' fields array and a power of two 'capacity'", source->uid);
+        return ERROR;
+    }
+
+    source->capacity = (uint32_t) capacity;
+    source->fieldsCount = (int) json_object_array_length(recordJ);
+    source->fields = calloc(source->fieldsCount, sizeof(CtrlShmFieldT));
+    for (idx = 0; idx < source->fieldsCount; idx++) {
+        fieldJ = json_object_array_get_idx(recordJ, idx);
+        if (wrap_json_unpack(fieldJ, "{ss,ss}", "name", &source->fields[idx].name, "type", &type) ||
+            (fieldType = SourceNameIndex(ShmFieldTypesNames, type)) < 0) {
+            AFB_API_ERROR(api, "ShmLoadRecord: shm source '%s' invalid field %s", source->uid,
+                json_object_to_json_string(fieldJ));
+            return ERROR;
+        }
+        source->fields[idx].type = (CtrlShmFieldTypeT) fieldType;
+        source->fields[idx].offset = source->recordSize;
+        source->recordSize += (uint32_t) ShmFieldTypesSizes[fieldType];
+    }
+
+    return 0;
+}
+
+static int SourceLoadOne(afb_api_t api, CtrlFdSourceT *source, json_object *sourceJ)
+{
+    json_object *actionsJ = NULL, *recordJ = NULL;
+    const char *type = NULL, *framing = "line";
+    int bufferSize = SOURCE_DEFAULT_BUFFER, capacity = SOURCE_SHM_DEFAULT_CAPACITY, idx;
+
+    if (wrap_json_unpack(sourceJ, "{ss,ss,ss,s?s,s?i,s?o,s?o,s?i}",
+            "uid", &source->uid,
+            "type", &type,
+            "path", &source->path,
+            "framing", &framing,
+            "buffer", &bufferSize,
+            "actions", &actionsJ,
+            "record", &recordJ,
+            "capacity", &capacity) || bufferSize <= 0) {
+        AFB_API_ERROR(api, "SourceLoadOne: source needs 'uid', 'type' and 'path': %s",
+            json_object_to_json_string(sourceJ));
+        return ERROR;
+    }
+
+    idx = SourceNameIndex(SourceTypesNames, type);
+    if (idx < 0) {
+        AFB_API_ERROR(api, "SourceLoadOne: source '%s' unknown type '%s'", source->uid, type);
+        return ERROR;
+    }
+    source->type = (CtrlFdSourceTypeT) idx;
+
+    idx = SourceNameIndex(SourceFramingsNames, framing);
+    if (idx < 0) {
+        AFB_API_ERROR(api, "SourceLoadOne: source '%s' unknown framing '%s'", source->uid, framing);
+        return ERROR;
+    }
+    source->framing = (CtrlFramingT) idx;
+
+    if (source->type == SOURCE_TYPE_SHM && ShmLoadRecord(api, source, recordJ, capacity))
+        return ERROR;
+
+    /* inotify events are read whole, the buffer must hold at least one */
+    if (source->type == SOURCE_TYPE_INOTIFY && bufferSize < (int) sizeof(struct inotify_event) + NAME_MAX + 1)
+        bufferSize = (int) sizeof(struct inotify_event) + NAME_MAX + 1;
+
+    source->api = api;
+    source->fd = -1;
+    source->bufferSize = (size_t) bufferSize;
+    if (actionsJ)
+        source->actions = ActionConfig(api, actionsJ, 0);
+
+    return 0;
+}
+
+/**
+ * @brief Controller's 'sources' section loader. Sources are file descriptors
+ * watched through the binder's event loop: FIFOs or character devices,
+ * unix stream sockets accepting producers, inotify watches, and shared memory
+ * rings handed over to local producers. Input is read by batches into
+ * reusable buffers, split according to the source's framing or decoded from
+ * fixed layout records, then dispatched to the source's actions and to the
+ * controller's events handlers with the source uid as label.
+ *
+ * @param api the API handle being set up.
+ * @param section the section definition.
+ * @param sourcesJ the JSON section, NULL when called at init time.
+ * @return int 0 if OK, other if not.
+ */
+int CtrlSourcesConfig(afb_api_t api, CtlSectionT *section, json_object *sourcesJ)
+{
+    int idx, errcount = 0;
+
+    if (!sourcesJ) {
+        for (idx = 0; idx < CtrlFdSourcesCount; idx++) {
+            if (SourceStart(&CtrlFdSources[idx])) {
+                AFB_API_ERROR(api, "CtrlSourcesConfig: fail to start source '%s' on '%s': %s",
+                    CtrlFdSources[idx].uid, CtrlFdSources[idx].path, strerror(errno));
+                errcount++;
+            }
+        }
+        return errcount;
+    }
+
+    if (!json_object_is_type(sourcesJ, json_type_array)) {
+        AFB_API_ERROR(api, "CtrlSourcesConfig: 'sources' section must be an array");
+        return ERROR;
+    }
+
+    CtrlFdSourcesCount = (int) json_object_array_length(sourcesJ);
+    CtrlFdSources = calloc(CtrlFdSourcesCount, sizeof(CtrlFdSourceT));
+    for (idx = 0; idx < CtrlFdSourcesCount; idx++)
+        errcount += SourceLoadOne(api, &CtrlFdSources[idx], json_object_array_get_idx(sourcesJ, idx));
+
+    return errcount;
+}
@@ -0,0 +1,463 @@
+/*
+ * Copyright (C) 2018 "IoT.bzh"
+ * Author Romain Forlot <romain@iot.bzh>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "controller-binding.h"
+
+#define SM_ANY_STATE "*"
+#define SM_ANY_STATE_ID -1
+
+typedef struct {
+    const char *uid;
+    CtlActionT *onentry;
+    CtlActionT *onexit;
+} CtrlStateT;
+
+typedef struct {
+    int from;
+    int to;
+    int trigger;
+    CtrlConditionT *guards;
+    int guardsCount;
+    CtlActionT *actions;
+} CtrlTransitionT;
+
+typedef struct {
+    const char *uid;
+    CtrlInternT states;
+    CtrlStateT *stateDefs;
+    CtrlTransitionT *transitions;
+    int transitionsCount;
+    int *table;
+    int *candidates;
+    int current;
+    afb_event_t event;
+    int loa;
+    const char *privileges;
+    pthread_mutex_t lock;
+} CtrlStateMachineT;
+
+/*
+ * Triggers, events labels and controls names, share one id space so that
+ * every machine transition table is indexed the same way by
+ * state * triggersCount + trigger.
+ */
+static CtrlInternT CtrlSmTriggers = { 0 };
+static CtrlStateMachineT *CtrlStateMachines = NULL;
+static int CtrlStateMachinesCount = 0;
+static int CtrlSmTriggersCount = 0;
+
+static int StateMachineLoadStates(afb_api_t api, CtrlStateMachineT *machine, json_object *statesJ)
+{
+    json_object *stateJ, *onentryJ, *onexitJ;
+    int idx, count = (int) json_object_array_length(statesJ);
+
+    machine->stateDefs = calloc(count, sizeof(CtrlStateT));
+    for (idx = 0; idx < count; idx++) {
+        stateJ = json_object_array_get_idx(statesJ, idx);
+        onentryJ = onexitJ = NULL;
+        if (json_object_is_type(stateJ, json_type_string)) {
+            machine->stateDefs[idx].uid = json_object_get_string(stateJ);
+        }
+        else if (wrap_json_unpack(stateJ, "{ss,s?o,s?o}",
+                    "uid", &machine->stateDefs[idx].uid,
+                    "onentry", &onentryJ,
+                    "onexit", &onexitJ)) {
+            AFB_API_ERROR(api, "StateMachineLoadStates: invalid state in machine '%s': %s",
+                machine->uid, json_object_to_json_string(stateJ));
+            return ERROR;
+        }
+
+        if (CtrlInternFind(&machine->states, machine->stateDefs[idx].uid) >= 0) {
+            AFB_API_ERROR(api, "StateMachineLoadStates: duplicated state '%s' in machine '%s'",
+                machine->stateDefs[idx].uid, machine->uid);
+            return ERROR;
+        }
+        CtrlInternAdd(&machine->states, machine->stateDefs[idx].uid);
+
+        if (onentryJ)
+            machine->stateDefs[idx].onentry = ActionConfig(api, onentryJ, 0);
+        if (onexitJ)
+            machine->stateDefs[idx].onexit = ActionConfig(api, onexitJ, 0);
+    }
+
+    return 0;
+}
+
+static int StateMachineLoadTransitions(afb_api_t api, CtrlStateMachineT *machine, json_object *transitionsJ)
+{
+    json_object *transitionJ, *guardJ, *actionsJ;
+    const char *from, *to, *event, *control;
+    CtrlTransitionT *transition;
+    int idx, count = (int) json_object_array_length(transitionsJ);
+
+    machine->transitions = calloc(count, sizeof(CtrlTransitionT));
+    machine->transitionsCount = count;
+    for (idx = 0; idx < count; idx++) {
+        transitionJ = json_object_array_get_idx(transitionsJ, idx);
+        transition = &machine->transitions[idx];
+        from = to = event = control = NULL;
+        guardJ = actionsJ = NULL;
+
+        if (wrap_json_unpack(transitionJ, "{ss,ss,s?s,s?s,s?o,s?o}",
+                "from", &from,
+                "to", &to,
+                "event", &event,
+                "control", &control,
+                "guard", &guardJ,
+                "actions", &actionsJ) || !event == !control) {
+            AFB_API_ERROR(api, "StateMachineLoadTransitions: machine '%s' transition needs 'from', 'to' and one of 'event' or 'control': %s",
+                machine->uid, json_object_to_json_string(transitionJ));
+            return ERROR;
+        }
+
+        transition->from = strcmp(from, SM_ANY_STATE) ? CtrlInternFind(&machine->states, from) : SM_ANY_STATE_ID;
+        transition->to = CtrlInternFind(&machine->states, to);
+        if (transition->to < 0 || (transition->from < 0 && strcmp(from, SM_ANY_STATE))) {
+            AFB_API_ERROR(api, "StateMachineLoadTransitions: machine '%s' unknown state in transition %s -> %s",
+                machine->uid, from, to);
+            return ERROR;
+        }
+
+        if (event) {
+            transition->trigger = CtrlInternAdd(&CtrlSmTriggers, event);
+        }
+        else {
+            char *trigger;
+            if (asprintf(&trigger, "control:%s", control) < 0)
+                return ERROR;
+            transition->trigger = CtrlInternAdd(&CtrlSmTriggers, trigger);
+            free(trigger);
+        }
+
+        transition->guards = CtrlConditionsLoad(api, guardJ, &transition->guardsCount);
+        if (transition->guardsCount < 0)
+            return ERROR;
+
+        if (actionsJ)
+            transition->actions = ActionConfig(api, actionsJ, 0);
+    }
+
+    return 0;
+}
+
+/*
+ * Build the dense transition table once every trigger has been interned. The
+ * table holds, for every (state, trigger) cell, the range of its candidate
+ * transitions in the candidates array, kept in declaration order so that the
+ * first transition whose guards hold wins.
+ */
+static void StateMachineCompile(CtrlStateMachineT *machine)
+{
+    int idx, state, cell, cellsCount = machine->states.count * CtrlSmTriggersCount;
+    int *fill;
+
+    machine->table = calloc(cellsCount + 1, sizeof(int));
+    for (state = 0; state < machine->states.count; state++) {
+        for (idx = 0; idx < machine->transitionsCount; idx++) {
+            CtrlTransitionT *transition = &machine->transitions[idx];
+            if (transition->from == state || transition->from == SM_ANY_STATE_ID)
+                machine->table[state * CtrlSmTriggersCount + transition->trigger + 1]++;
+        }
+    }
+
+    for (cell = 0; cell < cellsCount; cell++)
+        machine->table[cell + 1] += machine->table[cell];
+
+    machine->candidates = malloc((machine->table[cellsCount] + 1) * sizeof(int));
+    fill = calloc(cellsCount, sizeof(int));
+    for (state = 0; state < machine->states.count; state++) {
+        for (idx = 0; idx < machine->transitionsCount; idx++) {
+            CtrlTransitionT *transition = &machine->transitions[idx];
+            if (transition->from != state && transition->from != SM_ANY_STATE_ID)
+                continue;
+            cell = state * CtrlSmTriggersCount + transition->trigger;
+            machine->candidates[machine->table[cell] + fill[cell]++] = idx;
+        }
+    }
+    free(fill);
+}
+
+static json_object *StateMachineStatus(CtrlStateMachineT *machine)
+{
+    return json_object_new_string(machine->stateDefs[machine->current].uid);
+}
+
+/* Fire one trigger on a machine, return 1 if a transition happened */
+static int StateMachineFire(afb_api_t api, CtrlStateMachineT *machine, int trigger, json_object *payloadJ)
+{
+    CtrlTransitionT *transition = NULL, *candidate;
+    int from, cell, idx;
+
+    pthread_mutex_lock(&machine->lock);
+    from = machine->current;
+    cell = from * CtrlSmTriggersCount + trigger;
+    for (idx = machine->table[cell]; idx < machine->table[cell + 1]; idx++) {
+        candidate = &machine->transitions[machine->candidates[idx]];
+        if (CtrlConditionsEval(candidate->guards, candidate->guardsCount, payloadJ)) {
+            transition = candidate;
+            machine->current = transition->to;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&machine->lock);
+
+    if (!transition)
+        return 0;
+
+    AFB_API_DEBUG(api, "StateMachine '%s': %s -> %s [%s]", machine->uid,
+        machine->stateDefs[from].uid, machine->stateDefs[transition->to].uid, CtrlCorrelationGet());
+
+    /* Actions run out of the lock, they may trigger the controller back */
+    CtrlActionsExec(api, machine->uid, machine->stateDefs[from].onexit, payloadJ);
+    CtrlActionsExec(api, machine->uid, transition->actions, payloadJ);
+    CtrlActionsExec(api, machine->uid, machine->stateDefs[transition->to].onentry, payloadJ);
+
+    if (machine->event) {
+        json_object *evtJ = NULL;
+        wrap_json_pack(&evtJ, "{ss,ss,ss}",
+            "uid", machine->uid,
+            "from", machine->stateDefs[from].uid,
+            "to", machine->stateDefs[transition->to].uid);
+        afb_event_push(machine->event, CtrlCorrelationTag(evtJ));
+    }
+
+    return 1;
+}
+
+/**
+ * @brief Fire a trigger on every state machine, ie: the one of a control
+ * driving machines, called once the control's checks passed.
+ *
+ * @param api the controller API handle.
+ * @param trigger the trigger id.
+ * @param payloadJ the trigger payload, ownership is kept by the caller.
+ */
+void CtrlStateMachineTrigger(afb_api_t api, int trigger, json_object *payloadJ)
+{
+    for (int idx = 0; idx < CtrlStateMachinesCount; idx++)
+        StateMachineFire(api, &CtrlStateMachines[idx], trigger, payloadJ);
+}
+
+/**
+ * @brief Dispatch an event received by the controller API to the state
+ * machines. Cost is one hash lookup then one table lookup per machine.
+ *
+ * @param api the controller API handle.
+ * @param evtLabel the event label, ie: "api/event".
+ * @param eventJ the event payload.
+ */
+void CtrlStateMachineDispatch(afb_api_t api, const char *evtLabel, json_object *eventJ)
+{
+    int trigger = CtrlInternFind(&CtrlSmTriggers, evtLabel);
+
+    if (trigger >= 0)
+        CtrlStateMachineTrigger(api, trigger, eventJ);
+}
+
+/* Verb created for every 'control' trigger not naming a declared control */
+static void StateMachineControlRequest(afb_req_t request)
+{
+    int trigger = (int) (intptr_t) afb_req_get_vcbdata(request);
+    json_object *statesJ = json_object_new_object();
+    char cidBuffer[CTRL_CORRELATION_LEN];
+    const char *previous = CtrlCorrelationSet(CtrlCorrelationFrom(afb_req_json(request), cidBuffer));
+
+    CtrlStateMachineTrigger(afb_req_get_api(request), trigger, afb_req_json(request));
+    CtrlCorrelationSet(previous);
+
+    for (int idx = 0; idx < CtrlStateMachinesCount; idx++)
+        json_object_object_add(statesJ, CtrlStateMachines[idx].uid, StateMachineStatus(&CtrlStateMachines[idx]));
+
+    AFB_ReqSuccess(request, statesJ, NULL);
+}
+
+/**
+ * @brief Verb returning the current state of every state machine, or of the
+ * one given by { "uid": "name" }.
+ *
+ * @param request AFB request with the JSON arguments if the request got some.
+ */
+void CtrlStateMachineRequest(afb_req_t request)
+{
+    const char *uid = NULL;
+    json_object *statesJ;
+
+    wrap_json_unpack(afb_req_json(request), "{s?s}", "uid", &uid);
+
+    statesJ = json_object_new_object();
+    for (int idx = 0; idx < CtrlStateMachinesCount; idx++) {
+        if (uid && strcmp(uid, CtrlStateMachines[idx].uid))
+            continue;
+        json_object_object_add(statesJ, CtrlStateMachines[idx].uid, StateMachineStatus(&CtrlStateMachines[idx]));
+    }
+
+    if (uid && !json_object_object_length(statesJ)) {
+        json_object_put(statesJ);
+        AFB_ReqFailF(request, "unknown-machine", "No state machine '%s'", uid);
+        return;
+    }
+
+    AFB_ReqSuccess(request, statesJ, NULL);
+}
+
+static int StateMachineLoadOne(afb_api_t api, CtrlStateMachineT *machine, json_object *machineJ)
+{
+    json_object *statesJ = NULL, *transitionsJ = NULL;
+    const char *initial = NULL, *event = NULL;
+
+    if (wrap_json_unpack(machineJ, "{ss,s?s,so,so,s?s,s?i,s?s}",
+            "uid", &machine->uid,
+            "initial", &initial,
+            "states", &statesJ,
+            "transitions", &transitionsJ,
+            "event", &event,
+            "auth", &machine->loa,
+            "privileges", &machine->privileges) ||
+        !json_object_is_type(statesJ, json_type_array) ||
+        !json_object_is_type(transitionsJ, json_type_array) ||
+        !json_object_array_length(statesJ)) {
+        AFB_API_ERROR(api, "StateMachineLoadOne: machine needs a 'uid', a 'states' array and a 'transitions' array: %s",
+            json_object_to_json_string(machineJ));
+        return ERROR;
+    }
+
+    pthread_mutex_init(&machine->lock, NULL);
+
+    if (StateMachineLoadStates(api, machine, statesJ) ||
+        StateMachineLoadTransitions(api, machine, transitionsJ))
+        return ERROR;
+
+    machine->current = initial ? CtrlInternFind(&machine->states, initial) : 0;
+    if (machine->current < 0) {
+        AFB_API_ERROR(api, "StateMachineLoadOne: machine '%s' unknown initial state '%s'", machine->uid, initial);
+        return ERROR;
+    }
+
+    if (event)
+        machine->event = CtrlEventGet(api, event);
+
+    return 0;
+}
+
+/*
+ * A trigger verb takes the highest LOA of the machines it drives, which must
+ * agree on its privileges.
+ */
+static int StateMachineTriggerAuth(afb_api_t api, int trigger, int *loa, const char **privileges)
+{
+    *loa = 0;
+    *privileges = NULL;
+
+    for (int idx = 0; idx < CtrlStateMachinesCount; idx++) {
+        CtrlStateMachineT *machine = &CtrlStateMachines[idx];
+        for (int tidx = 0; tidx < machine->transitionsCount; tidx++) {
+            if (machine->transitions[tidx].trigger != trigger)
+                continue;
+            if (machine->loa > *loa)
+                *loa = machine->loa;
+            if (machine->privileges && *privileges && strcmp(machine->privileges, *privileges)) {
+                AFB_API_ERROR(api, "StateMachineTriggerAuth: machines disagree on trigger '%s' privileges",
+                    CtrlSmTriggers.names[trigger] + 8);
+                return ERROR;
+            }
+            if (machine->privileges)
+                *privileges = machine->privileges;
+            break;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Controller's 'statemachines' section loader. Every machine declares
+ * its states with optional 'onentry' and 'onexit' actions, and transitions
+ * triggered by an event label or a control name, with optional guards and
+ * actions. A declared control fires its transitions once its own checks
+ * passed, other control names become verbs protected by the machines 'auth'
+ * and 'privileges'.
+ *
+ * @param api the API handle being set up.
+ * @param section the section definition.
+ * @param machinesJ the JSON section, NULL when called at init time.
+ * @return int 0 if OK, other if not.
+ */
+int CtrlStateMachineConfig(afb_api_t api, CtlSectionT *section, json_object *machinesJ)
+{
+    int idx, errcount = 0;
+
+    /* Enter initial states once the plugins are initialized */
+    if (!machinesJ) {
+        for (idx = 0; idx < CtrlStateMachinesCount; idx++) {
+            CtrlStateMachineT *machine = &CtrlStateMachines[idx];
+            CtrlActionsExec(api, machine->uid, machine->stateDefs[machine->current].onentry, NULL);
+        }
+        return 0;
+    }
+
+    if (!json_object_is_type(machinesJ, json_type_array)) {
+        AFB_API_ERROR(api, "CtrlStateMachineConfig: 'statemachines' section must be an array");
+        return ERROR;
+    }
+
+    CtrlStateMachinesCount = (int) json_object_array_length(machinesJ);
+    CtrlStateMachines = calloc(CtrlStateMachinesCount, sizeof(CtrlStateMachineT));
+    for (idx = 0; idx < CtrlStateMachinesCount; idx++)
+        errcount += StateMachineLoadOne(api, &CtrlStateMachines[idx], json_object_array_get_idx(machinesJ, idx));
+
+    if (errcount)
+        return errcount;
+
+    CtrlSmTriggersCount = CtrlSmTriggers.count;
+    for (idx = 0; idx < CtrlStateMachinesCount; idx++)
+        StateMachineCompile(&CtrlStateMachines[idx]);
+
+    /* Every distinct control trigger hooks into its control, or becomes an API verb */
+    for (idx = 0; idx < CtrlSmTriggersCount; idx++) {
+        const char *trigger = CtrlSmTriggers.names[idx], *privileges;
+        CtrlControlT *control;
+        int loa;
+
+        if (strncmp(trigger, "control:", 8))
+            continue;
+
+        control = CtrlControlFind(trigger + 8);
+        if (control) {
+            control->smTrigger = idx + 1;
+            continue;
+        }
+
+        if (StateMachineTriggerAuth(api, idx, &loa, &privileges)) {
+            errcount++;
+            continue;
+        }
+        if (afb_api_add_verb(api, trigger + 8, "State machine trigger", StateMachineControlRequest,
+                             (void *) (intptr_t) idx, CtrlAuthMake(loa, privileges), 0, 0)) {
+            AFB_API_ERROR(api, "CtrlStateMachineConfig: fail to register trigger verb '%s'", trigger + 8);
+            errcount++;
+        }
+    }
+
+    return errcount;
+}
@@ -0,0 +1,333 @@
+/*
+ * Copyright (C) 2018 "IoT.bzh"
+ * Author Romain Forlot <romain@iot.bzh>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "controller-binding.h"
+
+#define STREAM_DEFAULT_CHUNK 65536
+#define STREAM_DEFAULT_WINDOW 4
+#define STREAM_DEFAULT_IDLE 30000
+
+/*
+ * A streamed result, pushed by chunks on an event of its own to the client
+ * that called the control. At most 'window' chunks are in flight: the next
+ * ones are produced as the client acknowledges the previous ones, only the
+ * session that opened the stream may acknowledge or cancel it. Until its
+ * producer is attached, the stream belongs to the control call opening it:
+ * it is only closed by CtrlStreamFeed or CtrlStreamFail.
+ */
+struct CtrlStreamS {
+    struct CtrlStreamS *next;
+    afb_api_t api;
+    unsigned id;
+    uint64_t session;
+    afb_event_t event;
+    sd_event_source *timer;
+    size_t chunk;
+    int window;
+    uint64_t idle;
+    uint64_t activity;
+    int seq;
+    int acked;
+    int cancelled;
+    CtrlStreamProducerT producer;
+    void *closure;
+    void (*release)(void *closure);
+};
+
+/* Slices an array result it owns, releasing the items pushed */
+typedef struct {
+    json_object *arrayJ;
+    int idx;
+    int count;
+    json_object *valueJ;
+} CtrlStreamArrayT;
+
+static CtrlStreamT *CtrlStreams = NULL;
+static unsigned CtrlStreamsNextId = 0;
+static pthread_mutex_t CtrlStreamsLock = PTHREAD_MUTEX_INITIALIZER;
+
+static void StreamClose(CtrlStreamT *stream)
+{
+    CtrlStreamT **prev;
+
+    for (prev = &CtrlStreams; *prev; prev = &(*prev)->next) {
+        if (*prev == stream) {
+            *prev = stream->next;
+            break;
+        }
+    }
+
+    if (stream->release)
+        stream->release(stream->closure);
+    sd_event_source_set_enabled(stream->timer, SD_EVENT_OFF);
+    sd_event_source_unref(stream->timer);
+    afb_event_unref(stream->event);
+    free(stream);
+}
+
+/* Push chunks while the window allows it, called with the lock held */
+static void StreamPump(CtrlStreamT *stream)
+{
+    json_object *itemsJ, *chunkJ;
+
+    while (stream->producer && stream->seq - stream->acked < stream->window) {
+        itemsJ = stream->producer(stream->closure, stream->chunk);
+        if (!itemsJ) {
+            wrap_json_pack(&chunkJ, "{si,si,sb}", "stream", (int) stream->id, "seq", stream->seq, "end", 1);
+            afb_event_push(stream->event, chunkJ);
+            StreamClose(stream);
+            return;
+        }
+        wrap_json_pack(&chunkJ, "{si,si,so}", "stream", (int) stream->id, "seq", stream->seq++, "items", itemsJ);
+        afb_event_push(stream->event, chunkJ);
+    }
+}
+
+static int StreamIdleCB(sd_event_source *source, uint64_t usec, void *context)
+{
+    unsigned id = (unsigned) (uintptr_t) context;
+    CtrlStreamT *stream;
+    json_object *chunkJ;
+
+    pthread_mutex_lock(&CtrlStreamsLock);
+    for (stream = CtrlStreams; stream && stream->id != id; stream = stream->next)
+        ;
+    if (stream && stream->producer && CtrlNowUsec() - stream->activity >= stream->idle) {
+        wrap_json_pack(&chunkJ, "{si,si,ss}", "stream", (int) stream->id, "seq", stream->seq, "error", "timeout");
+        afb_event_push(stream->event, chunkJ);
+        StreamClose(stream);
+    }
+    else if (stream) {
+        sd_event_source_set_time(source, stream->activity + stream->idle);
+        sd_event_source_set_enabled(source, SD_EVENT_ONESHOT);
+    }
+    pthread_mutex_unlock(&CtrlStreamsLock);
+
+    return 0;
+}
+
+/**
+ * @brief Open a stream for a control request, subscribe the client to its
+ * event and reply { "stream": 12, "event": "api/stream-12" } right away.
+ *
+ * @param request the control request, replied.
+ * @param chunk the serialized size of a chunk, 0 for the default.
+ * @param window the chunks in flight before waiting for acks, 0 for the default.
+ * @param idle milliseconds without acks before dropping the stream, 0 for the default.
+ * @return CtrlStreamT* the stream, NULL if it could not be opened and the
+ * request was replied an error.
+ */
+CtrlStreamT *CtrlStreamOpen(afb_req_t request, int chunk, int window, int idle)
+{
+    afb_api_t api = afb_req_get_api(request);
+    CtrlSessionT *session = CtrlSessionGet(request, 1);
+    CtrlStreamT *stream = calloc(1, sizeof(CtrlStreamT));
+    json_object *responseJ;
+    char name[32], *fullname;
+
+    stream->session = session ? session->id : 0;
+
+    pthread_mutex_lock(&CtrlStreamsLock);
+    stream->id = ++CtrlStreamsNextId;
+    pthread_mutex_unlock(&CtrlStreamsLock);
+
+    stream->api = api;
+    stream->chunk = chunk > 0 ? (size_t) chunk : STREAM_DEFAULT_CHUNK;
+    stream->window = window > 0 ? window : STREAM_DEFAULT_WINDOW;
+    stream->idle = (uint64_t) (idle > 0 ? idle : STREAM_DEFAULT_IDLE) * 1000;
+    stream->activity = CtrlNowUsec();
+
+    snprintf(name, sizeof(name), "stream-%u", stream->id);
+    stream->event = afb_api_make_event(api, name);
+    if (!afb_event_is_valid(stream->event) || afb_req_subscribe(request, stream->event) < 0 ||
+        sd_event_add_time(afb_api_get_event_loop(api), &stream->timer, CLOCK_MONOTONIC,
+                          stream->activity + stream->idle, 1000, StreamIdleCB, (void *) (uintptr_t) stream->id) < 0) {
+        AFB_ReqFail(request, "internal-error", "Fail to open the result stream");
+        afb_event_unref(stream->event);
+        free(stream);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&CtrlStreamsLock);
+    stream->next = CtrlStreams;
+    CtrlStreams = stream;
+    pthread_mutex_unlock(&CtrlStreamsLock);
+
+    if (asprintf(&fullname, "%s/%s", afb_api_name(api), name) < 0)
+        fullname = NULL;
+    wrap_json_pack(&responseJ, "{si,s?s,sI,si}", "stream", (int) stream->id, "event", fullname,
+                   "chunk", (int64_t) stream->chunk, "window", stream->window);
+    free(fullname);
+    AFB_ReqSuccess(request, responseJ, NULL);
+
+    return stream;
+}
+
+/**
+ * @brief Start producing a stream's chunks, the producer is called for each
+ * chunk, as the window allows, until it returns NULL.
+ *
+ * @param stream the stream.
+ * @param producer returns the next items array, NULL once done.
+ * @param closure the producer's closure.
+ * @param release releases the closure once the stream is over, could be NULL.
+ */
+void CtrlStreamFeed(CtrlStreamT *stream, CtrlStreamProducerT producer, void *closure, void (*release)(void *closure))
+{
+    pthread_mutex_lock(&CtrlStreamsLock);
+    stream->producer = producer;
+    stream->closure = closure;
+    stream->release = release;
+    stream->activity = CtrlNowUsec();
+    if (stream->cancelled)
+        StreamClose(stream);
+    else
+        StreamPump(stream);
+    pthread_mutex_unlock(&CtrlStreamsLock);
+}
+
+/**
+ * @brief End a stream on a failure of its producer.
+ *
+ * @param stream the stream.
+ * @param error the error status.
+ * @param info the error details, could be NULL.
+ */
+void CtrlStreamFail(CtrlStreamT *stream, const char *error, const char *info)
+{
+    json_object *chunkJ;
+
+    pthread_mutex_lock(&CtrlStreamsLock);
+    wrap_json_pack(&chunkJ, "{si,si,ss,s?s}", "stream", (int) stream->id, "seq", stream->seq, "error", error, "info", info);
+    afb_event_push(stream->event, chunkJ);
+    StreamClose(stream);
+    pthread_mutex_unlock(&CtrlStreamsLock);
+}
+
+/*
+ * Items are measured by serializing them one by one to fill the chunk, and the
+ * array drops its reference on the items pushed so that the result shrinks as
+ * it streams instead of being serialized at once.
+ */
+static json_object *StreamArrayNext(void *closure, size_t budget)
+{
+    CtrlStreamArrayT *slicer = (CtrlStreamArrayT *) closure;
+    json_object *itemsJ, *itemJ;
+    size_t size = 0;
+
+    if (slicer->valueJ) {
+        itemsJ = json_object_new_array();
+        json_object_array_add(itemsJ, slicer->valueJ);
+        slicer->valueJ = NULL;
+        return itemsJ;
+    }
+
+    if (slicer->idx >= slicer->count)
+        return NULL;
+
+    itemsJ = json_object_new_array();
+    while (slicer->idx < slicer->count && (!size || size < budget)) {
+        itemJ = json_object_get(json_object_array_get_idx(slicer->arrayJ, slicer->idx));
+        size += strlen(json_object_to_json_string_ext(itemJ, JSON_C_TO_STRING_PLAIN)) + 1;
+        json_object_array_add(itemsJ, itemJ);
+        json_object_array_put_idx(slicer->arrayJ, slicer->idx, NULL);
+        slicer->idx++;
+    }
+
+    return itemsJ;
+}
+
+static void StreamArrayRelease(void *closure)
+{
+    CtrlStreamArrayT *slicer = (CtrlStreamArrayT *) closure;
+
+    json_object_put(slicer->arrayJ);
+    json_object_put(slicer->valueJ);
+    free(slicer);
+}
+
+/**
+ * @brief Stream a result: an array by items, anything else as a single item.
+ *
+ * @param stream the stream.
+ * @param resultJ the result, a reference is taken.
+ * @param owned whether the result is no longer used by anyone else. Results
+ * given by the binder are not owned, an in-process callee may keep them (ie: a
+ * cache): the stream, pulled from other threads, works on a copy of them.
+ */
+void CtrlStreamFeedJson(CtrlStreamT *stream, json_object *resultJ, int owned)
+{
+    CtrlStreamArrayT *slicer = calloc(1, sizeof(CtrlStreamArrayT));
+
+    resultJ = owned ? json_object_get(resultJ) : CtrlJsonCopy(resultJ);
+    if (json_object_is_type(resultJ, json_type_array)) {
+        slicer->arrayJ = resultJ;
+        slicer->count = (int) json_object_array_length(resultJ);
+    }
+    else
+        slicer->valueJ = resultJ;
+
+    CtrlStreamFeed(stream, StreamArrayNext, slicer, StreamArrayRelease);
+}
+
+/**
+ * @brief Verb acknowledging the chunks received from a stream:
+ * { "stream": 12, "ack": 3 } once the chunks up to seq 2 are handled, or
+ * { "stream": 12, "cancel": true } to drop it.
+ *
+ * @param request AFB request with the JSON arguments if the request got some.
+ */
+void CtrlStreamAckRequest(afb_req_t request)
+{
+    CtrlSessionT *session = CtrlSessionGet(request, 0);
+    CtrlStreamT *stream;
+    int id = 0, ack = -1, cancel = 0;
+
+    if (wrap_json_unpack(afb_req_json(request), "{si,s?i,s?b}", "stream", &id, "ack", &ack, "cancel", &cancel)) {
+        AFB_ReqFail(request, "invalid-args", "Expect { \"stream\": id, \"ack\": count } or { \"stream\": id, \"cancel\": true }");
+        return;
+    }
+
+    pthread_mutex_lock(&CtrlStreamsLock);
+    for (stream = CtrlStreams; stream && stream->id != (unsigned) id; stream = stream->next)
+        ;
+    /* other sessions can not tell a stream of another client exists */
+    if (!stream || !session || stream->session != session->id) {
+        pthread_mutex_unlock(&CtrlStreamsLock);
+        AFB_ReqFailF(request, "unknown-stream", "No stream %d, it is over or was dropped", id);
+        return;
+    }
+
+    stream->activity = CtrlNowUsec();
+    if (cancel && !stream->producer)
+        stream->cancelled = 1;
+    else if (cancel)
+        StreamClose(stream);
+    else if (ack > stream->acked && ack <= stream->seq) {
+        stream->acked = ack;
+        StreamPump(stream);
+    }
+    pthread_mutex_unlock(&CtrlStreamsLock);
+
+    AFB_ReqSuccess(request, NULL, NULL);
+}
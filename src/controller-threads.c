@@ -0,0 +1,421 @@
+/*
+ * Copyright (C) 2018 "IoT.bzh"
+ * Author Romain Forlot <romain@iot.bzh>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+#include "controller-binding.h"
+
+#define THREADS_MAX_RECORDS 64
+
+/* A placement applied to the threads of a role */
+typedef struct {
+    const char *uid;
+    const char *cpus;
+    cpu_set_t cpuset;
+    int policy;
+    const char *policyName;
+    int priority;
+    int nice;
+    int hasNice;
+} CtrlThreadClassT;
+
+/* What was applied to one controller's thread, for the stats verb */
+typedef struct {
+    const char *role;
+    const char *klass;
+    pid_t tid;
+    int error;
+    const char *failed;
+} CtrlThreadRecordT;
+
+/* A timer (re)arming handed over to the binder, 0 disarms it */
+typedef struct {
+    afb_api_t api;
+    sd_event_source *timer;
+    uint64_t usec;
+} CtrlTimerArmT;
+
+typedef struct CtrlDispatchItemS {
+    struct CtrlDispatchItemS *next;
+    afb_api_t api;
+    char *label;
+    json_object *eventJ;
+    uint64_t queued;
+} CtrlDispatchItemT;
+
+static const struct {
+    const char *name;
+    int policy;
+} CtrlThreadPolicies[] = {
+    { "other", SCHED_OTHER },
+    { "batch", SCHED_BATCH },
+    { "idle", SCHED_IDLE },
+    { "fifo", SCHED_FIFO },
+    { "rr", SCHED_RR },
+};
+
+static CtrlThreadClassT *CtrlThreadClasses = NULL;
+static int CtrlThreadClassesCount = 0;
+static json_object *CtrlThreadRolesJ = NULL;
+static CtrlThreadRecordT CtrlThreadRecords[THREADS_MAX_RECORDS];
+static int CtrlThreadRecordsCount = 0;
+static pthread_mutex_t CtrlThreadLock = PTHREAD_MUTEX_INITIALIZER;
+
+static int CtrlDispatchIsolated = 0;
+static CtrlDispatchItemT *CtrlDispatchHead = NULL;
+static CtrlDispatchItemT **CtrlDispatchTail = &CtrlDispatchHead;
+static pthread_mutex_t CtrlDispatchLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t CtrlDispatchCond = PTHREAD_COND_INITIALIZER;
+
+static CtrlThreadClassT *ThreadClassFind(const char *uid)
+{
+    for (int idx = 0; uid && idx < CtrlThreadClassesCount; idx++) {
+        if (!strcmp(CtrlThreadClasses[idx].uid, uid))
+            return &CtrlThreadClasses[idx];
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Apply the placement configured for a role to the calling thread:
+ * CPU set, scheduling policy and priority, nice level. Failures are kept for
+ * the stats verb, the thread keeps running with its default placement. Every
+ * thread started by the controller calls it first.
+ *
+ * @param role the thread role, ie: "dispatch", "sinks", "lanes", "fanout".
+ * @return int 0 if OK or nothing configured, other if not.
+ */
+int CtrlThreadApply(const char *role)
+{
+    json_object *classJ = NULL;
+    CtrlThreadClassT *klass;
+    CtrlThreadRecordT record = { .role = role, .tid = (pid_t) syscall(SYS_gettid) };
+    struct sched_param param;
+
+    if (!json_object_object_get_ex(CtrlThreadRolesJ, role, &classJ))
+        return 0;
+
+    klass = ThreadClassFind(json_object_get_string(classJ));
+    record.klass = klass ? klass->uid : json_object_get_string(classJ);
+    if (!klass) {
+        record.error = ENOENT;
+        record.failed = "class";
+    }
+    else if (klass->cpus && (record.error = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &klass->cpuset))) {
+        record.failed = "cpus";
+    }
+    else {
+        param.sched_priority = klass->priority;
+        if (klass->policyName && (record.error = pthread_setschedparam(pthread_self(), klass->policy, &param))) {
+            record.failed = "policy";
+        }
+        else if (klass->hasNice && setpriority(PRIO_PROCESS, (id_t) record.tid, klass->nice)) {
+            record.error = errno;
+            record.failed = "nice";
+        }
+    }
+
+    pthread_mutex_lock(&CtrlThreadLock);
+    if (CtrlThreadRecordsCount < THREADS_MAX_RECORDS)
+        CtrlThreadRecords[CtrlThreadRecordsCount++] = record;
+    pthread_mutex_unlock(&CtrlThreadLock);
+
+    return record.error ? ERROR : 0;
+}
+
+/**
+ * @brief Verb returning the controller's statistics, currently the placement
+ * of its threads.
+ *
+ * @param request AFB request with the JSON arguments if the request got some.
+ */
+void CtrlStatsRequest(afb_req_t request)
+{
+    json_object *threadsJ = json_object_new_array(), *threadJ, *responseJ;
+    CtrlThreadClassT *klass;
+    char cpus[CPU_SETSIZE * 4];
+    cpu_set_t cpuset;
+    int len;
+
+    pthread_mutex_lock(&CtrlThreadLock);
+    for (int idx = 0; idx < CtrlThreadRecordsCount; idx++) {
+        CtrlThreadRecordT *record = &CtrlThreadRecords[idx];
+        klass = ThreadClassFind(record->klass);
+
+        /* effective CPU set, as the kernel reports it */
+        len = 0;
+        cpus[0] = '\0';
+        if (!sched_getaffinity(record->tid, sizeof(cpuset), &cpuset)) {
+            for (int cpu = 0; cpu < CPU_SETSIZE && len < (int) sizeof(cpus) - 8; cpu++) {
+                if (CPU_ISSET(cpu, &cpuset))
+                    len += snprintf(cpus + len, sizeof(cpus) - (size_t) len, len ? ",%d" : "%d", cpu);
+            }
+        }
+
+        wrap_json_pack(&threadJ, "{ss,si,ss,ss,s?s,s?s}",
+                       "role", record->role,
+                       "tid", (int) record->tid,
+                       "class", record->klass,
+                       "cpus", cpus,
+                       "policy", klass ? klass->policyName : NULL,
+                       "error", record->error ? record->failed : NULL);
+        if (record->error)
+            json_object_object_add(threadJ, "reason", json_object_new_string(strerror(record->error)));
+        json_object_array_add(threadsJ, threadJ);
+    }
+    pthread_mutex_unlock(&CtrlThreadLock);
+
+    wrap_json_pack(&responseJ, "{so,sb}", "threads", threadsJ, "isolated-dispatch", CtrlDispatchIsolated);
+    AFB_ReqSuccess(request, responseJ, NULL);
+}
+
+static void TimerArmNow(sd_event_source *timer, uint64_t usec)
+{
+    if (!usec) {
+        sd_event_source_set_enabled(timer, SD_EVENT_OFF);
+        return;
+    }
+
+    sd_event_source_set_time(timer, usec);
+    sd_event_source_set_enabled(timer, SD_EVENT_ONESHOT);
+}
+
+static void TimerArmJob(int signum, void *arg)
+{
+    CtrlTimerArmT *arm = (CtrlTimerArmT *) arg;
+
+    /* taking the loop for this binder thread */
+    if (!signum && afb_api_get_event_loop(arm->api))
+        TimerArmNow(arm->timer, arm->usec);
+    free(arm);
+}
+
+/**
+ * @brief Arm a one shot timer of the binder's loop, or disarm it. The loop
+ * is not thread safe and neither the controller's threads nor the binder's
+ * job threads running controls are known to hold it: the arming is always
+ * queued as a binder job taking the loop, in order for a given timer. A late
+ * arming only costs a spurious wake up, timer callbacks check their state
+ * again.
+ *
+ * @param api the API handle owning the timer.
+ * @param timer the timer, living as long as the configuration.
+ * @param usec the CLOCK_MONOTONIC expiry, 0 to disarm the timer.
+ */
+void CtrlTimerArm(afb_api_t api, sd_event_source *timer, uint64_t usec)
+{
+    CtrlTimerArmT *arm = malloc(sizeof(CtrlTimerArmT));
+
+    arm->api = api;
+    arm->timer = timer;
+    arm->usec = usec;
+    if (afb_api_queue_job(api, TimerArmJob, arm, timer, 0) < 0) {
+        AFB_API_ERROR(api, "CtrlTimerArm: fail to queue a timer arming");
+        free(arm);
+    }
+}
+
+static void *DispatchThread(void *arg)
+{
+    CtrlDispatchItemT *item;
+
+    CtrlThreadApply("dispatch");
+
+    for (;;) {
+        pthread_mutex_lock(&CtrlDispatchLock);
+        while (!CtrlDispatchHead)
+            pthread_cond_wait(&CtrlDispatchCond, &CtrlDispatchLock);
+        item = CtrlDispatchHead;
+        CtrlDispatchHead = item->next;
+        if (!CtrlDispatchHead)
+            CtrlDispatchTail = &CtrlDispatchHead;
+        pthread_mutex_unlock(&CtrlDispatchLock);
+
+        CtrlShedQueueDelay(item->queued);
+        CtrlDispatchRun(item->api, item->label, item->eventJ);
+        json_object_put(item->eventJ);
+        free(item->label);
+        free(item);
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Hand an event over to the isolated dispatch thread, when configured.
+ *
+ * @param api the API handle receiving the event.
+ * @param evtLabel the event label.
+ * @param eventJ the event payload, still owned and maybe serialized by the
+ * binder: the dispatch thread gets a copy.
+ * @return int 1 if the event was handed over, 0 if it must be dispatched by
+ * the caller.
+ */
+int CtrlDispatchHandOver(afb_api_t api, const char *evtLabel, json_object *eventJ)
+{
+    CtrlDispatchItemT *item;
+
+    if (!CtrlDispatchIsolated)
+        return 0;
+
+    item = malloc(sizeof(CtrlDispatchItemT));
+    item->next = NULL;
+    item->api = api;
+    item->label = strdup(evtLabel);
+    item->eventJ = CtrlJsonCopy(eventJ);
+    item->queued = CtrlNowUsec();
+
+    pthread_mutex_lock(&CtrlDispatchLock);
+    *CtrlDispatchTail = item;
+    CtrlDispatchTail = &item->next;
+    pthread_cond_signal(&CtrlDispatchCond);
+    pthread_mutex_unlock(&CtrlDispatchLock);
+
+    return 1;
+}
+
+static int ThreadCpusParse(const char *cpus, cpu_set_t *cpuset)
+{
+    char *end;
+    long first, last;
+
+    CPU_ZERO(cpuset);
+    while (*cpus) {
+        first = last = strtol(cpus, &end, 10);
+        if (end == cpus)
+            return ERROR;
+        if (*end == '-') {
+            cpus = end + 1;
+            last = strtol(cpus, &end, 10);
+            if (end == cpus)
+                return ERROR;
+        }
+        if (first < 0 || last < first || last >= CPU_SETSIZE)
+            return ERROR;
+        for (long cpu = first; cpu <= last; cpu++)
+            CPU_SET((int) cpu, cpuset);
+        if (*end == ',')
+            end++;
+        else if (*end)
+            return ERROR;
+        cpus = end;
+    }
+
+    return CPU_COUNT(cpuset) ? 0 : ERROR;
+}
+
+static int ThreadClassLoad(afb_api_t api, CtrlThreadClassT *klass, const char *uid, json_object *classJ)
+{
+    size_t idx;
+
+    klass->uid = uid;
+    klass->nice = 0;
+    klass->hasNice = json_object_object_get_ex(classJ, "nice", NULL);
+
+    if (wrap_json_unpack(classJ, "{s?s,s?s,s?i,s?i}",
+                         "cpus", &klass->cpus,
+                         "policy", &klass->policyName,
+                         "priority", &klass->priority,
+                         "nice", &klass->nice)) {
+        AFB_API_ERROR(api, "ThreadClassLoad: invalid class '%s' %s", uid, json_object_to_json_string(classJ));
+        return ERROR;
+    }
+
+    if (klass->cpus && ThreadCpusParse(klass->cpus, &klass->cpuset)) {
+        AFB_API_ERROR(api, "ThreadClassLoad: class '%s' invalid cpus '%s'", uid, klass->cpus);
+        return ERROR;
+    }
+
+    if (klass->policyName) {
+        for (idx = 0; idx < sizeof(CtrlThreadPolicies) / sizeof(CtrlThreadPolicies[0]); idx++) {
+            if (!strcmp(CtrlThreadPolicies[idx].name, klass->policyName))
+                break;
+        }
+        if (idx == sizeof(CtrlThreadPolicies) / sizeof(CtrlThreadPolicies[0]) ||
+            klass->priority < sched_get_priority_min(CtrlThreadPolicies[idx].policy) ||
+            klass->priority > sched_get_priority_max(CtrlThreadPolicies[idx].policy)) {
+            AFB_API_ERROR(api, "ThreadClassLoad: class '%s' invalid policy '%s' or priority %d", uid,
+                          klass->policyName, klass->priority);
+            return ERROR;
+        }
+        klass->policy = CtrlThreadPolicies[idx].policy;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Controller's 'threads' section loader. Declares placement classes
+ * and assigns them to the controller's thread roles; the "dispatch" role also
+ * moves events dispatch to its own thread:
+ * { "classes": { "rt": { "cpus": "2-3", "policy": "fifo", "priority": 10 } },
+ *   "roles": { "dispatch": "rt", "sinks": "background" } }
+ *
+ * @param api the API handle being set up.
+ * @param section the section definition.
+ * @param threadsJ the JSON section, NULL when called at init time.
+ * @return int 0 if OK, other if not.
+ */
+int CtrlThreadsConfig(afb_api_t api, CtlSectionT *section, json_object *threadsJ)
+{
+    json_object *classesJ = NULL, *rolesJ = NULL;
+    pthread_t dispatcher;
+    int errcount = 0, idx = 0;
+
+    if (!threadsJ)
+        return 0;
+
+    if (wrap_json_unpack(threadsJ, "{so,so}", "classes", &classesJ, "roles", &rolesJ) ||
+        !json_object_is_type(classesJ, json_type_object) || !json_object_is_type(rolesJ, json_type_object)) {
+        AFB_API_ERROR(api, "CtrlThreadsConfig: 'threads' section needs 'classes' and 'roles' objects");
+        return ERROR;
+    }
+
+    CtrlThreadClassesCount = json_object_object_length(classesJ);
+    CtrlThreadClasses = calloc(CtrlThreadClassesCount, sizeof(CtrlThreadClassT));
+    json_object_object_foreach(classesJ, uid, classJ)
+        errcount += ThreadClassLoad(api, &CtrlThreadClasses[idx++], uid, classJ);
+
+    json_object_object_foreach(rolesJ, role, roleJ) {
+        if (!ThreadClassFind(json_object_get_string(roleJ))) {
+            AFB_API_ERROR(api, "CtrlThreadsConfig: role '%s' unknown class '%s'", role, json_object_get_string(roleJ));
+            errcount++;
+        }
+    }
+    CtrlThreadRolesJ = json_object_get(rolesJ);
+
+    if (!errcount && json_object_object_get_ex(rolesJ, "dispatch", NULL)) {
+        if (pthread_create(&dispatcher, NULL, DispatchThread, NULL)) {
+            AFB_API_ERROR(api, "CtrlThreadsConfig: fail to start the dispatch thread");
+            return ERROR;
+        }
+        pthread_detach(dispatcher);
+        CtrlDispatchIsolated = 1;
+    }
+
+    return errcount;
+}
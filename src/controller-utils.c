@@ -0,0 +1,614 @@
+/*
+ * Copyright (C) 2018 "IoT.bzh"
+ * Author Romain Forlot <romain@iot.bzh>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "controller-binding.h"
+
+/* Correlation ID of the request or event being processed by this thread */
+static __thread const char *CtrlCorrelation = NULL;
+
+/* The controller library's Lua state is shared by every thread running actions */
+static pthread_mutex_t CtrlLuaMutex = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+
+/**
+ * @brief Current monotonic time in microseconds.
+ */
+uint64_t CtrlNowUsec(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000 + (uint64_t) now.tv_nsec / 1000;
+}
+
+/**
+ * @brief FNV-1a 64 bits hash, the one hash of the controller: intern tables,
+ * events lanes, router ring, shared image and description version.
+ *
+ * @param data the bytes to hash.
+ * @param length the number of bytes.
+ * @return uint64_t the hash, fold or truncate it for smaller tables.
+ */
+uint64_t CtrlHash(const void *data, size_t length)
+{
+    const unsigned char *bytes = (const unsigned char *) data;
+    uint64_t hash = 14695981039346656037ull;
+
+    for (size_t idx = 0; idx < length; idx++) {
+        hash ^= bytes[idx];
+        hash *= 1099511628211ull;
+    }
+
+    return hash;
+}
+
+static uint32_t InternHash(const char *name)
+{
+    return (uint32_t) CtrlHash(name, strlen(name));
+}
+
+static const char Base64Chars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+/**
+ * @brief Encode bytes in padded standard base64.
+ *
+ * @param data the bytes to encode.
+ * @param len the number of bytes.
+ * @return char* the NUL terminated text, to free.
+ */
+char *CtrlBase64Encode(const unsigned char *data, size_t len)
+{
+    char *text = malloc(((len + 2) / 3) * 4 + 1), *out = text;
+    size_t idx;
+
+    for (idx = 0; idx + 2 < len; idx += 3) {
+        *out++ = Base64Chars[data[idx] >> 2];
+        *out++ = Base64Chars[((data[idx] & 0x03) << 4) | (data[idx + 1] >> 4)];
+        *out++ = Base64Chars[((data[idx + 1] & 0x0f) << 2) | (data[idx + 2] >> 6)];
+        *out++ = Base64Chars[data[idx + 2] & 0x3f];
+    }
+    if (idx < len) {
+        *out++ = Base64Chars[data[idx] >> 2];
+        if (idx + 1 < len) {
+            *out++ = Base64Chars[((data[idx] & 0x03) << 4) | (data[idx + 1] >> 4)];
+            *out++ = Base64Chars[(data[idx + 1] & 0x0f) << 2];
+        }
+        else {
+            *out++ = Base64Chars[(data[idx] & 0x03) << 4];
+            *out++ = '=';
+        }
+        *out++ = '=';
+    }
+    *out = '\0';
+
+    return text;
+}
+
+/**
+ * @brief Decode standard or url base64, padding optional.
+ *
+ * @param in the text to decode.
+ * @param len the text length.
+ * @param out where to decode, (len / 4) * 3 + 2 bytes are always enough.
+ * @param outLen the size of out.
+ * @return ssize_t the decoded length, -1 if invalid or out is too small.
+ */
+ssize_t CtrlBase64Decode(const char *in, size_t len, unsigned char *out, size_t outLen)
+{
+    uint32_t acc = 0;
+    size_t count = 0;
+    int bits = 0, value;
+
+    for (size_t idx = 0; idx < len && in[idx] != '='; idx++) {
+        char c = in[idx];
+        if (c >= 'A' && c <= 'Z') value = c - 'A';
+        else if (c >= 'a' && c <= 'z') value = c - 'a' + 26;
+        else if (c >= '0' && c <= '9') value = c - '0' + 52;
+        else if (c == '-' || c == '+') value = 62;
+        else if (c == '_' || c == '/') value = 63;
+        else return -1;
+
+        acc = acc << 6 | (uint32_t) value;
+        bits += 6;
+        if (bits >= 8) {
+            bits -= 8;
+            if (count == outLen)
+                return -1;
+            out[count++] = (unsigned char) (acc >> bits);
+        }
+    }
+
+    return (ssize_t) count;
+}
+
+static void InternGrow(CtrlInternT *intern)
+{
+    int idx, slot, size = intern->size ? intern->size * 2 : 16;
+
+    free(intern->slots);
+    intern->slots = malloc(size * sizeof(int));
+    for (idx = 0; idx < size; idx++)
+        intern->slots[idx] = -1;
+    intern->size = size;
+
+    for (idx = 0; idx < intern->count; idx++) {
+        slot = (int) (InternHash(intern->names[idx]) & (uint32_t) (size - 1));
+        while (intern->slots[slot] >= 0)
+            slot = (slot + 1) & (size - 1);
+        intern->slots[slot] = idx;
+    }
+
+    intern->names = realloc(intern->names, size * sizeof(char *));
+}
+
+/**
+ * @brief Look for a name in an intern table.
+ *
+ * @param intern the intern table.
+ * @param name the name to look for.
+ * @return int the name's id, or -1 if not interned.
+ */
+int CtrlInternFind(const CtrlInternT *intern, const char *name)
+{
+    int slot;
+
+    if (!intern->size || !name)
+        return -1;
+
+    slot = (int) (InternHash(name) & (uint32_t) (intern->size - 1));
+    while (intern->slots[slot] >= 0) {
+        if (!strcmp(intern->names[intern->slots[slot]], name))
+            return intern->slots[slot];
+        slot = (slot + 1) & (intern->size - 1);
+    }
+
+    return -1;
+}
+
+/**
+ * @brief Intern a name, giving it a dense id starting at 0. Intern tables are
+ * filled at load time only and are read-only afterward.
+ *
+ * @param intern the intern table.
+ * @param name the name to intern, it is duplicated if added.
+ * @return int the name's id.
+ */
+int CtrlInternAdd(CtrlInternT *intern, const char *name)
+{
+    int slot, id = CtrlInternFind(intern, name);
+
+    if (id >= 0)
+        return id;
+
+    if ((intern->count + 1) * 2 > intern->size)
+        InternGrow(intern);
+
+    id = intern->count++;
+    intern->names[id] = CtrlImageString(name);
+
+    slot = (int) (InternHash(name) & (uint32_t) (intern->size - 1));
+    while (intern->slots[slot] >= 0)
+        slot = (slot + 1) & (intern->size - 1);
+    intern->slots[slot] = id;
+
+    return id;
+}
+
+/**
+ * @brief Split a dotted field path, ie: "position.speed", into its keys.
+ *
+ * @param field the dotted path.
+ * @param depth filled with the number of keys.
+ * @return char** the NULL terminated keys array.
+ */
+char **CtrlJsonPathCompile(const char *field, int *depth)
+{
+    char **path, *keys = strdup(field), *saveptr = NULL, *key;
+    int count = 1;
+
+    for (const char *c = field; *c; c++) {
+        if (*c == '.')
+            count++;
+    }
+
+    path = calloc(count + 1, sizeof(char *));
+    count = 0;
+    for (key = strtok_r(keys, ".", &saveptr); key; key = strtok_r(NULL, ".", &saveptr))
+        path[count++] = key;
+
+    *depth = count;
+    return path;
+}
+
+/**
+ * @brief Walk a compiled field path through a JSON object.
+ *
+ * @return json_object* the value found, or NULL.
+ */
+json_object *CtrlJsonPathGet(json_object *objJ, char **path, int depth)
+{
+    for (int idx = 0; idx < depth && objJ; idx++) {
+        if (!json_object_object_get_ex(objJ, path[idx], &objJ))
+            return NULL;
+    }
+
+    return objJ;
+}
+
+/* Frozen containers keep their text, shared with the original */
+static int JsonCopyShallow(json_object *srcJ, json_object *parentJ, const char *key, size_t index, json_object **dstJ)
+{
+    void *text;
+    int rc = json_c_shallow_copy_default(srcJ, parentJ, key, index, dstJ);
+
+    if (rc < 1 || (!json_object_is_type(srcJ, json_type_object) && !json_object_is_type(srcJ, json_type_array)) ||
+        !(text = json_object_get_userdata(srcJ)))
+        return rc;
+
+    json_object_set_serializer(*dstJ, json_object_userdata_to_json_string, text, NULL);
+    return 2;
+}
+
+/**
+ * @brief Deep copy a JSON object to hand it to another thread, json-c
+ * reference counts and serialization buffers not being thread safe. Frozen
+ * parts of the copy keep serializing their frozen text, so the original must
+ * outlive it: frozen objects live as long as the configuration.
+ *
+ * @param srcJ the object to copy, only read, ownership is kept by the caller.
+ * @return json_object* a new object nobody else references, NULL if srcJ is.
+ */
+json_object *CtrlJsonCopy(json_object *srcJ)
+{
+    json_object *copyJ = NULL;
+
+    if (srcJ && json_object_deep_copy(srcJ, &copyJ, JsonCopyShallow))
+        return NULL;
+
+    return copyJ;
+}
+
+static const char *ConditionOps[] = {
+    [CTRL_OP_EQ] = "==",
+    [CTRL_OP_NE] = "!=",
+    [CTRL_OP_LT] = "<",
+    [CTRL_OP_LE] = "<=",
+    [CTRL_OP_GT] = ">",
+    [CTRL_OP_GE] = ">=",
+    [CTRL_OP_EXISTS] = "exists",
+};
+
+/**
+ * @brief Compile one condition: { "field": "a.b", "op": ">", "value": 10 }.
+ * Without "op" the condition checks the field existence.
+ *
+ * @param api the API handle used for logging.
+ * @param condition the condition to fill.
+ * @param conditionJ the JSON description.
+ * @return int 0 if OK, other if not.
+ */
+int CtrlConditionLoad(afb_api_t api, CtrlConditionT *condition, json_object *conditionJ)
+{
+    const char *field = NULL, *op = "exists";
+    json_object *valueJ = NULL;
+    int idx;
+
+    if (wrap_json_unpack(conditionJ, "{ss,s?s,s?o}", "field", &field, "op", &op, "value", &valueJ)) {
+        AFB_API_ERROR(api, "CtrlConditionLoad: invalid condition %s", json_object_to_json_string(conditionJ));
+        return ERROR;
+    }
+
+    for (idx = 0; idx < (int) (sizeof(ConditionOps) / sizeof(ConditionOps[0])); idx++) {
+        if (!strcasecmp(op, ConditionOps[idx]))
+            break;
+    }
+    if (idx == (int) (sizeof(ConditionOps) / sizeof(ConditionOps[0]))) {
+        AFB_API_ERROR(api, "CtrlConditionLoad: unknown operator '%s'", op);
+        return ERROR;
+    }
+
+    if (idx != CTRL_OP_EXISTS && !valueJ) {
+        AFB_API_ERROR(api, "CtrlConditionLoad: operator '%s' on '%s' needs a value", op, field);
+        return ERROR;
+    }
+
+    condition->op = (CtrlConditionOpT) idx;
+    condition->path = CtrlJsonPathCompile(field, &condition->depth);
+    condition->valueJ = json_object_get(valueJ);
+    condition->number = json_object_get_double(valueJ);
+    condition->isNumber = json_object_is_type(valueJ, json_type_int) || json_object_is_type(valueJ, json_type_double);
+
+    return 0;
+}
+
+/**
+ * @brief Compile a condition or an array of conditions, all of which must
+ * match.
+ *
+ * @param count filled with the number of compiled conditions.
+ * @return CtrlConditionT* conditions array, NULL on error or when conditionsJ is
+ * NULL.
+ */
+CtrlConditionT *CtrlConditionsLoad(afb_api_t api, json_object *conditionsJ, int *count)
+{
+    CtrlConditionT *conditions;
+    int idx, isArray = json_object_is_type(conditionsJ, json_type_array);
+
+    *count = 0;
+    if (!conditionsJ)
+        return NULL;
+
+    *count = isArray ? (int) json_object_array_length(conditionsJ) : 1;
+    conditions = calloc(*count, sizeof(CtrlConditionT));
+    for (idx = 0; idx < *count; idx++) {
+        if (CtrlConditionLoad(api, &conditions[idx], isArray ? json_object_array_get_idx(conditionsJ, idx) : conditionsJ)) {
+            free(conditions);
+            *count = -1;
+            return NULL;
+        }
+    }
+
+    return conditions;
+}
+
+/**
+ * @brief Evaluate a compiled condition against an event or request payload.
+ *
+ * @return int 1 if the condition holds, 0 if not.
+ */
+int CtrlConditionEval(const CtrlConditionT *condition, json_object *payloadJ)
+{
+    json_object *fieldJ = CtrlJsonPathGet(payloadJ, condition->path, condition->depth);
+    double diff;
+
+    if (!fieldJ)
+        return 0;
+
+    if (condition->op == CTRL_OP_EXISTS)
+        return 1;
+
+    if (condition->isNumber)
+        diff = json_object_get_double(fieldJ) - condition->number;
+    else if (json_object_is_type(fieldJ, json_type_string) && json_object_is_type(condition->valueJ, json_type_string))
+        diff = strcmp(json_object_get_string(fieldJ), json_object_get_string(condition->valueJ));
+    else
+        diff = json_object_equal(fieldJ, condition->valueJ) ? 0 : 1;
+
+    switch (condition->op) {
+        case CTRL_OP_EQ: return diff == 0;
+        case CTRL_OP_NE: return diff != 0;
+        case CTRL_OP_LT: return diff < 0;
+        case CTRL_OP_LE: return diff <= 0;
+        case CTRL_OP_GT: return diff > 0;
+        case CTRL_OP_GE: return diff >= 0;
+        default: return 0;
+    }
+}
+
+/**
+ * @brief Evaluate a conditions array, all conditions must hold.
+ */
+int CtrlConditionsEval(const CtrlConditionT *conditions, int count, json_object *payloadJ)
+{
+    for (int idx = 0; idx < count; idx++) {
+        if (!CtrlConditionEval(&conditions[idx], payloadJ))
+            return 0;
+    }
+
+    return 1;
+}
+
+/**
+ * @brief Serialize Lua actions run from several threads, Lua actions may call
+ * back into the controller so the lock is recursive.
+ */
+void CtrlLuaLock(void)
+{
+    pthread_mutex_lock(&CtrlLuaMutex);
+}
+
+void CtrlLuaUnlock(void)
+{
+    pthread_mutex_unlock(&CtrlLuaMutex);
+}
+
+/**
+ * @brief Execute one action, holding the Lua lock for Lua actions.
+ *
+ * @param source the action's source.
+ * @param action the action.
+ * @param queryJ the action's query, ownership is kept by the caller.
+ */
+void CtrlActionExec(CtlSourceT *source, CtlActionT *action, json_object *queryJ)
+{
+    if (action->type == CTL_TYPE_LUA)
+        CtrlLuaLock();
+    ActionExecOne(source, action, queryJ);
+    if (action->type == CTL_TYPE_LUA)
+        CtrlLuaUnlock();
+}
+
+/**
+ * @brief Query to give to an action. The controller library merges the args
+ * of API actions into their query: those get a new object overlaying their
+ * args on references to the query members, the query tree itself is neither
+ * copied nor modified. Other actions share the query.
+ *
+ * @param action the action.
+ * @param queryJ the caller's query, ownership is kept by the caller.
+ * @return json_object* a new reference on the action's query.
+ */
+json_object *CtrlActionQuery(CtlActionT *action, json_object *queryJ)
+{
+    json_object *overlayJ;
+
+    if (action->type != CTL_TYPE_API || !json_object_is_type(action->argsJ, json_type_object) ||
+        !json_object_is_type(queryJ, json_type_object))
+        return json_object_get(queryJ);
+
+    overlayJ = json_object_new_object();
+    json_object_object_foreach(queryJ, qkey, qvalJ)
+        json_object_object_add(overlayJ, qkey, json_object_get(qvalJ));
+    json_object_object_foreach(action->argsJ, akey, avalJ)
+        json_object_object_add(overlayJ, akey, json_object_get(avalJ));
+
+    return overlayJ;
+}
+
+/**
+ * @brief Execute every action of an actions array as returned by ActionConfig,
+ * out of any request context.
+ *
+ * @param api the controller API handle.
+ * @param uid the source uid given to the actions.
+ * @param actions the NULL uid terminated actions array, could be NULL.
+ * @param queryJ the actions' query, ownership is kept by the caller.
+ */
+void CtrlActionsExec(afb_api_t api, const char *uid, CtlActionT *actions, json_object *queryJ)
+{
+    CtlSourceT source;
+
+    if (!actions)
+        return;
+
+    memset(&source, 0, sizeof(source));
+    source.uid = uid;
+    source.api = api;
+
+    for (int idx = 0; actions[idx].uid; idx++) {
+        json_object *actionQueryJ = CtrlActionQuery(&actions[idx], queryJ);
+        CtrlActionExec(&source, &actions[idx], actionQueryJ);
+        json_object_put(actionQueryJ);
+    }
+}
+
+/**
+ * @brief Get the controller's state of the request's client session. Its id
+ * tells the sessions apart, never reused unlike the state's address.
+ *
+ * @param request the request.
+ * @param create whether to create the state if the session has none yet.
+ * @return CtrlSessionT* the session state, NULL if none.
+ */
+CtrlSessionT *CtrlSessionGet(afb_req_t request, int create)
+{
+    static uint64_t sequence = 0;
+    CtrlSessionT *session = (CtrlSessionT *) afb_req_context_get(request);
+
+    if (!session && create) {
+        session = calloc(1, sizeof(CtrlSessionT));
+        session->id = __atomic_add_fetch(&sequence, 1, __ATOMIC_RELAXED);
+        afb_req_context_set(request, session, free);
+    }
+
+    return session;
+}
+
+/**
+ * @brief Get the correlation ID carried by a request or event payload, or
+ * assign a new one, unique across controllers' processes.
+ *
+ * @param argsJ the request arguments or event payload, could be NULL.
+ * @param buffer where to build a new ID, CTRL_CORRELATION_LEN bytes long.
+ * @return const char* the correlation ID, valid as long as argsJ and buffer.
+ */
+const char *CtrlCorrelationFrom(json_object *argsJ, char *buffer)
+{
+    static uint64_t sequence = 0;
+    static uint32_t boot = 0;
+    json_object *cidJ;
+
+    if (json_object_object_get_ex(argsJ, "correlation", &cidJ) && json_object_is_type(cidJ, json_type_string))
+        return json_object_get_string(cidJ);
+
+    if (!__atomic_load_n(&boot, __ATOMIC_RELAXED))
+        __atomic_store_n(&boot, (uint32_t) time(NULL), __ATOMIC_RELAXED);
+
+    snprintf(buffer, CTRL_CORRELATION_LEN, "%x-%x-%llx", (unsigned) getpid(), boot,
+             (unsigned long long) __atomic_add_fetch(&sequence, 1, __ATOMIC_RELAXED));
+    return buffer;
+}
+
+/**
+ * @brief Set the correlation ID of the work processed by the calling thread.
+ *
+ * @param cid the correlation ID, NULL to clear it.
+ * @return const char* the previous ID, to restore once the work is done.
+ */
+const char *CtrlCorrelationSet(const char *cid)
+{
+    const char *previous = CtrlCorrelation;
+
+    CtrlCorrelation = cid;
+    return previous;
+}
+
+/**
+ * @brief Correlation ID of the work processed by the calling thread.
+ */
+const char *CtrlCorrelationGet(void)
+{
+    return CtrlCorrelation;
+}
+
+/**
+ * @brief Request arguments carrying a correlation ID. The caller's arguments
+ * are left untouched, an in-process caller may still use them: a new top
+ * level object shares their members and adds the 'correlation' field.
+ *
+ * @param argsJ the request arguments, ownership is kept by the caller.
+ * @param cid the correlation ID.
+ * @return json_object* a new reference on the arguments to use.
+ */
+json_object *CtrlCorrelationArgs(json_object *argsJ, const char *cid)
+{
+    json_object *copyJ;
+
+    if (!json_object_is_type(argsJ, json_type_object) || json_object_object_get_ex(argsJ, "correlation", NULL))
+        return json_object_get(argsJ);
+
+    copyJ = json_object_new_object();
+    json_object_object_foreach(argsJ, key, valJ)
+        json_object_object_add(copyJ, key, json_object_get(valJ));
+    json_object_object_add(copyJ, "correlation", json_object_new_string(cid));
+
+    return copyJ;
+}
+
+/**
+ * @brief Add the current correlation ID to an emitted object, unless it
+ * already carries one.
+ *
+ * @param objJ the event payload or subcall arguments.
+ * @return json_object* objJ.
+ */
+json_object *CtrlCorrelationTag(json_object *objJ)
+{
+    if (CtrlCorrelation && json_object_is_type(objJ, json_type_object) &&
+        !json_object_object_get_ex(objJ, "correlation", NULL))
+        json_object_object_add(objJ, "correlation", json_object_new_string(CtrlCorrelation));
+
+    return objJ;
+}